@@ -0,0 +1,33 @@
+// replacement global operator new/delete counting allocations for
+// run_stats (see stats.h); only linked into the watcor executable
+#include "stats.h"
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// mark the counters as working before main() starts
+struct hook {
+    hook() { allocation_counters().hooked = true; }
+} hook_installed;
+
+} // namespace
+
+void *operator new(std::size_t n) {
+    alloc_counters &a{ allocation_counters() };
+    if (a.active.load(std::memory_order_relaxed)) {
+        a.count.fetch_add(1, std::memory_order_relaxed);
+        a.bytes.fetch_add(n, std::memory_order_relaxed);
+    }
+    void *p{ std::malloc(n ? n : 1) };
+    if (!p) { throw std::bad_alloc(); }
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
@@ -0,0 +1,202 @@
+#include "batch.h"
+#include "codec.h"
+#include "gro.h"
+#include "membuf.h"
+#include "parallel.h"
+#include "uring.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace {
+
+// outcome of one file; one per file in flight, reused
+struct batch_slot {
+    std::string output;  // converted file (for standard output)
+    std::string message; // error message ("": success)
+    bool format_error{ false }; // the error is a gro_error
+    long waters{ 0 };    // water molecules converted
+};
+
+bool is_directory(const std::string &name) {
+    struct stat st;
+    return stat(name.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// length of a gro file name without the extension (0: not a gro file);
+// compressed files (.gro.gz, .gro.zst) count as gro files
+size_t gro_stem(const std::string &n) {
+    size_t e{ n.size() };
+    if (codec_of_name(n) == CODEC_GZIP) { e -= 3; }
+    if (codec_of_name(n) == CODEC_ZSTD) { e -= 4; }
+    if (e > 4 && n.compare(e - 4, 4, ".gro") == 0) { return e - 4; }
+    return 0;
+}
+
+// the .gro files in a directory, in name order
+std::vector<std::string> gro_files(const std::string &dir) {
+    DIR *d{ opendir(dir.c_str()) };
+    if (!d) {
+        throw(std::runtime_error("cannot read directory '" + dir + "': "
+                                 + strerror(errno)));
+    }
+    std::vector<std::string> names;
+    while (dirent *e = readdir(d)) {
+        std::string n{ e->d_name };
+        if (gro_stem(n) > 0) { names.push_back(n); }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    std::string prefix{ dir };
+    if (prefix.back() != '/') { prefix += '/'; }
+    for (auto &n: names) { n = prefix + n; }
+    return names;
+}
+
+// convert one file into slot s (never throws)
+void convert_file(const batch_item &item, const model &wm, batch_slot &s,
+                  run_stats *stats, bool uring) {
+    s.output.clear();
+    s.message.clear();
+    s.format_error = false;
+    s.waters = 0;
+    try {
+        text_file lines{ item.in, uring };
+        if (lines.size() < 1) {
+            s.message = "cannot process input: '" + item.in + "' is empty";
+            s.format_error = true;
+            return;
+        }
+        string_buffer sb{ s.output };
+        std::ostream os{ &sb };
+        s.waters = static_cast<long>(process_gro(os, lines, wm, 1, stats));
+        if (item.out.empty()) { return; }
+        codec_t c{ codec_of_name(item.out) };
+        if (!codec_supported(c)) {
+            s.message = "cannot write '" + item.out + "': " + codec_name(c)
+                        + " compression is not supported by this build";
+            return;
+        }
+        if (uring) {
+            try {
+                uring_ostream uf{ item.out };
+                if (c == CODEC_NONE) {
+                    uf.write(s.output.data(),
+                             static_cast<std::streamsize>(s.output.size()));
+                } else {
+                    compress(c, s.output.data(), s.output.size(), uf);
+                }
+                uf.finish();
+            }
+            catch (const std::runtime_error &e) {
+                s.message = e.what(); // about the output file
+            }
+            return;
+        }
+        std::ofstream of{ item.out, std::ios::binary };
+        if (!of.good()) {
+            s.message = "cannot open '" + item.out + "': " + strerror(errno);
+            return;
+        }
+        if (c == CODEC_NONE) {
+            of.write(s.output.data(),
+                     static_cast<std::streamsize>(s.output.size()));
+        } else {
+            compress(c, s.output.data(), s.output.size(), of);
+        }
+        of.close();
+        if (!of) { s.message = "error writing '" + item.out + "'"; }
+    }
+    catch (const gro_error &e) {
+        s.message = std::string(e.what()) + "\n  in '" + item.in + "'";
+        s.format_error = true;
+    }
+    catch (const std::runtime_error &e) {
+        s.message = e.what();
+        if (s.message.find(item.in) == std::string::npos) {
+            s.message += "\n  in '" + item.in + "'";
+        }
+    }
+}
+
+} // namespace
+
+std::string batch_output_name(const std::string &pattern,
+                              const std::string &in) {
+    if (pattern.empty()) { return ""; }
+    size_t slash{ in.rfind('/') };
+    std::string base{ slash == std::string::npos ? in : in.substr(slash + 1) };
+    size_t stem{ gro_stem(base) };
+    if (stem > 0) { base.erase(stem); }
+    std::string out;
+    size_t p{ 0 };
+    for (size_t q = pattern.find("{}"); q != std::string::npos;
+         q = pattern.find("{}", p)) {
+        out += pattern.substr(p, q - p) + base;
+        p = q + 2;
+    }
+    return out + pattern.substr(p);
+}
+
+void batch_add_files(const std::vector<std::string> &names,
+                     const std::string &pattern,
+                     std::vector<batch_item> &items) {
+    for (const auto &n: names) {
+        if (is_directory(n)) {
+            for (const auto &f: gro_files(n)) {
+                items.push_back(batch_item{ f,
+                                            batch_output_name(pattern, f) });
+            }
+        } else {
+            items.push_back(batch_item{ n, batch_output_name(pattern, n) });
+        }
+    }
+}
+
+void batch_add_manifest(std::istream &is, const std::string &pattern,
+                        std::vector<batch_item> &items) {
+    std::string l;
+    while (std::getline(is, l)) {
+        std::istringstream ls{ l };
+        batch_item item;
+        if (!(ls >> item.in) || item.in[0] == '#') { continue; }
+        if (!(ls >> item.out)) {
+            item.out = batch_output_name(pattern, item.in);
+        }
+        items.push_back(item);
+    }
+}
+
+batch_result run_batch(const std::vector<batch_item> &items, const model &wm,
+                       int threads, std::ostream &out, std::ostream &log,
+                       const std::string &prog, run_stats *stats,
+                       bool uring) {
+    // a file may be converted while up to 2 * threads earlier ones wait to
+    // be written: item i uses slot i % ahead, free once item i - ahead is
+    // consumed
+    size_t ahead{ 2 * static_cast<size_t>(threads > 0 ? threads : 1) };
+    std::vector<batch_slot> slots(std::min(ahead, items.size()));
+    batch_result r;
+    parallel_ordered(items.size(), threads, ahead, [&](size_t i) {
+        convert_file(items[i], wm, slots[i % ahead], stats, uring);
+    }, [&](size_t i) {
+        batch_slot &s{ slots[i % ahead] };
+        if (!s.message.empty()) {
+            log << prog << ": " << s.message << std::endl;
+            ++(s.format_error ? r.format_errors : r.other_errors);
+            return;
+        }
+        if (items[i].out.empty()) {
+            out.write(s.output.data(),
+                      static_cast<std::streamsize>(s.output.size()));
+        }
+        ++r.files;
+        r.waters += s.waters;
+    });
+    return r;
+}
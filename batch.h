@@ -0,0 +1,97 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include "model.h"
+#include "stats.h"
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/** \defgroup batch Batch conversion
+ * Conversion of many (small) gro files in one run, spread over a pool of
+ * threads. Every file is converted on one thread from an in-memory copy,
+ * into an output buffer that the thread reuses for its next file.
+ * Compressed files (.gro.gz, .gro.zst) are read and written like plain
+ * ones; output files are compressed according to their extension.
+ * @{
+ */
+
+//! One file of a batch
+struct batch_item {
+    std::string in;  //!< input file
+    std::string out; //!< output file ("": standard output)
+};
+
+//! Name of the output file for an input file
+/**
+ * \param pattern output name in which every "{}" is replaced by the base
+ *     name of the input without directory and .gro (.gro.gz, .gro.zst)
+ *     extension; "" means standard output
+ * \param in name of the input file
+ * \return the output file name ("" for standard output)
+ */
+std::string batch_output_name(const std::string &pattern,
+                              const std::string &in);
+
+//! Add the files named on the command line to a batch
+/**
+ * A directory stands for all the .gro files (also compressed) in it, in
+ * name order.
+ *
+ * \param names files or directories
+ * \param pattern output name pattern (see batch_output_name())
+ * \param[out] items list to add to
+ * \throws std::runtime_error if a directory cannot be read
+ */
+void batch_add_files(const std::vector<std::string> &names,
+                     const std::string &pattern,
+                     std::vector<batch_item> &items);
+
+//! Add the files of a manifest to a batch
+/**
+ * Each line holds an input file name, optionally followed by the name of
+ * its output file (else pattern is used); names are separated by blanks.
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * \param is the manifest
+ * \param pattern output name pattern (see batch_output_name())
+ * \param[out] items list to add to
+ */
+void batch_add_manifest(std::istream &is, const std::string &pattern,
+                        std::vector<batch_item> &items);
+
+//! Summary of a batch run
+struct batch_result {
+    size_t files{ 0 };         //!< files converted successfully
+    size_t format_errors{ 0 }; //!< files not in gro format (gro_error)
+    size_t other_errors{ 0 };  //!< other failures (I/O, bad water structure)
+    long waters{ 0 };          //!< water molecules converted
+};
+
+//! Convert the files of a batch
+/**
+ * Files are converted on up to threads threads. Output for standard
+ * output is written to out in the order of the items, whatever the number
+ * of threads. A file that fails is reported on log (in order, prefixed by
+ * prog) and does not stop the batch.
+ *
+ * \param items files to convert
+ * \param wm the water model to be used in the output (shared by all
+ *     threads)
+ * \param threads number of threads
+ * \param out destination of the output for standard output
+ * \param log destination of the error messages
+ * \param prog name of the program, for error messages
+ * \param stats if not nullptr, the phases of all conversions are recorded
+ * \param uring read and write the files through io_uring (see uring.h;
+ *     the caller checks io_ring::available())
+ * \return the numbers of files converted and failed
+ */
+batch_result run_batch(const std::vector<batch_item> &items, const model &wm,
+                       int threads, std::ostream &out, std::ostream &log,
+                       const std::string &prog, run_stats *stats = nullptr,
+                       bool uring = false);
+
+/**@}*/
+
+#endif
@@ -0,0 +1,488 @@
+// watcor_bench: throughput of the stages of a water model conversion,
+// on a given .gro file or on a reproducible synthetic one
+#include "model.h"
+#include "readall.h"
+#include "gro.h"
+#include "gro_writer.h"
+#include "parallel.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+namespace {
+
+const double pi{ 3.14159265358979323846 };
+
+//! Print unix style usage information
+void print_help(const std::string &a) {
+    std::cout << "Usage: " << a << " [-n atoms] [-S seed] [-r repeats] "
+              << "[-j N] [-o out.json] [infile]\n";
+    std::cout << "       " << a << " -g [-n atoms] [-S seed] [-V] outfile\n";
+    std::cout << "Measure the throughput of each stage of a conversion.\n\n";
+    std::cout << "Options:\n";
+    std::cout << "  -n atoms    size of the synthetic system (default 1000000)\n";
+    std::cout << "  -S seed     seed of the synthetic system (default 1)\n";
+    std::cout << "  -r repeats  runs of each stage, the fastest is reported "
+              << "(default 3)\n";
+    std::cout << "  -j N        threads for process_gro (0: all cores)\n";
+    std::cout << "  -o file     write the JSON report to file (default stdout)\n";
+    std::cout << "  -g          only generate the synthetic system into outfile\n";
+    std::cout << "  -V          no velocities in the generated file\n\n";
+    std::cout << "Without infile a synthetic system is generated in $TMPDIR "
+              << "(or /tmp)\nand removed afterwards.\n";
+}
+
+// ---- synthetic system ----
+
+// splitmix64: the same sequence on every platform
+class random_source {
+public:
+    explicit random_source(uint64_t seed) : state(seed) {}
+    uint64_t next() {
+        uint64_t z{ state += 0x9e3779b97f4a7c15ULL };
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    double uniform() { // [0, 1) with 53 random bits
+        return static_cast<double>(next() >> 11) / 9007199254740992.0;
+    }
+    double uniform(double a, double b) { return a + (b - a) * uniform(); }
+private:
+    uint64_t state;
+};
+
+// writes atom records in .gro format
+class gro_generator {
+public:
+    gro_generator(std::ostream &o, bool v) : os(o), velocities(v) {
+        buf.reserve(1 << 20);
+    }
+    ~gro_generator() { flush(); }
+
+    void line(const char *s) { buf += s; buf += '\n'; }
+
+    void atom(const char *res, const char *name,
+              const double x[3], random_source &rnd) {
+        char l[128];
+        int n{ std::snprintf(l, sizeof(l), "%5d%-5s%5s%5d%8.3f%8.3f%8.3f",
+                             static_cast<int>(resnr % 100000), res, name,
+                             static_cast<int>(atomnr % 100000),
+                             x[0], x[1], x[2]) };
+        if (velocities) {
+            n += std::snprintf(l + n, sizeof(l) - n, "%8.4f%8.4f%8.4f",
+                               rnd.uniform(-1.0, 1.0), rnd.uniform(-1.0, 1.0),
+                               rnd.uniform(-1.0, 1.0));
+        }
+        buf.append(l, static_cast<size_t>(n));
+        buf += '\n';
+        ++atomnr;
+        if (buf.size() >= (1 << 20)) { flush(); }
+    }
+
+    void next_residue() { ++resnr; }
+
+    void flush() {
+        os.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+        buf.clear();
+    }
+
+private:
+    std::ostream &os;
+    bool velocities;
+    std::string buf;
+    size_t resnr{ 1 };
+    size_t atomnr{ 1 };
+};
+
+// a random unit vector
+void random_direction(random_source &rnd, double u[3]) {
+    double z{ rnd.uniform(-1.0, 1.0) };
+    double phi{ rnd.uniform(0.0, 2.0 * pi) };
+    double r{ std::sqrt(1.0 - z * z) };
+    u[0] = r * std::cos(phi);
+    u[1] = r * std::sin(phi);
+    u[2] = z;
+}
+
+//! Write a reproducible synthetic .gro file
+/**
+ * About 15% of the residues are solute (1 to 8 atoms), the rest are waters:
+ * 3-site, 4-site (MW) and 5-site (LP1/LP2 or EP1/EP2) in random orientations
+ * near the experimental geometry, at roughly the density of liquid water.
+ */
+void generate(std::ostream &os, size_t natoms, uint64_t seed, bool vel) {
+    static const char *const solute[]{ "N", "CA", "C", "O", "CB", "CG", "CD",
+                                       "H" };
+    const double roh{ 0.09572 };
+    const double half_angle{ 104.52 / 2.0 * pi / 180.0 };
+    const double lp_angle{ 109.47 / 2.0 * pi / 180.0 };
+    const double box{ std::max(1.0, std::cbrt(natoms / 100.0)) };
+
+    random_source rnd{ seed };
+    gro_generator g{ os, vel };
+    g.line(("watcor_bench synthetic system seed " + std::to_string(seed)
+            + " t= 0.0").c_str());
+    char count[32];
+    std::snprintf(count, sizeof(count), "%5zu", natoms);
+    g.line(count);
+
+    size_t left{ natoms };
+    while (left > 0) {
+        double o[3]{ rnd.uniform(0.0, box), rnd.uniform(0.0, box),
+                     rnd.uniform(0.0, box) };
+        double r{ rnd.uniform() };
+        int sites{ r < 0.15 ? 0 : r < 0.6 ? 3 : r < 0.8 ? 4 : 5 };
+        if (static_cast<size_t>(sites) > left) { sites = 0; }
+        if (sites == 0) {
+            size_t n{ std::min<size_t>(left, 1 + rnd.next() % 8) };
+            double d[3];
+            random_direction(rnd, d);
+            for (size_t k = 0; k < n; ++k) {
+                double x[3]{ o[0] + 0.14 * k * d[0], o[1] + 0.14 * k * d[1],
+                             o[2] + 0.14 * k * d[2] };
+                g.atom("PRO", solute[k], x, rnd);
+            }
+            left -= n;
+        } else {
+            // bisector u, in-plane v and normal w
+            double u[3], t[3], v[3], w[3];
+            random_direction(rnd, u);
+            random_direction(rnd, t);
+            w[0] = u[1] * t[2] - u[2] * t[1];
+            w[1] = u[2] * t[0] - u[0] * t[2];
+            w[2] = u[0] * t[1] - u[1] * t[0];
+            double lw{ std::sqrt(w[0]*w[0] + w[1]*w[1] + w[2]*w[2]) };
+            if (lw < 1.0e-6) { continue; }
+            for (auto &c: w) { c /= lw; }
+            v[0] = w[1] * u[2] - w[2] * u[1];
+            v[1] = w[2] * u[0] - w[0] * u[2];
+            v[2] = w[0] * u[1] - w[1] * u[0];
+            double c{ roh * std::cos(half_angle) };
+            double s{ roh * std::sin(half_angle) };
+            double h1[3], h2[3];
+            for (int k = 0; k < 3; ++k) {
+                h1[k] = o[k] + c * u[k] + s * v[k];
+                h2[k] = o[k] + c * u[k] - s * v[k];
+            }
+            g.atom("SOL", "OW", o, rnd);
+            g.atom("SOL", "HW1", h1, rnd);
+            g.atom("SOL", "HW2", h2, rnd);
+            if (sites == 4) {
+                double m[3];
+                for (int k = 0; k < 3; ++k) { m[k] = o[k] + 0.015 * u[k]; }
+                g.atom("SOL", "MW", m, rnd);
+            } else if (sites == 5) {
+                bool ep{ (rnd.next() & 1) != 0 };
+                double cl{ 0.07 * std::cos(lp_angle) };
+                double sl{ 0.07 * std::sin(lp_angle) };
+                double l1[3], l2[3];
+                for (int k = 0; k < 3; ++k) {
+                    l1[k] = o[k] - cl * u[k] + sl * w[k];
+                    l2[k] = o[k] - cl * u[k] - sl * w[k];
+                }
+                g.atom("SOL", ep ? "EP1" : "LP1", l1, rnd);
+                g.atom("SOL", ep ? "EP2" : "LP2", l2, rnd);
+            }
+            left -= static_cast<size_t>(sites);
+        }
+        g.next_residue();
+    }
+    char b[64];
+    std::snprintf(b, sizeof(b), "%10.5f%10.5f%10.5f", box, box, box);
+    g.line(b);
+}
+
+// ---- measurements ----
+
+// discards everything written to it
+class null_buffer: public std::streambuf {
+protected:
+    std::streamsize xsputn(const char *, std::streamsize n) override {
+        return n;
+    }
+    int_type overflow(int_type c) override {
+        return traits_type::not_eof(c);
+    }
+};
+
+struct stage_result {
+    std::string name;
+    double seconds; // fastest run
+    size_t atoms;   // atoms handled by the stage
+    size_t bytes;   // input bytes handled by the stage
+};
+
+// fastest of repeats runs of f; setup (not timed) is called before each
+double best_time(int repeats, const std::function<void()> &setup,
+                 const std::function<void()> &f) {
+    double best{ 0.0 };
+    for (int r = 0; r < repeats; ++r) {
+        setup();
+        auto t0 = std::chrono::steady_clock::now();
+        f();
+        auto t1 = std::chrono::steady_clock::now();
+        double s{ std::chrono::duration<double>(t1 - t0).count() };
+        if (r == 0 || s < best) { best = s; }
+    }
+    return best;
+}
+
+std::string json_string(const std::string &s) {
+    std::string r{ "\"" };
+    for (char c: s) {
+        if (c == '"' || c == '\\') { r += '\\'; }
+        if (static_cast<unsigned char>(c) < 0x20) { r += ' '; continue; }
+        r += c;
+    }
+    return r + "\"";
+}
+
+void write_report(std::ostream &os, const std::string &file,
+                  const text_file &tf, const water_layout &wl, int threads,
+                  int repeats, const std::vector<stage_result> &st) {
+    char b[512];
+    os << "{\n";
+    os << "  \"file\": " << json_string(file) << ",\n";
+    os << "  \"bytes\": " << tf.bytes() << ",\n";
+    os << "  \"lines\": " << tf.size() << ",\n";
+    os << "  \"atoms\": " << wl.natoms << ",\n";
+    os << "  \"waters\": " << wl.first.size() << ",\n";
+    os << "  \"threads\": " << threads << ",\n";
+    os << "  \"repeats\": " << repeats << ",\n";
+    os << "  \"isa\": " << json_string(model::batch_isa()) << ",\n";
+    os << "  \"stages\": [\n";
+    for (size_t i = 0; i < st.size(); ++i) {
+        const stage_result &s{ st[i] };
+        double t{ s.seconds > 0.0 ? s.seconds : 1.0e-9 };
+        std::snprintf(b, sizeof(b),
+                      "    {\"stage\": %s, \"seconds\": %.6f, \"atoms\": %zu, "
+                      "\"bytes\": %zu, \"atoms_per_s\": %.0f, "
+                      "\"mb_per_s\": %.1f}%s\n",
+                      json_string(s.name).c_str(), s.seconds, s.atoms,
+                      s.bytes, s.atoms / t, s.bytes / t / 1.0e6,
+                      i + 1 < st.size() ? "," : "");
+        os << b;
+    }
+    os << "  ]\n}\n";
+}
+
+// run all stages on a file
+std::vector<stage_result> run(const std::string &name, int repeats,
+                              int threads, std::unique_ptr<text_file> &tf,
+                              water_layout &wl) {
+    std::vector<stage_result> st;
+    auto none = []() {};
+
+    double t{ best_time(repeats, [&]() { tf.reset(); },
+                        [&]() { tf.reset(new text_file(name)); }) };
+    const text_file &lines{ *tf };
+    st.push_back({ "readall", t, lines.size(), lines.bytes() });
+
+    t = best_time(repeats, none, [&]() { wl = find_waters(lines); });
+    size_t na{ wl.natoms };
+    st.front().atoms = na;
+    size_t atom_bytes{ static_cast<size_t>(lines[na + 1].data()
+                       + lines[na + 1].size() + 1 - lines[2].data()) };
+    st.push_back({ "scan", t, na, atom_bytes });
+
+    // parse all atom lines (Angstrom)
+    std::vector<double> xyz(na * 3);
+    t = best_time(repeats, none, [&]() {
+        for (size_t i = 0; i < na; ++i) {
+            coordinates(lines[i + 2], xyz[3*i], xyz[3*i+1], xyz[3*i+2]);
+        }
+    });
+    st.push_back({ "coordinates", t, na, atom_bytes });
+
+    // batch transform of all waters, for every model
+    size_t nw{ wl.first.size() };
+    size_t water_bytes{ 0 };
+    for (size_t j = 0; j < nw; ++j) {
+        for (uint32_t k = 0; k < wl.sites[j]; ++k) {
+            water_bytes += lines[wl.first[j] + k + 2].size() + 1;
+        }
+    }
+    std::vector<double> in[9];
+    std::vector<double> out[9];
+    std::vector<double> ext[3 * max_extra_sites];
+    for (int k = 0; k < 9; ++k) {
+        in[k].resize(nw);
+        for (size_t j = 0; j < nw; ++j) {
+            in[k][j] = xyz[3 * (wl.first[j] + k / 3) + k % 3];
+        }
+    }
+    for (auto &e: ext) { e.resize(nw); }
+    std::vector<unsigned char> bad(nw);
+    std::vector<std::string> models{ model::catalog() };
+    for (size_t id = 0; id < models.size(); ++id) {
+        model wm;
+        wm.initialise(static_cast<int>(id));
+        t = best_time(repeats, [&]() {
+            for (int k = 0; k < 9; ++k) { out[k] = in[k]; }
+        }, [&]() {
+            if (nw == 0) { return; }
+            site_arrays O{ &out[0][0], &out[1][0], &out[2][0] };
+            site_arrays H1{ &out[3][0], &out[4][0], &out[5][0] };
+            site_arrays H2{ &out[6][0], &out[7][0], &out[8][0] };
+            site_arrays extra[max_extra_sites];
+            for (int k = 0; k < max_extra_sites; ++k) {
+                extra[k] = site_arrays{ ext[3*k].data(), ext[3*k+1].data(),
+                                         ext[3*k+2].data() };
+            }
+            wm.transform(nw, O, H1, H2, extra, bad.data());
+        });
+        st.push_back({ "transform:" + models[id], t, wl.water_atoms,
+                       water_bytes });
+    }
+
+    // formatting of all atom records
+    null_buffer nb;
+    std::ostream null_os{ &nb };
+    t = best_time(repeats, none, [&]() {
+        gro_writer w{ &null_os };
+        for (size_t i = 0; i < na; ++i) {
+            w.atom(lines[i + 2], i + 1, xyz[3*i] / 10.0, xyz[3*i+1] / 10.0,
+                   xyz[3*i+2] / 10.0);
+        }
+    });
+    st.push_back({ "format", t, na, atom_bytes });
+
+    // the whole conversion
+    model wm;
+    wm.initialise(0);
+    t = best_time(repeats, none, [&]() {
+        process_gro(null_os, lines, wm, threads);
+    });
+    st.push_back({ "process_gro", t, na, lines.bytes() });
+    return st;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    size_t natoms{ 1000000 };
+    uint64_t seed{ 1 };
+    int repeats{ 3 };
+    int threads{ 1 };
+    bool gen_only{ false };
+    bool velocities{ true };
+    std::string json_name;
+
+    int n{ 1 };
+    try {
+        while (n < argc && argv[n][0] == '-' && argv[n][1] != '\0') {
+            std::string arg{ argv[n] };
+            bool has_value{ n + 1 < argc };
+            if (arg == "-h" || arg == "--help") {
+                print_help(argv[0]);
+                return 0;
+            } else if (arg == "-g") {
+                gen_only = true;
+            } else if (arg == "-V") {
+                velocities = false;
+            } else if (arg == "-n" && has_value) {
+                natoms = std::stoull(argv[++n]);
+            } else if (arg == "-S" && has_value) {
+                seed = std::stoull(argv[++n]);
+            } else if (arg == "-r" && has_value) {
+                repeats = std::max(1, std::stoi(argv[++n]));
+            } else if (arg == "-j" && has_value) {
+                threads = thread_count(std::stoi(argv[++n]));
+            } else if (arg == "-o" && has_value) {
+                json_name = argv[++n];
+            } else {
+                print_help(argv[0]);
+                return 1;
+            }
+            ++n;
+        }
+    }
+    catch (const std::logic_error &) {
+        print_help(argv[0]);
+        return 1;
+    }
+    if (gen_only && n >= argc) { print_help(argv[0]); return 1; }
+
+    try {
+        if (gen_only) {
+            std::ofstream of{ argv[n], std::ios::binary };
+            generate(of, natoms, seed, velocities);
+            of.close();
+            if (!of) {
+                throw(std::runtime_error("error writing '"
+                                         + std::string(argv[n]) + "'"));
+            }
+            return 0;
+        }
+
+        // input: given file or a temporary synthetic one
+        std::string name;
+        bool temporary{ n >= argc };
+        if (temporary) {
+            const char *dir{ std::getenv("TMPDIR") };
+            name = std::string(dir && *dir ? dir : "/tmp")
+                   + "/watcor_bench_XXXXXX";
+            std::vector<char> tmpl(name.begin(), name.end());
+            tmpl.push_back('\0');
+            int fd{ mkstemp(tmpl.data()) };
+            if (fd < 0) {
+                throw(std::runtime_error("cannot create temporary file"));
+            }
+            close(fd);
+            name = tmpl.data();
+            std::ofstream of{ name, std::ios::binary };
+            generate(of, natoms, seed, velocities);
+            of.close();
+            if (!of) {
+                std::remove(name.c_str());
+                throw(std::runtime_error("error writing '" + name + "'"));
+            }
+        } else {
+            name = argv[n];
+        }
+
+        std::unique_ptr<text_file> tf;
+        water_layout wl;
+        std::vector<stage_result> st;
+        try {
+            st = run(name, repeats, threads, tf, wl);
+        }
+        catch (...) {
+            if (temporary) { std::remove(name.c_str()); }
+            throw;
+        }
+        if (temporary) { std::remove(name.c_str()); }
+
+        std::string label{ temporary ? "synthetic:" + std::to_string(natoms)
+                                       + ":" + std::to_string(seed)
+                                     : name };
+        if (json_name.empty()) {
+            write_report(std::cout, label, *tf, wl, threads, repeats, st);
+        } else {
+            std::ofstream of{ json_name };
+            write_report(of, label, *tf, wl, threads, repeats, st);
+            of.close();
+            if (!of) {
+                throw(std::runtime_error("error writing '" + json_name + "'"));
+            }
+        }
+    }
+    catch (const std::exception &e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        return 2;
+    }
+    return 0;
+}
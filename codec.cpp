@@ -0,0 +1,655 @@
+#include "codec.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#ifdef WATCOR_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WATCOR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+//! Decompressor of one format
+class decoder {
+public:
+    virtual ~decoder() {}
+    //! start again at the beginning of a stream
+    virtual void reset() = 0;
+    //! Decompress some of [in, in_end) into [out, out_end)
+    /**
+     * Both pointers are advanced past what was used.
+     * \return true if the end of a stream was reached
+     */
+    virtual bool step(const char *&in, const char *in_end, char *&out,
+                      char *out_end) = 0;
+};
+
+//! Compressor of one format
+class encoder {
+public:
+    virtual ~encoder() {}
+    //! Compress some of [in, in_end) into [out, out_end)
+    /**
+     * Both pointers are advanced past what was used.
+     * \param end no input follows: finish the stream
+     * \return true once the stream is finished (only if end)
+     */
+    virtual bool step(const char *&in, const char *in_end, char *&out,
+                      char *out_end, bool end) = 0;
+};
+
+namespace {
+
+const size_t block_size{ 1 << 20 };  // bytes per block of a ring
+const size_t ring_blocks{ 4 };       // blocks per ring
+const size_t chunk_size{ 1 << 18 };  // bytes read or written at a time
+
+// codec libraries count in 32 bit
+const size_t max_step{ 1 << 30 };
+
+size_t step_size(const char *p, const char *e) {
+    return std::min(static_cast<size_t>(e - p), max_step);
+}
+
+#ifdef WATCOR_HAVE_ZLIB
+class gzip_decoder: public decoder {
+public:
+    explicit gzip_decoder(const std::string &name) : file(name) {
+        std::memset(&z, 0, sizeof(z));
+        if (inflateInit2(&z, 15 + 32) != Z_OK) { // gzip or zlib header
+            throw(std::runtime_error("cannot start decompressing '"
+                                     + file + "'"));
+        }
+    }
+    ~gzip_decoder() { inflateEnd(&z); }
+    void reset() override { inflateReset(&z); }
+    bool step(const char *&in, const char *in_end, char *&out,
+              char *out_end) override {
+        z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+        z.avail_in = static_cast<uInt>(step_size(in, in_end));
+        z.next_out = reinterpret_cast<Bytef *>(out);
+        z.avail_out = static_cast<uInt>(step_size(out, out_end));
+        int r{ inflate(&z, Z_NO_FLUSH) };
+        in = reinterpret_cast<const char *>(z.next_in);
+        out = reinterpret_cast<char *>(z.next_out);
+        if (r == Z_STREAM_END) {
+            inflateReset(&z); // another member may follow
+            return true;
+        }
+        if (r != Z_OK && r != Z_BUF_ERROR) {
+            throw(std::runtime_error("corrupt gzip data in '" + file + "'"
+                                     + (z.msg ? std::string(": ") + z.msg
+                                              : std::string())));
+        }
+        return false;
+    }
+private:
+    std::string file;
+    z_stream z;
+};
+
+class gzip_encoder: public encoder {
+public:
+    gzip_encoder() {
+        std::memset(&z, 0, sizeof(z));
+        if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw(std::runtime_error("cannot start gzip compression"));
+        }
+    }
+    ~gzip_encoder() { deflateEnd(&z); }
+    bool step(const char *&in, const char *in_end, char *&out,
+              char *out_end, bool end) override {
+        z.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+        z.avail_in = static_cast<uInt>(step_size(in, in_end));
+        z.next_out = reinterpret_cast<Bytef *>(out);
+        z.avail_out = static_cast<uInt>(step_size(out, out_end));
+        bool last{ end && z.avail_in == static_cast<size_t>(in_end - in) };
+        int r{ deflate(&z, last ? Z_FINISH : Z_NO_FLUSH) };
+        in = reinterpret_cast<const char *>(z.next_in);
+        out = reinterpret_cast<char *>(z.next_out);
+        if (r == Z_STREAM_ERROR) {
+            throw(std::runtime_error("gzip compression failed"));
+        }
+        return r == Z_STREAM_END;
+    }
+private:
+    z_stream z;
+};
+#endif
+
+#ifdef WATCOR_HAVE_ZSTD
+class zstd_decoder: public decoder {
+public:
+    explicit zstd_decoder(const std::string &name) :
+        file(name), z{ ZSTD_createDStream() } {
+        if (!z || ZSTD_isError(ZSTD_initDStream(z))) {
+            ZSTD_freeDStream(z);
+            throw(std::runtime_error("cannot start decompressing '"
+                                     + file + "'"));
+        }
+    }
+    ~zstd_decoder() { ZSTD_freeDStream(z); }
+    void reset() override { ZSTD_initDStream(z); }
+    bool step(const char *&in, const char *in_end, char *&out,
+              char *out_end) override {
+        ZSTD_inBuffer ib{ in, static_cast<size_t>(in_end - in), 0 };
+        ZSTD_outBuffer ob{ out, static_cast<size_t>(out_end - out), 0 };
+        size_t r{ ZSTD_decompressStream(z, &ob, &ib) };
+        if (ZSTD_isError(r)) {
+            throw(std::runtime_error("corrupt zstd data in '" + file + "': "
+                                     + ZSTD_getErrorName(r)));
+        }
+        in += ib.pos;
+        out += ob.pos;
+        return r == 0; // frame decoded and flushed
+    }
+private:
+    std::string file;
+    ZSTD_DStream *z;
+};
+
+class zstd_encoder: public encoder {
+public:
+    zstd_encoder() : z{ ZSTD_createCStream() } {
+        if (!z || ZSTD_isError(ZSTD_initCStream(z, 3))) {
+            ZSTD_freeCStream(z);
+            throw(std::runtime_error("cannot start zstd compression"));
+        }
+    }
+    ~zstd_encoder() { ZSTD_freeCStream(z); }
+    bool step(const char *&in, const char *in_end, char *&out,
+              char *out_end, bool end) override {
+        ZSTD_inBuffer ib{ in, static_cast<size_t>(in_end - in), 0 };
+        ZSTD_outBuffer ob{ out, static_cast<size_t>(out_end - out), 0 };
+        bool finishing{ end && in == in_end };
+        size_t r{ finishing ? ZSTD_endStream(z, &ob)
+                            : ZSTD_compressStream(z, &ob, &ib) };
+        if (ZSTD_isError(r)) {
+            throw(std::runtime_error(std::string("zstd compression failed: ")
+                                     + ZSTD_getErrorName(r)));
+        }
+        in += ib.pos;
+        out += ob.pos;
+        return finishing && r == 0; // all flushed
+    }
+private:
+    ZSTD_CStream *z;
+};
+#endif
+
+std::runtime_error unsupported(codec_t c, const std::string &name) {
+    return std::runtime_error("'" + name + "': " + codec_name(c)
+                              + " compression is not supported by this "
+                              "build");
+}
+
+std::unique_ptr<decoder> make_decoder(codec_t c, const std::string &name) {
+    switch (c) {
+#ifdef WATCOR_HAVE_ZLIB
+    case CODEC_GZIP: return std::unique_ptr<decoder>(new gzip_decoder(name));
+#endif
+#ifdef WATCOR_HAVE_ZSTD
+    case CODEC_ZSTD: return std::unique_ptr<decoder>(new zstd_decoder(name));
+#endif
+    default: throw(unsupported(c, name));
+    }
+}
+
+std::unique_ptr<encoder> make_encoder(codec_t c, const std::string &name) {
+    switch (c) {
+#ifdef WATCOR_HAVE_ZLIB
+    case CODEC_GZIP: return std::unique_ptr<encoder>(new gzip_encoder());
+#endif
+#ifdef WATCOR_HAVE_ZSTD
+    case CODEC_ZSTD: return std::unique_ptr<encoder>(new zstd_encoder());
+#endif
+    default: throw(unsupported(c, name));
+    }
+}
+
+// decompress until no progress is possible (input used up or output full);
+// ended tells whether the data used so far end with a complete stream
+void decode(decoder &d, const char *&in, const char *in_end, char *&out,
+            char *out_end, bool &ended) {
+    while (out != out_end) {
+        const char *in0{ in };
+        char *out0{ out };
+        if (d.step(in, in_end, out, out_end)) {
+            ended = true;
+        } else if (in != in0) {
+            ended = false;
+        }
+        if (in == in0 && out == out0) { break; }
+    }
+}
+
+std::runtime_error corrupt(const std::string &name) {
+    return std::runtime_error("corrupt compressed data in '" + name + "'");
+}
+
+std::runtime_error truncated(const std::string &name) {
+    return std::runtime_error("unexpected end of compressed data in '"
+                              + name + "'");
+}
+
+} // namespace
+
+codec_t codec_of_name(const std::string &name) {
+    auto ends_with = [&](const char *ext) {
+        size_t n{ std::strlen(ext) };
+        return name.size() > n && name.compare(name.size() - n, n, ext) == 0;
+    };
+    if (ends_with(".gz")) { return CODEC_GZIP; }
+    if (ends_with(".zst")) { return CODEC_ZSTD; }
+    return CODEC_NONE;
+}
+
+codec_t codec_of_data(const char *p, size_t n) {
+    const unsigned char *u{ reinterpret_cast<const unsigned char *>(p) };
+    if (n >= 2 && u[0] == 0x1f && u[1] == 0x8b) { return CODEC_GZIP; }
+    if (n >= 4 && u[0] == 0x28 && u[1] == 0xb5 && u[2] == 0x2f
+        && u[3] == 0xfd) {
+        return CODEC_ZSTD;
+    }
+    return CODEC_NONE;
+}
+
+codec_t codec_of_stream(std::istream &is) {
+    std::streampos start{ is.tellg() };
+    if (start == std::streampos(-1)) {
+        return is.peek() == 0x1f ? CODEC_GZIP : CODEC_NONE;
+    }
+    char magic[4];
+    is.read(magic, sizeof(magic));
+    size_t n{ static_cast<size_t>(is.gcount()) };
+    is.clear();
+    is.seekg(start);
+    return codec_of_data(magic, n);
+}
+
+const char *codec_name(codec_t c) {
+    switch (c) {
+    case CODEC_GZIP: return "gzip";
+    case CODEC_ZSTD: return "zstd";
+    default: return "none";
+    }
+}
+
+bool codec_supported(codec_t c) {
+    switch (c) {
+    case CODEC_NONE: return true;
+#ifdef WATCOR_HAVE_ZLIB
+    case CODEC_GZIP: return true;
+#endif
+#ifdef WATCOR_HAVE_ZSTD
+    case CODEC_ZSTD: return true;
+#endif
+    default: return false;
+    }
+}
+
+void decompress(codec_t c, const char *p, size_t n,
+                const std::function<void(const char *, size_t)> &take,
+                const std::string &name) {
+    std::unique_ptr<decoder> d{ make_decoder(c, name) };
+    block_ring ring(ring_blocks, block_size);
+    std::exception_ptr error; // failure of the thread
+    std::thread worker([&]() {
+        const char *in{ p };
+        const char *e{ p + n };
+        bool ended{ false };
+        codec_block *b{ nullptr };
+        try {
+            bool done{ false };
+            while (!done) {
+                b = ring.produce();
+                if (!b) { return; }
+                char *o{ b->data.data() };
+                char *oe{ o + b->data.size() };
+                decode(*d, in, e, o, oe, ended);
+                done = o != oe; // no more output
+                if (done && in != e) { throw(corrupt(name)); }
+                if (done && !ended) { throw(truncated(name)); }
+                b->size = static_cast<size_t>(o - b->data.data());
+                b->last = done;
+                ring.produced();
+                b = nullptr;
+            }
+        }
+        catch (...) {
+            error = std::current_exception();
+            if (!b) { b = ring.produce(); }
+            if (b) {
+                b->size = 0;
+                b->last = true;
+                ring.produced();
+            }
+        }
+    });
+    try {
+        bool last{ false };
+        while (!last) {
+            codec_block *b{ ring.consume() };
+            last = b->last;
+            if (b->size > 0) { take(b->data.data(), b->size); }
+            ring.consumed();
+        }
+    }
+    catch (...) {
+        ring.cancel();
+        worker.join();
+        throw;
+    }
+    worker.join();
+    if (error) { std::rethrow_exception(error); }
+}
+
+size_t decompressed_size(codec_t c, const char *p, size_t n) {
+    // more than this is left to growing the buffer
+    const size_t most{ 32 * n };
+    size_t s{ 0 };
+    if (c == CODEC_GZIP && n >= 18) {
+        const unsigned char *u{ reinterpret_cast<const unsigned char *>(p)
+                                + n - 4 };
+        s = static_cast<size_t>(u[0]) | static_cast<size_t>(u[1]) << 8
+            | static_cast<size_t>(u[2]) << 16
+            | static_cast<size_t>(u[3]) << 24;
+    }
+#ifdef WATCOR_HAVE_ZSTD
+    if (c == CODEC_ZSTD) {
+        // ZSTD_CONTENTSIZE_UNKNOWN and _ERROR are larger than most
+        unsigned long long z{ ZSTD_getFrameContentSize(p, n) };
+        if (z <= most) { s = static_cast<size_t>(z); }
+    }
+#endif
+    return s <= most ? s : 0;
+}
+
+void compress(codec_t c, const char *p, size_t n, std::ostream &os) {
+    std::unique_ptr<encoder> enc{ make_encoder(c, "output") };
+    std::vector<char> z(chunk_size);
+    const char *e{ p + n };
+    bool done{ false };
+    while (!done && os) {
+        char *o{ z.data() };
+        done = enc->step(p, e, o, z.data() + z.size(), true);
+        os.write(z.data(), o - z.data());
+    }
+}
+
+// block_ring
+
+block_ring::block_ring(size_t n, size_t bytes) : blocks(n) {
+    for (auto &b: blocks) { b.data.resize(bytes); }
+}
+
+codec_block *block_ring::produce() {
+    std::unique_lock<std::mutex> guard{ lock };
+    changed.wait(guard, [&]() { return stop || head - tail < blocks.size(); });
+    if (stop) { return nullptr; }
+    codec_block *b{ &blocks[head % blocks.size()] };
+    b->size = 0;
+    b->last = false;
+    return b;
+}
+
+void block_ring::produced() {
+    {
+        std::lock_guard<std::mutex> guard{ lock };
+        ++head;
+    }
+    changed.notify_all();
+}
+
+codec_block *block_ring::consume() {
+    std::unique_lock<std::mutex> guard{ lock };
+    changed.wait(guard, [&]() { return stop || head > tail; });
+    if (stop) { return nullptr; }
+    return &blocks[tail % blocks.size()];
+}
+
+void block_ring::consumed() {
+    {
+        std::lock_guard<std::mutex> guard{ lock };
+        ++tail;
+    }
+    changed.notify_all();
+}
+
+void block_ring::cancel() {
+    {
+        std::lock_guard<std::mutex> guard{ lock };
+        stop = true;
+    }
+    changed.notify_all();
+}
+
+void block_ring::reset() {
+    head = 0;
+    tail = 0;
+    stop = false;
+}
+
+// decompress_buffer
+
+decompress_buffer::decompress_buffer(std::istream &src, codec_t c,
+                                     const std::string &name,
+                                     run_stats *stats) :
+    in(src), file(name), st(stats), dec{ make_decoder(c, name) },
+    start{ src.tellg() }, ring(ring_blocks, block_size) {
+    launch();
+}
+
+decompress_buffer::~decompress_buffer() {
+    halt();
+}
+
+void decompress_buffer::launch() {
+    worker = std::thread([this]() { run(); });
+}
+
+void decompress_buffer::halt() {
+    ring.cancel();
+    if (worker.joinable()) { worker.join(); }
+}
+
+void decompress_buffer::run() {
+    std::vector<char> raw(chunk_size);
+    const char *p{ raw.data() };
+    const char *e{ p };
+    bool eof{ false };   // source used up
+    bool ended{ false }; // the data so far end with a complete stream
+    codec_block *b{ nullptr };
+    try {
+        bool done{ false };
+        while (!done) {
+            b = ring.produce();
+            if (!b) { return; }
+            phase_timer t{ st, "decompress" };
+            char *o{ b->data.data() };
+            char *oe{ o + b->data.size() };
+            while (o != oe) {
+                if (p == e && !eof) {
+                    in.read(raw.data(),
+                            static_cast<std::streamsize>(raw.size()));
+                    if (in.bad()) {
+                        throw(std::runtime_error("error reading '" + file
+                                                 + "'"));
+                    }
+                    p = raw.data();
+                    e = p + in.gcount();
+                    eof = p == e;
+                }
+                decode(*dec, p, e, o, oe, ended);
+                if (o == oe || !eof) { continue; }
+                if (p != e) { throw(corrupt(file)); }
+                if (!ended) { throw(truncated(file)); }
+                done = true;
+                break;
+            }
+            b->size = static_cast<size_t>(o - b->data.data());
+            b->last = done;
+            t.count(b->size, 0);
+            ring.produced();
+            b = nullptr;
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+        if (!b) { b = ring.produce(); }
+        if (b) {
+            b->size = 0;
+            b->last = true;
+            ring.produced();
+        }
+    }
+}
+
+decompress_buffer::int_type decompress_buffer::underflow() {
+    if (gptr() < egptr()) { return traits_type::to_int_type(*gptr()); }
+    for (;;) {
+        if (current) {
+            if (current->last) {
+                if (error) { std::rethrow_exception(error); }
+                return traits_type::eof();
+            }
+            passed += current->size;
+            ring.consumed();
+            current = nullptr;
+        }
+        current = ring.consume();
+        if (!current) { return traits_type::eof(); }
+        char *p{ current->data.data() };
+        setg(p, p, p + current->size);
+        if (current->size > 0) { return traits_type::to_int_type(*p); }
+    }
+}
+
+decompress_buffer::pos_type
+decompress_buffer::seekoff(off_type off, std::ios_base::seekdir dir,
+                           std::ios_base::openmode which) {
+    if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::in)
+        || start == std::streampos(-1)) {
+        return pos_type(off_type(-1));
+    }
+    return pos_type(static_cast<off_type>(passed + (gptr() - eback())));
+}
+
+decompress_buffer::pos_type
+decompress_buffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+    pos_type here{ seekoff(0, std::ios_base::cur, which) };
+    if (here == pos_type(off_type(-1)) || pos == here) { return here; }
+    if (pos != pos_type(0)) { return pos_type(off_type(-1)); }
+
+    // rewind: decompress again from the start
+    halt();
+    ring.reset();
+    current = nullptr;
+    passed = 0;
+    error = nullptr;
+    setg(nullptr, nullptr, nullptr);
+    in.clear();
+    in.seekg(start);
+    if (!in) { return pos_type(off_type(-1)); }
+    dec->reset();
+    launch();
+    return pos;
+}
+
+// compress_buffer
+
+compress_buffer::compress_buffer(std::ostream &dst, codec_t c,
+                                 const std::string &name, run_stats *stats) :
+    out(dst), file(name), st(stats), enc{ make_encoder(c, name) },
+    ring(ring_blocks, block_size) {
+    current = ring.produce();
+    setp(current->data.data(), current->data.data() + current->data.size());
+    worker = std::thread([this]() { run(); });
+}
+
+compress_buffer::~compress_buffer() {
+    ring.cancel();
+    if (worker.joinable()) { worker.join(); }
+}
+
+bool compress_buffer::hand_over(bool last) {
+    if (!current) { return false; }
+    current->size = static_cast<size_t>(pptr() - pbase());
+    current->last = last;
+    ring.produced();
+    current = last ? nullptr : ring.produce();
+    if (!current) {
+        setp(nullptr, nullptr);
+        return last;
+    }
+    setp(current->data.data(), current->data.data() + current->data.size());
+    return true;
+}
+
+compress_buffer::int_type compress_buffer::overflow(int_type c) {
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+        return traits_type::not_eof(c);
+    }
+    if (pptr() == epptr() && !hand_over(false)) { return traits_type::eof(); }
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+}
+
+std::streamsize compress_buffer::xsputn(const char *p, std::streamsize n) {
+    std::streamsize done{ 0 };
+    while (done < n) {
+        if (pptr() == epptr() && !hand_over(false)) { break; }
+        std::streamsize k{ std::min(n - done,
+                                    static_cast<std::streamsize>(epptr()
+                                                                 - pptr())) };
+        std::memcpy(pptr(), p + done, static_cast<size_t>(k));
+        pbump(static_cast<int>(k));
+        done += k;
+    }
+    return done;
+}
+
+void compress_buffer::finish() {
+    if (!worker.joinable()) { return; }
+    hand_over(true);
+    worker.join();
+    if (error) { std::rethrow_exception(error); }
+    out.flush();
+    if (!out) { throw(std::runtime_error("error writing '" + file + "'")); }
+}
+
+void compress_buffer::run() {
+    std::vector<char> z(chunk_size);
+    try {
+        for (;;) {
+            codec_block *b{ ring.consume() };
+            if (!b) { return; }
+            {
+                phase_timer t{ st, "compress" };
+                const char *p{ b->data.data() };
+                const char *e{ p + b->size };
+                for (;;) {
+                    char *o{ z.data() };
+                    bool done{ enc->step(p, e, o, z.data() + z.size(),
+                                         b->last) };
+                    out.write(z.data(), o - z.data());
+                    if (!out) {
+                        throw(std::runtime_error("error writing '" + file
+                                                 + "'"));
+                    }
+                    if (b->last ? done : p == e) { break; }
+                }
+                t.count(b->size, 0);
+            }
+            bool last{ b->last };
+            ring.consumed();
+            if (last) { return; }
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+        ring.cancel();
+    }
+}
@@ -0,0 +1,265 @@
+#ifndef CODEC_H
+#define CODEC_H
+#include "stats.h"
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** \defgroup codec Compressed files
+ * Transparent gzip and zstd compression of input and output. Streams
+ * compress or decompress on a thread of their own, handing over blocks of
+ * data through a small ring of buffers, so that codec work overlaps with
+ * the conversion and memory use is bounded.
+ * @{
+ */
+
+//! Compression format of a file
+enum codec_t {
+    CODEC_NONE = 0, //!< not compressed
+    CODEC_GZIP,     //!< gzip (.gz)
+    CODEC_ZSTD      //!< Zstandard (.zst)
+};
+
+//! Format of a file from its name (.gz or .zst extension)
+codec_t codec_of_name(const std::string &name);
+
+//! Format of data from its first bytes (magic number)
+/**
+ * \param p start of the data
+ * \param n number of bytes available (4 are enough)
+ */
+codec_t codec_of_data(const char *p, size_t n);
+
+//! Format of a stream from its first bytes; the stream is not advanced
+/**
+ * Of a stream that cannot be positioned (a pipe) only the first byte can
+ * be looked at, so only gzip is recognised there.
+ */
+codec_t codec_of_stream(std::istream &is);
+
+//! Name of a format ("gzip", "zstd" or "none")
+const char *codec_name(codec_t c);
+
+//! true if support for a format was compiled in
+bool codec_supported(codec_t c);
+
+//! Decompress data held in memory on a thread of its own
+/**
+ * The decompressed data are handed to take on the calling thread, block by
+ * block and in order, while the next blocks are decompressed, so that the
+ * work of take overlaps with the decompression. Concatenated streams (as
+ * made by cat a.gz b.gz) are decompressed one after the other.
+ *
+ * \param c format of the data
+ * \param p compressed data
+ * \param n number of bytes
+ * \param take called with the start and size of each block
+ * \param name file name for error messages
+ * \throws std::runtime_error if the format is not supported or the data
+ *     are corrupt or truncated, or what take throws
+ */
+void decompress(codec_t c, const char *p, size_t n,
+                const std::function<void(const char *, size_t)> &take,
+                const std::string &name);
+
+//! Size of compressed data after decompression, as far as it is recorded
+/**
+ * Only an estimate for allocating room: a gzip trailer holds the size of
+ * the last member modulo 4 GB, a zstd header that of the first frame.
+ *
+ * \param c format of the data
+ * \param p compressed data
+ * \param n number of bytes
+ * \return the size, or 0 if it is not recorded or implausibly large
+ */
+size_t decompressed_size(codec_t c, const char *p, size_t n);
+
+//! Compress data held in memory and write it to a stream
+/**
+ * \param c format of the output
+ * \param p data
+ * \param n number of bytes
+ * \param os stream to write to
+ * \throws std::runtime_error if the format is not supported
+ */
+void compress(codec_t c, const char *p, size_t n, std::ostream &os);
+
+class decoder;
+class encoder;
+
+//! A block of data handed over between two threads
+struct codec_block {
+    std::vector<char> data; //!< storage (of the ring's block size)
+    size_t size{ 0 };       //!< bytes used
+    bool last{ false };     //!< no blocks follow
+};
+
+//! Bounded ring of blocks between a producer and a consumer thread
+/**
+ * Blocks are consumed in the order they are produced; the producer waits
+ * while all blocks are full, the consumer while all are empty.
+ */
+class block_ring {
+public:
+    //! \param n number of blocks \param bytes size of each block
+    block_ring(size_t n, size_t bytes);
+
+    //! next empty block to fill (waits); nullptr once cancelled
+    codec_block *produce();
+    //! hand over the block returned by produce()
+    void produced();
+    //! next full block (waits); nullptr once cancelled
+    codec_block *consume();
+    //! give back the block returned by consume()
+    void consumed();
+    //! wake up and stop both sides
+    void cancel();
+    //! empty all blocks and undo cancel() (no thread may be using the ring)
+    void reset();
+
+private:
+    std::vector<codec_block> blocks;
+    size_t head{ 0 };  //!< blocks produced
+    size_t tail{ 0 };  //!< blocks consumed
+    bool stop{ false };
+    std::mutex lock;
+    std::condition_variable changed;
+};
+
+//! Stream buffer decompressing another stream on a thread of its own
+/**
+ * If the source stream can be positioned, the buffer can be rewound to its
+ * start (decompressing again); other positioning is not supported. Errors
+ * of the source or the data are thrown by the reading functions (see
+ * decompress_istream).
+ */
+class decompress_buffer: public std::streambuf {
+public:
+    //! Start decompressing
+    /**
+     * \param src compressed stream (must outlive the buffer)
+     * \param c format of the stream
+     * \param name file name for error messages
+     * \param stats if not nullptr, decompression is recorded as a phase
+     * \throws std::runtime_error if the format is not supported
+     */
+    decompress_buffer(std::istream &src, codec_t c, const std::string &name,
+                      run_stats *stats = nullptr);
+    ~decompress_buffer();
+
+    decompress_buffer(const decompress_buffer &) = delete;
+    decompress_buffer &operator=(const decompress_buffer &) = delete;
+
+protected:
+    int_type underflow() override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which) override;
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+private:
+    std::istream &in;
+    std::string file;
+    run_stats *st;
+    std::unique_ptr<decoder> dec;
+    std::streampos start;      //!< start of the source (-1: cannot rewind)
+    block_ring ring;
+    codec_block *current{ nullptr }; //!< block in the get area
+    size_t passed{ 0 };        //!< bytes in the blocks before current
+    std::exception_ptr error;  //!< failure of the thread
+    std::thread worker;
+
+    void launch();             //!< start the thread at the current source
+    void halt();               //!< stop the thread
+    void run();                //!< body of the thread
+};
+
+//! Input stream decompressing another stream (see decompress_buffer)
+/**
+ * Errors (corrupt or truncated data, read errors) are thrown as
+ * std::runtime_error by the reading functions.
+ */
+class decompress_istream: public std::istream {
+public:
+    //! \copydoc decompress_buffer::decompress_buffer
+    decompress_istream(std::istream &src, codec_t c, const std::string &name,
+                       run_stats *stats = nullptr) :
+        std::istream(nullptr), buf(src, c, name, stats) {
+        rdbuf(&buf);
+        exceptions(std::ios::badbit);
+    }
+private:
+    decompress_buffer buf;
+};
+
+//! Stream buffer compressing into another stream on a thread of its own
+/**
+ * The compressed stream is only complete after finish().
+ */
+class compress_buffer: public std::streambuf {
+public:
+    //! Start compressing
+    /**
+     * \param dst stream for the compressed data (must outlive the buffer)
+     * \param c format of the output
+     * \param name file name for error messages
+     * \param stats if not nullptr, compression is recorded as a phase
+     * \throws std::runtime_error if the format is not supported
+     */
+    compress_buffer(std::ostream &dst, codec_t c, const std::string &name,
+                    run_stats *stats = nullptr);
+    ~compress_buffer(); //!< abandons the output if finish() was not called
+
+    compress_buffer(const compress_buffer &) = delete;
+    compress_buffer &operator=(const compress_buffer &) = delete;
+
+    //! Compress what is left, end the compressed stream and flush it
+    /**
+     * \throws std::runtime_error if compressing or writing failed
+     */
+    void finish();
+
+protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char *p, std::streamsize n) override;
+
+private:
+    std::ostream &out;
+    std::string file;
+    run_stats *st;
+    std::unique_ptr<encoder> enc;
+    block_ring ring;
+    codec_block *current{ nullptr }; //!< block in the put area
+    std::exception_ptr error;  //!< failure of the thread
+    std::thread worker;
+
+    bool hand_over(bool last); //!< pass on the current block
+    void run();                //!< body of the thread
+};
+
+//! Output stream compressing into another stream (see compress_buffer)
+class compress_ostream: public std::ostream {
+public:
+    //! \copydoc compress_buffer::compress_buffer
+    compress_ostream(std::ostream &dst, codec_t c, const std::string &name,
+                     run_stats *stats = nullptr) :
+        std::ostream(nullptr), buf(dst, c, name, stats) {
+        rdbuf(&buf);
+    }
+    //! \copydoc compress_buffer::finish
+    void finish() { buf.finish(); }
+private:
+    compress_buffer buf;
+};
+
+/**@}*/
+
+#endif
@@ -0,0 +1,193 @@
+#include "geometry_report.h"
+#include <cstdio>
+
+namespace {
+
+std::string json_string(const std::string &s) {
+    std::string r{ "\"" };
+    for (char c: s) {
+        if (c == '"' || c == '\\') { r += '\\'; }
+        r += c;
+    }
+    return r + "\"";
+}
+
+// lowest values first; equal values by line, so that any order of adding
+// them gives the same list
+bool lower(const distribution::sample &a, const distribution::sample &b) {
+    return a.value < b.value || (a.value == b.value && a.line < b.line);
+}
+
+bool higher(const distribution::sample &a, const distribution::sample &b) {
+    return a.value > b.value || (a.value == b.value && a.line < b.line);
+}
+
+// insert s into the sorted list v (at most keep long) if it belongs there
+template <class Before>
+void keep_sorted(std::vector<distribution::sample> &v, size_t keep,
+                 const distribution::sample &s, Before before) {
+    auto at = std::upper_bound(v.begin(), v.end(), s, before);
+    if (static_cast<size_t>(at - v.begin()) >= keep) { return; }
+    v.insert(at, s);
+    if (v.size() > keep) { v.pop_back(); }
+}
+
+// the samples of v in the format fmt, separated by commas, with a line
+// break and indent after every per_line of them (0: no breaks)
+void write_samples(std::ostream &os,
+                   const std::vector<distribution::sample> &v, const char *fmt,
+                   size_t per_line = 0, const char *indent = "") {
+    char b[64];
+    for (size_t i = 0; i < v.size(); ++i) {
+        if (i > 0 && per_line > 0 && i % per_line == 0) {
+            os << ",\n" << indent;
+        } else if (i > 0) {
+            os << ", ";
+        }
+        std::snprintf(b, sizeof(b), fmt, v[i].value, v[i].line);
+        os << b;
+    }
+}
+
+} // namespace
+
+distribution::distribution(const std::string &name, const std::string &unit,
+                           double low_end, double bin_width, size_t nbins,
+                           size_t extremes) :
+    what(name), units(unit), lo(low_end), width(bin_width), bins(nbins),
+    keep(std::max(extremes, size_t{ 1 })), hist(nbins + 2, 0) {}
+
+void distribution::keep_low(const sample &s) {
+    keep_sorted(low, keep, s, lower);
+}
+
+void distribution::keep_high(const sample &s) {
+    keep_sorted(high, keep, s, higher);
+}
+
+void distribution::merge(const distribution &o) {
+    for (size_t b = 0; b < hist.size() && b < o.hist.size(); ++b) {
+        hist[b] += o.hist[b];
+    }
+    n += o.n;
+    sum += o.sum;
+    for (const auto &s: o.low) { keep_low(s); }
+    for (const auto &s: o.high) { keep_high(s); }
+}
+
+double distribution::mean() const {
+    return n > 0 ? static_cast<double>(sum) * 1.0e-6 / static_cast<double>(n)
+                 : 0.0;
+}
+
+void distribution::write(std::ostream &os) const {
+    char b[256];
+    os << what << " (" << units << "): " << n << " values";
+    if (n == 0) {
+        os << "\n";
+        return;
+    }
+    std::snprintf(b, sizeof(b), ", min %.4f, max %.4f, mean %.4f\n",
+                  low.front().value, high.front().value, mean());
+    os << b;
+    os << "  lowest:  ";
+    write_samples(os, low, "%.4f (line %zu)", 3, "           ");
+    os << "\n  highest: ";
+    write_samples(os, high, "%.4f (line %zu)", 3, "           ");
+    os << "\n";
+    size_t most{ *std::max_element(hist.begin(), hist.end()) };
+    for (size_t k = 0; k < hist.size(); ++k) {
+        if (hist[k] == 0) { continue; }
+        size_t bar{ std::max(size_t{ 1 }, static_cast<size_t>(
+            40.0 * static_cast<double>(hist[k]) / static_cast<double>(most)
+            + 0.5)) };
+        if (k == 0) {
+            std::snprintf(b, sizeof(b), "  %9s < %-9.4f", "", lo);
+        } else if (k == bins + 1) {
+            std::snprintf(b, sizeof(b), "  %9s >= %-8.4f", "",
+                          bin_start(bins));
+        } else {
+            std::snprintf(b, sizeof(b), "  %9.4f - %-9.4f", bin_start(k - 1),
+                          bin_start(k));
+        }
+        os << b;
+        std::snprintf(b, sizeof(b), " %12zu ", hist[k]);
+        os << b << std::string(bar, '#') << "\n";
+    }
+}
+
+void distribution::write_json(std::ostream &os,
+                              const std::string &indent) const {
+    char b[256];
+    os << "{\n" << indent << "  \"quantity\": " << json_string(what)
+       << ",\n" << indent << "  \"unit\": " << json_string(units) << ",\n";
+    os << indent << "  \"count\": " << n << ",\n";
+    if (n > 0) {
+        std::snprintf(b, sizeof(b), "\"min\": %.6f, \"max\": %.6f, "
+                      "\"mean\": %.6f", low.front().value, high.front().value,
+                      mean());
+        os << indent << "  " << b << ",\n";
+    }
+    const std::vector<sample> *lists[2]{ &low, &high };
+    const char *names[2]{ "lowest", "highest" };
+    for (int k = 0; k < 2; ++k) {
+        os << indent << "  \"" << names[k] << "\": [";
+        write_samples(os, *lists[k], "{\"value\": %.6f, \"line\": %zu}");
+        os << "],\n";
+    }
+    std::snprintf(b, sizeof(b), "\"histogram\": {\"start\": %.6f, "
+                  "\"width\": %.6f, \"below\": %zu, \"above\": %zu, ", lo,
+                  width, hist.front(), hist.back());
+    os << indent << "  " << b << "\"counts\": [";
+    for (size_t k = 1; k <= bins; ++k) {
+        os << hist[k] << (k < bins ? ", " : "");
+    }
+    os << "]}\n" << indent << "}";
+}
+
+geometry_report::geometry_report(const std::vector<std::string> &names,
+                                 size_t extremes) :
+    oh_distance("O-H distance", "A", 0.8, 0.005, 80, extremes),
+    hoh_angle("H-O-H angle", "degree", 80.0, 0.5, 100, extremes),
+    site_distance("extra site to O distance", "A", 0.0, 0.01, 100, extremes),
+    models(names), keep(extremes) {
+    for (const auto &m: models) {
+        h_shift.emplace_back("H displacement, " + m, "A", 0.0, 0.005,
+                             100, extremes);
+    }
+}
+
+void geometry_report::merge(const geometry_report &o) {
+    oh_distance.merge(o.oh_distance);
+    hoh_angle.merge(o.hoh_angle);
+    site_distance.merge(o.site_distance);
+    for (size_t m = 0; m < h_shift.size() && m < o.h_shift.size(); ++m) {
+        h_shift[m].merge(o.h_shift[m]);
+    }
+}
+
+void geometry_report::write(std::ostream &os) const {
+    os << "Geometry of " << waters() << " input waters\n";
+    oh_distance.write(os);
+    hoh_angle.write(os);
+    site_distance.write(os);
+    for (const auto &d: h_shift) { d.write(os); }
+}
+
+void geometry_report::write_json(std::ostream &os) const {
+    os << "{\n  \"waters\": " << waters() << ",\n";
+    os << "  \"oh_distance\": ";
+    oh_distance.write_json(os, "  ");
+    os << ",\n  \"hoh_angle\": ";
+    hoh_angle.write_json(os, "  ");
+    os << ",\n  \"site_distance\": ";
+    site_distance.write_json(os, "  ");
+    os << ",\n  \"h_displacement\": [";
+    for (size_t m = 0; m < h_shift.size(); ++m) {
+        os << "\n    {\"model\": " << json_string(models[m])
+           << ", \"distribution\": ";
+        h_shift[m].write_json(os, "    ");
+        os << "}" << (m + 1 < h_shift.size() ? "," : "");
+    }
+    os << "\n  ]\n}\n";
+}
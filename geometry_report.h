@@ -0,0 +1,155 @@
+#ifndef GEOMETRY_REPORT_H
+#define GEOMETRY_REPORT_H
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/** \defgroup geometry_report Geometry report
+ * Checks of the input waters, gathered during a conversion (see
+ * process_gro()) mostly from values that the transform computes anyway:
+ * the O-H distances and H-O-H angles of the input, the distances of its
+ * extra sites from O, and how far each H atom moves when the water is
+ * idealised, for each output model. For each quantity the report has a
+ * histogram, the minimum, maximum and mean, and the values furthest out on
+ * either side with the line where they were found.
+ *
+ * Each thread fills a report of its own for every part of a frame, which
+ * is then merged into the total. Sums are kept as integers (in units of
+ * 1e-6) and ties are broken by line, so the report does not depend on the
+ * order of the merges, nor on the number of threads.
+ * @{
+ */
+
+//! Distribution of one quantity
+class distribution {
+public:
+    //! A value and where it was found
+    struct sample {
+        double value; //!< the value
+        size_t line;  //!< line of the atom in the input (from 1)
+    };
+
+    //! An empty distribution
+    /**
+     * \param name what is measured
+     * \param unit unit of the values
+     * \param lo lower end of the histogram
+     * \param width width of a bin
+     * \param bins number of bins (values outside them are counted as below
+     *     or above the histogram)
+     * \param extremes number of lowest and of highest values kept (at
+     *     least 1)
+     */
+    distribution(const std::string &name, const std::string &unit, double lo,
+                 double width, size_t bins, size_t extremes);
+
+    //! add a value found at line l
+    void add(double v, size_t l) {
+        double u{ (v - lo) / width };
+        size_t b{ u < 0.0 ? 0 : u < static_cast<double>(bins) ?
+                  static_cast<size_t>(u) + 1 : bins + 1 };
+        ++hist[b];
+        ++n;
+        sum += std::llround(v * 1.0e6);
+        if (low.size() < keep || !(v > low.back().value)) {
+            keep_low(sample{ v, l });
+        }
+        if (high.size() < keep || !(v < high.back().value)) {
+            keep_high(sample{ v, l });
+        }
+    }
+
+    //! add the values of another distribution of the same quantity
+    void merge(const distribution &o);
+
+    const std::string &name() const { return what; } //!< what is measured
+    const std::string &unit() const { return units; } //!< unit of values
+    size_t count() const { return n; } //!< number of values
+    double mean() const; //!< mean value (0 if none)
+    //! lowest values, lowest first
+    const std::vector<sample> &lowest() const { return low; }
+    //! highest values, highest first
+    const std::vector<sample> &highest() const { return high; }
+    //! counts: below the histogram, each bin, above it
+    const std::vector<size_t> &histogram() const { return hist; }
+    double bin_start(size_t b) const { return lo + width * b; } //!< bin b
+
+    //! write a summary, the extremes and the non-empty bins for humans
+    void write(std::ostream &os) const;
+    //! write a JSON object
+    void write_json(std::ostream &os, const std::string &indent) const;
+
+private:
+    void keep_low(const sample &s);
+    void keep_high(const sample &s);
+
+    std::string what;
+    std::string units;
+    double lo;
+    double width;
+    size_t bins;
+    size_t keep;                 // extremes kept on each side
+    std::vector<size_t> hist;    // bins + 2 counts
+    size_t n{ 0 };
+    long long sum{ 0 };          // of the values, in units of 1e-6
+    std::vector<sample> low{};   // lowest values
+    std::vector<sample> high{};  // highest values
+};
+
+//! Geometry of the waters of a conversion
+class geometry_report {
+public:
+    //! An empty report
+    /**
+     * \param models names of the output models, in the order of the
+     *     outputs of process_gro()
+     * \param extremes number of values kept at either end of each
+     *     distribution
+     */
+    explicit geometry_report(const std::vector<std::string> &models,
+                             size_t extremes = 10);
+
+    distribution oh_distance;   //!< O-H distances of the input (Angstrom)
+    distribution hoh_angle;     //!< H-O-H angles of the input (degrees)
+    distribution site_distance; //!< extra sites of the input: distance to O
+    //! displacement of each H atom by the conversion, for each model
+    std::vector<distribution> h_shift;
+
+    //! add the geometry of an input water
+    /**
+     * \param rOH1,rOH2 its O-H distances
+     * \param bisector length of the sum of its unit O-H vectors (see
+     *     shape_arrays)
+     * \param line line of the O atom (from 1), followed by those of H1 and H2
+     */
+    void add_water(double rOH1, double rOH2, double bisector, size_t line) {
+        oh_distance.add(rOH1, line + 1);
+        oh_distance.add(rOH2, line + 2);
+        hoh_angle.add(2.0 * std::acos(std::min(bisector * 0.5, 1.0))
+                      * degrees_per_radian, line);
+    }
+
+    //! an empty report with the same quantities, to be merged into this one
+    geometry_report empty() const { return geometry_report(models, keep); }
+    //! add the values of a report from empty()
+    void merge(const geometry_report &o);
+
+    size_t waters() const { return hoh_angle.count(); } //!< waters seen
+    //! write a report for humans
+    void write(std::ostream &os) const;
+    //! write a JSON object
+    void write_json(std::ostream &os) const;
+
+private:
+    static constexpr double degrees_per_radian{ 57.295779513082320877 };
+    std::vector<std::string> models;
+    size_t keep;
+};
+
+/**@}*/
+
+#endif
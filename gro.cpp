@@ -1,239 +1,1822 @@
 #include "gro.h"
+#include "gro_parse.h"
+#include "gro_writer.h"
+#include "parallel.h"
 #include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unistd.h>
 
 
-// extract atom name from .gro atom line; remove spaces
-std::string atom_name(const std::string l) {
+// return coordinates in Angstroms from .gro atom line
+void coordinates(line_view l, double &x, double &y, double &z) {
+    if (l.length() < 44 || !parse_real(l.substr(20,8), x)
+        || !parse_real(l.substr(28,8), y) || !parse_real(l.substr(36,8), z)) {
+        std::string msg{ "file format error (coordinates)" };
+        throw(gro_error(msg, l));
+    }
+    x *= 10.0;
+    y *= 10.0;
+    z *= 10.0;
+}
+
+// packed code of the first two name characters, upper case, as compared
+// by classify_atom()
+#define NAME_CODE(a, b) (static_cast<unsigned>(a) | static_cast<unsigned>(b) << 8)
+
+name_class classify_atom(line_view l) {
     if (l.length() < 15) {
         std::string msg{ "file format error (atom name)" };
-        throw(gro_error(msg,l));
+        throw(gro_error(msg, l));
+    }
+    // the 5 name characters as one integer (first one in the low byte)
+    const unsigned char *p{ reinterpret_cast<const unsigned char *>(
+                            l.data() + 10) };
+    uint64_t v{ uint64_t{ p[0] } | uint64_t{ p[1] } << 8
+                | uint64_t{ p[2] } << 16 | uint64_t{ p[3] } << 24
+                | uint64_t{ p[4] } << 32 };
+    // skip leading spaces: find the first byte that is not a space
+    uint64_t nonspace{ v ^ 0x2020202020ull };
+    if (nonspace == 0) { return NAME_OTHER; }
+    int b{ 0 };
+    while (((nonspace >> (8 * b)) & 0xff) == 0) { ++b; }
+    // first two characters, upper case (only the letters a-z change, and
+    // for the upper case letters compared here no other byte maps on them);
+    // a single character name leaves a zero byte, which matches nothing
+    unsigned code{ static_cast<unsigned>(v >> (8 * b)) & 0xdfdfu };
+    switch (code) {
+    case NAME_CODE('O', 'W'): return NAME_OW;
+    case NAME_CODE('H', 'W'): return NAME_HW;
+    case NAME_CODE('M', 'W'):
+    case NAME_CODE('L', 'P'):
+    case NAME_CODE('E', 'P'): return NAME_EXTRA;
+    default: return NAME_OTHER;
     }
-    std::string nm{ l.substr(10,5) };
-    nm.erase(0,nm.find_first_not_of(" "));
-    nm.erase(nm.find_last_not_of(" ")+1);
-    return nm;
 }
 
-// return only first 2 chars of atom name as uppercase
-// (done to simplify comparisons)
-std::string standardise(const std::string n) {
-    std::string v{ "" };
-    for (auto c: n) {
-        if (c >= 'a' && c <= 'z') {
-            c += 'A' - 'a';            
+#undef NAME_CODE
+
+namespace {
+
+// random access to the lines of a file held in memory
+// (Container is std::vector<std::string> or text_file)
+template <class Container>
+class memory_lines {
+public:
+    explicit memory_lines(const Container &l) : lines(l) {}
+    bool has(size_t i) const { return i < lines.size(); }
+    line_view operator[](size_t i) const {
+        if (i >= lines.size()) {
+            throw(gro_error("unexpected end of file"));
         }
-        v += c;
+        return lines[i];
     }
-    if (v.size() < 2) { return v; }
-    return v.substr(0,2);
-}
+    void release(size_t) const {} // nothing to free, all lines are kept
+private:
+    const Container &lines;
+};
 
-// return coordinates in Angstroms from .gro atom line
-void coordinates(const std::string l, double &x, double &y, double &z) {
-    std::string msg{ "file format error (coordinates)" };
-    if (l.length() < 44) {
-        throw(gro_error(msg,l));
+// thrown by stream_lines when the input ends too early
+class frame_truncated: public gro_error {
+public:
+    frame_truncated(const std::string &msg, const std::string &line) :
+        gro_error(msg, line) {}
+};
+
+// sliding window over the lines of a stream
+// lines are read on demand and dropped again by release(), so only the
+// few lines between the oldest unreleased one and the lookahead are kept
+class stream_lines {
+public:
+    //! \param tee if not null, every line read is copied to this stream
+    explicit stream_lines(std::istream &is, std::ostream *tee = nullptr) :
+        inp(is), copy(tee), first{ 0 } {}
+
+    bool has(size_t i) {
+        while (first + buf.size() <= i && fill()) {}
+        return i < first + buf.size();
     }
-    try {
-        x = std::stod(l.substr(20,8))*10.0;
-        y = std::stod(l.substr(28,8))*10.0;
-        z = std::stod(l.substr(36,8))*10.0;
+    line_view operator[](size_t i) {
+        if (i < first || !has(i)) {
+            throw(frame_truncated(eof_msg, eof_line));
+        }
+        return buf[i - first];
     }
-    catch(const std::invalid_argument &e) {
-        throw(gro_error(msg,l));
+    // lines before i are no longer needed
+    void release(size_t i) {
+        while (first < i && !buf.empty()) {
+            buf.pop_front();
+            ++first;
+        }
     }
-}
+    // read (and possibly copy) the rest of the input
+    void drain() {
+        while (fill()) { release(first + buf.size()); }
+    }
+    size_t count() const { return first + buf.size(); } // lines read so far
+    size_t bytes() const { return nbytes; } // bytes read so far
 
-// replace the atom counter at the beginning of a .gro atom line by c
-// and remove velocities
-std::string update_line(std::string l, size_t c) {
-    
-    if (l.length() < 44) {
-        std::string msg { "file format error (atom)" };
-        throw(gro_error(msg, l));
-    };
-    
-    char buf[8];
-    std::snprintf(buf, 6, "%5ld", c);
-    
-    return l.substr(0,15) + buf + l.substr(20,24);
-    
-}
-
-// replace coords in addition to update_line(l,c)
-std::string update_line(std::string l, size_t c, double x, double y, double z)
-{
-    std::string t = update_line(l,c); // fix the counter
-    
-    char buf[32]; // print new coordinates
-    std::snprintf(buf, 25, "%8.3f%8.3f%8.3f", x, y, z);
-    
-    return t.substr(0,20) + buf;
-}
-
-// replace atom name in addition to above
-std::string update_line(std::string l, std::string atnam, size_t c,
-                        double x, double y, double z) {
-    
-    std::string t { update_line(l,c,x,y,z) };
-    
-    char buf[6];
-    std::snprintf(buf, 6, "%5s", atnam.data());    
-    t.replace(10, 5, buf);
-    
-    return t;
-}
-
-int process_gro(std::ostream &os, const std::vector<std::string> &lines,
-                const model &wm) {
-    
-    // how many atoms will we need for each water molecule
-    int model_size{ wm.size() };
-    
-    size_t n{ lines.size() };
+    // set the error reported when lines are missing
+    void on_eof(const std::string &msg, const std::string &line) {
+        eof_msg = msg;
+        eof_line = line;
+    }
+private:
+    std::istream &inp;
+    std::ostream *copy;
+    std::deque<std::string> buf; // the window
+    size_t first;                // line number of buf[0]
+    size_t nbytes{ 0 };          // bytes read
+    std::string eof_msg{ "unexpected end of file" };
+    std::string eof_line{};
 
-    if (n < 5) {
-        std::string msg{ "file too short to contain a water molecule" };
-        std::string l{ std::to_string(n) };
-        throw(gro_error(msg,l));
+    bool fill() {
+        std::string l;
+        if (!std::getline(inp, l)) {
+            if (inp.bad()) {
+                throw(std::runtime_error("error while reading input"));
+            }
+            return false;
+        }
+        if (copy) {
+            *copy << l << '\n';
+            if (!*copy) {
+                throw(std::runtime_error("error writing spool file"));
+            }
+        }
+        nbytes += l.size() + 1;
+        buf.push_back(std::move(l));
+        return true;
     }
-    
-    size_t na{ 0 }; // number of atoms
-    long nas{ 0l };  // signed version for reading
+};
 
-    try {
-        nas = std::stol(lines[1]);
-    }    
-    catch (const std::invalid_argument & e) {
-        nas = -1;
+// open an anonymous temporary file (used to spool non-seekable input)
+void open_spool(std::fstream &f) {
+    const char *dir{ std::getenv("TMPDIR") };
+    std::string tmpl{ (dir && *dir) ? dir : "/tmp" };
+    tmpl += "/watcorXXXXXX";
+    std::vector<char> name(tmpl.begin(), tmpl.end());
+    name.push_back('\0');
+    int fd{ mkstemp(name.data()) };
+    if (fd < 0) {
+        std::string msg{ "cannot create spool file in '" + tmpl + "': " };
+        msg += strerror(errno);
+        throw(std::runtime_error(msg));
     }
+    close(fd);
+    f.open(name.data(), std::ios::in | std::ios::out | std::ios::trunc);
+    unlink(name.data()); // file disappears once f is closed
+    if (!f.is_open()) {
+        throw(std::runtime_error("cannot open spool file"));
+    }
+}
+
+// read the atom count from the second line of a .gro file
+size_t atom_count(line_view l) {
+    long nas{ 0l };  // signed version for reading
+
     // unreadable or negative nr. of atoms
-    if (nas < 0) {
+    if (!parse_long(l, nas) || nas < 0) {
         std::string msg{ "file format error (atom count)" };
-        throw(gro_error(msg,lines[1]));
+        throw(gro_error(msg, l));
     }
 
-    na = static_cast<size_t>(nas); // safe now: nas >= 0
-    
-    if (n < na + 2) {
-        std::string msg{ "file too short for " };
-        msg += std::to_string(na) + " atoms";
-        throw(gro_error(msg,lines[1]));
+    return static_cast<size_t>(nas); // safe now: nas >= 0
+}
+
+// if a complete frame (title, atom count, atoms, box) starts at line f of
+// a file held in memory, set na to its number of atoms and return true
+template <class Lines>
+bool frame_at(const Lines &lines, size_t f, size_t &na) {
+    long nas{ 0l };
+    if (!lines.has(f + 1) || !parse_long(lines[f + 1], nas) || nas < 0) {
+        return false;
+    }
+    na = static_cast<size_t>(nas);
+    return lines.has(f + na + 2);
+}
+
+// finds water molecules: names starting OW, HW, HW, optionally followed
+// by extra sites (MW, LP, EP); lines are visited in increasing order and
+// the few looked at ahead are remembered, so each line is classified once
+template <class Lines>
+class water_scanner {
+public:
+    explicit water_scanner(Lines &l) : lines(l) {
+        for (auto &k: key) { k = static_cast<size_t>(-1); }
     }
 
-    // count water molecules to figure out how many atoms we will have
-    // identify consecutive atoms with names starting OW, HW, HW
-    // optionally followed by one or more of MW|LP|EP (last is Amber name)
-    size_t cur{ 2 }; // current line: first atom
-    std::string an{}; // current atom name
-    int nw{ 0 }; // number of water molecules
-    int nwa{ 0 }; // number of atoms in water molecules
+    // class of the atom name on line i
+    name_class at(size_t i) {
+        size_t s{ i & 3 };
+        if (key[s] != i) {
+            cls[s] = classify_atom(lines[i]);
+            key[s] = i;
+        }
+        return cls[s];
+    }
+
+    // true if line cur starts a water molecule
+    bool water(size_t cur) {
+        return at(cur) == NAME_OW && at(cur+1) == NAME_HW
+               && at(cur+2) == NAME_HW;
+    }
+
+    // move cur past the HW2 atom and the extra sites of the water starting
+    // at cur - 2, without going beyond the last atom line (end - 1);
+    // returns the number of atoms skipped
+    size_t skip_tail(size_t end, size_t &cur) {
+        size_t skipped{ 0 };
+        bool extra{ true };
+        // the while loop will run at least once
+        while ((cur < end) && extra) {
+            ++cur; ++skipped;
+            extra = lines.has(cur) && at(cur) == NAME_EXTRA;
+        }
+        return skipped;
+    }
+
+private:
+    Lines &lines;
+    size_t key[4];      // line numbers of the remembered classes
+    name_class cls[4];  // their classes
+};
+
+// count water molecules to figure out how many atoms we will have
+// identify consecutive atoms with names starting OW, HW, HW
+// optionally followed by one or more of MW|LP|EP (last is Amber name)
+// f is the title line of the frame, na its number of atoms
+// if wat is given, the first and one past the last line of each water
+// are stored in wat and tail (see indexed_waters)
+template <class Lines>
+void count_waters(Lines &lines, size_t f, size_t na, size_t &nw, size_t &nwa,
+                  std::vector<size_t> *wat = nullptr,
+                  std::vector<size_t> *tail = nullptr) {
+    size_t cur{ f + 2 }; // current line: first atom
+    size_t end{ f + na + 2 }; // box line
+    nw = 0;  // number of water molecules
+    nwa = 0; // number of atoms in water molecules
 
     // iterate over atom lines (excl. last 2, but should be followed by 2 HW)
-    while (cur < na) {
-        an = standardise(atom_name(lines[cur]));
- //       std::cout << an << ":" << lines[cur] << "\n";
-        if (an == "OW" && standardise(atom_name(lines[cur+1])) == "HW"
-                    && standardise(atom_name(lines[cur+2])) == "HW") {
+    water_scanner<Lines> scan{ lines };
+    while (cur + 2 < end) {
+        lines.release(cur);
+        if (scan.water(cur)) {
             ++nw;
-            nwa += 2; cur += 2; //add 2: the while loop will run at least once
-            an = "MW";
-            while ((cur < na + 2) && (an=="MW" || an=="LP" || an=="EP")) {
-                ++cur; ++nwa;
-                an = standardise(atom_name(lines[cur]));
-            }
+            if (wat) { wat->push_back(cur); }
+            nwa += 2; cur += 2;
+            nwa += scan.skip_tail(end, cur);
+            if (tail) { tail->push_back(cur); }
         } else {
             ++cur;
         }
-    } 
+    }
     // NOTE: we may have 2 trailing atom lines with non-water atoms
     // plus the box, but we can ignore them here (not in printing)
-    
-
-    // Now we can write the modified file
-    
-    int modified{ 0 }; // number of water molecules processed
-    
-    os << lines[0] << '\n'; // title line written unchanged
-    os << na - nwa + nw*model_size << '\n'; // new number of atoms
-    
-    cur = 2; // rewind for printing of atoms
+}
+
+// water molecules of a frame found again while it is written
+template <class Lines>
+class scanned_waters {
+public:
+    explicit scanned_waters(Lines &l) : scan(l) {}
+    // true if a water starts at line cur; tail is set to the line after it
+    // (end is the box line)
+    bool at(size_t cur, size_t end, size_t &tail) {
+        if (!scan.water(cur)) { return false; }
+        tail = cur + 2;
+        scan.skip_tail(end, tail);
+        return true;
+    }
+private:
+    water_scanner<Lines> scan;
+};
+
+// water molecules of a frame taken from the index made by count_waters()
+class indexed_waters {
+public:
+    indexed_waters(const std::vector<size_t> &w, const std::vector<size_t> &t) :
+        wat(w), tail(t) {}
+    bool at(size_t cur, size_t, size_t &t) {
+        if (j >= wat.size() || wat[j] != cur) { return false; }
+        t = tail[j++];
+        return true;
+    }
+private:
+    const std::vector<size_t> &wat;
+    const std::vector<size_t> &tail;
+    size_t j{ 0 }; // next water
+};
+
+// the value of the 8 character coordinate field f in units of its last
+// digit (0.001 nm) into m, if the field has the layout of "%8.3f"; neg is
+// set for a minus sign
+bool field_digits(const char *f, long &m, bool &neg) {
+    if (f[4] != '.') { return false; }
+    int i{ 0 };
+    while (i < 3 && f[i] == ' ') { ++i; }
+    neg = f[i] == '-';
+    if (neg) { ++i; }
+    if (i > 3 || (f[i] == '0' && i < 3)) { return false; } // leading zero
+    m = 0;
+    for (; i < 8; ++i) {
+        unsigned d{ static_cast<unsigned>(f[i] - '0') };
+        if (i == 4) { continue; }
+        if (d > 9) { return false; }
+        m = 10 * m + static_cast<long>(d);
+    }
+    if (neg) { m = -m; }
+    return true;
+}
+
+// true if the 8 character coordinate field f is what gro_writer writes
+// for x (Angstrom): the field has the layout of "%8.3f" and its value is
+// what x rounds to
+bool written_as(const char *f, double x) {
+    long m;
+    bool neg;
+    if (!field_digits(f, m, neg)) { return false; }
+    // away from ties, so that rounding errors of a few ulp do not matter
+    double d{ x * 100.0 - static_cast<double>(m) };
+    if (!(d > -0.499999 && d < 0.499999)) { return false; }
+    return m != 0 || neg == std::signbit(x); // "-0.000"
+}
+
+// true if the coordinate field f has the layout of "%8.3f", is not zero
+// (whose sign a rounding error could change) and x (Angstrom) is within
+// the given fraction of its last digit from its value
+bool written_near(const char *f, double x, double within) {
+    long m;
+    bool neg;
+    if (!field_digits(f, m, neg) || m == 0) { return false; }
+    return std::fabs(x * 100.0 - static_cast<double>(m)) < within;
+}
+
+// extra site names as gro_writer writes them (right aligned in 5 columns)
+struct written_names {
+    explicit written_names(const model &wm) {
+        for (int k = 0; k < wm.size() - 3; ++k) {
+            const char *name{ wm.extra_name(k) };
+            size_t n{ std::min(std::strlen(name), size_t{ 5 }) };
+            std::memset(field[k], ' ', 5 - n);
+            std::memcpy(field[k] + 5 - n, name, n);
+        }
+    }
+    char field[max_extra_sites][5];
+};
+
+// true if the lines of a water (cur to tail) already hold its new sites
+// as they would be written, so they can be copied with new atom numbers
+// (fast path for waters that are in the model geometry already): O, H1
+// and H2 at x and the extra sites at ext (x, y, z each, in Angstrom) of a
+// model of model_size sites
+template <class Lines>
+bool unchanged_water(Lines &lines, size_t cur, size_t tail, int model_size,
+                     const written_names &names, const double *x,
+                     const double *ext) {
+    if (tail - cur != static_cast<size_t>(model_size)) { return false; }
+    for (int a = 0; a < 3; ++a) {
+        const char *f{ lines[cur + a].data() + 20 };
+        if (!written_as(f, x[3 * a]) || !written_as(f + 8, x[3 * a + 1])
+            || !written_as(f + 16, x[3 * a + 2])) {
+            return false;
+        }
+    }
+    line_view h2{ lines[cur + 2] };
+    for (int k = 0; k < model_size - 3; ++k) {
+        // written with the residue of H2 and the name of the model
+        line_view l{ lines[cur + 3 + k] };
+        if (l.size() < 44 || std::memcmp(l.data(), h2.data(), 10) != 0
+            || std::memcmp(l.data() + 10, names.field[k], 5) != 0) {
+            return false;
+        }
+        const char *f{ l.data() + 20 };
+        if (!written_as(f, ext[3 * k]) || !written_as(f + 8, ext[3 * k + 1])
+            || !written_as(f + 16, ext[3 * k + 2])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the geometry of a model as tested by ideal_water()
+struct model_shape {
+    explicit model_shape(const model &wm) :
+        size{ wm.size() }, names{ wm } {
+        const model_definition &d{ wm.definition() };
+        double half{ d.angle * std::atan(1.0) / 90.0 }; // in radian
+        ha = std::cos(half) * d.rOH;
+        hb = std::sin(half) * d.rOH;
+        for (int k = 0; k < size - 3; ++k) {
+            const virtual_site &v{ d.sites[k] };
+            site[k] = site_coefficients{ v.along_a, v.along_b, v.along_c };
+        }
+    }
+    int size;      // number of sites
+    double ha, hb; // H1 along the frame vectors a and b (H2: ha, -hb)
+    site_coefficients site[max_extra_sites]; // extra sites
+    written_names names; // their names
+};
+
+// true if the lines of a water (cur to tail; O, H1 and H2 read into x, in
+// Angstrom) are in the geometry of the model so closely that they are
+// what the transform would write, found without doing it: the O-H
+// lengths and the H-O-H angle move neither H atom by more than 0.48 of
+// the last digit, and the extra sites are within 0.49 of it of where the
+// model puts them along the frame of the water. The transform keeps O and
+// the frame, and its rounding errors are far below the margins left, so
+// unchanged_water() would accept the water too (it also accepts some that
+// fail here: near the tolerance, or with a coordinate of 0.000).
+template <class Lines>
+bool ideal_water(Lines &lines, size_t cur, size_t tail, const model_shape &m,
+                 const double *x) {
+    if (tail - cur != static_cast<size_t>(m.size)) { return false; }
+
+    // O-H vectors: r1 u1 and r2 u2, with u1 = (la a + lb b) / 2 and
+    // u2 = (la a - lb b) / 2 along the unit vectors a and b of the frame
+    double v[6];
+    double r[2];
+    for (int a = 0; a < 2; ++a) {
+        for (int k = 0; k < 3; ++k) { v[3*a+k] = x[3*a+3+k] - x[k]; }
+        r[a] = std::sqrt(v[3*a]*v[3*a] + v[3*a+1]*v[3*a+1]
+                         + v[3*a+2]*v[3*a+2]);
+        if (r[a] < 1.0e-4) { return false; }
+        for (int k = 0; k < 3; ++k) { v[3*a+k] /= r[a]; }
+    }
+    double ax{ v[0] + v[3] }, ay{ v[1] + v[4] }, az{ v[2] + v[5] };
+    double bx{ v[0] - v[3] }, by{ v[1] - v[4] }, bz{ v[2] - v[5] };
+    double la{ std::sqrt(ax*ax + ay*ay + az*az) };
+    double lb{ std::sqrt(bx*bx + by*by + bz*bz) };
+    if (la < 1.0e-4 || la > 1.9999) { return false; } // bad for transform
+    const double tol{ 0.0048 }; // Angstrom: 0.48 of the last digit
+    for (int a = 0; a < 2; ++a) {
+        double da{ r[a] * la / 2.0 - m.ha };
+        double db{ r[a] * lb / 2.0 - m.hb };
+        if (da*da + db*db > tol*tol) { return false; }
+    }
+
+    // the fields as written (O as read, H within rounding of the value read)
+    const char *f{ lines[cur].data() + 20 };
+    for (int k = 0; k < 3; ++k) {
+        if (!written_as(f + 8 * k, x[k])) { return false; }
+    }
+    for (int a = 1; a < 3; ++a) {
+        f = lines[cur + a].data() + 20;
+        for (int k = 0; k < 3; ++k) {
+            if (!written_near(f + 8 * k, x[3 * a + k], 0.01)) {
+                return false;
+            }
+        }
+    }
+    if (m.size == 3) { return true; }
+
+    // the extra sites along the frame
+    ax /= la; ay /= la; az /= la;
+    bx /= lb; by /= lb; bz /= lb;
+    double cx{ ay*bz - az*by }, cy{ az*bx - ax*bz }, cz{ ax*by - ay*bx };
+    line_view h2{ lines[cur + 2] };
+    for (int k = 0; k < m.size - 3; ++k) {
+        line_view l{ lines[cur + 3 + k] };
+        if (l.size() < 44 || std::memcmp(l.data(), h2.data(), 10) != 0
+            || std::memcmp(l.data() + 10, m.names.field[k], 5) != 0) {
+            return false;
+        }
+        const site_coefficients &s{ m.site[k] };
+        double ex{ x[0] + s.a*ax + s.b*bx + s.c*cx };
+        double ey{ x[1] + s.a*ay + s.b*by + s.c*cy };
+        double ez{ x[2] + s.a*az + s.b*bz + s.c*cz };
+        f = l.data() + 20;
+        if (!written_near(f, ex, 0.49) || !written_near(f + 8, ey, 0.49)
+            || !written_near(f + 16, ez, 0.49)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// record the number of waters copied unchanged (a count, not timed)
+void count_unchanged(run_stats *stats, size_t kept) {
+    if (stats) { stats->add_fast_path(kept); }
+}
+
+// write the title, atom count and atoms of the frame starting at line f,
+// using the counts from count_waters() and the waters found by waters
+// (scanned_waters or indexed_waters); returns the number of waters and
+// adds those copied unchanged to kept (if given)
+template <class Lines, class Waters>
+size_t write_frame(gro_writer &w, Lines &lines, size_t f, size_t na,
+                   size_t nw, size_t nwa, const model &wm, Waters &&waters,
+                   size_t *kept = nullptr) {
+
+    // how many atoms will we need for each water molecule
+    int model_size{ wm.size() };
+    model_shape shape{ wm };
+
+    size_t modified{ 0 }; // number of water molecules processed
+
+    w.line(lines[f]); // title line written unchanged
+    w.count(na - nwa + nw*model_size); // new number of atoms
+
+    size_t cur{ f + 2 }; // first atom
+    size_t end{ f + na + 2 }; // box line
     size_t counter{ 1 }; // for atom numbering in file
-    double x0, x1, x2, y0, y1, y2, z0, z1, z2; // coords of 3 water atoms
-    std::vector<double> extras{};  // coords of extra sites (xyz order)
-    while (cur < na) {
-        an = standardise(atom_name(lines[cur]));
-        if (an == "OW" && standardise(atom_name(lines[cur+1])) == "HW"
-                    && standardise(atom_name(lines[cur+2])) == "HW") {
+    double x[9];      // coords of O, H1, H2 (xyz order)
+    double extras[3 * max_extra_sites]; // coords of extra sites (xyz order)
+    size_t tail{ 0 }; // line after the current water
+    while (cur + 2 < end) {
+        lines.release(cur);
+        if (waters.at(cur, end, tail)) {
 
             // extract coords of OW, HW1, HW2
-            coordinates(lines[cur],x0,y0,z0);
-            coordinates(lines[cur+1],x1,y1,z1);
-            coordinates(lines[cur+2],x2,y2,z2);
-        
-            // idealise coordinates & store extra sites in extras
-            extras = wm.transform(x0,y0,z0,x1,y1,z1,x2,y2,z2);
-        
-            // convert from Angstrom to nm for gro format
-            x0 /= 10.0; y0 /= 10.0; z0 /= 10.0;
-            x1 /= 10.0; y1 /= 10.0; z1 /= 10.0;
-            x2 /= 10.0; y2 /= 10.0; z2 /= 10.0;
-        
-            // write updated water atoms
-            os << update_line(lines[cur], counter, x0, y0, z0) << '\n';
-            os << update_line(lines[cur+1], counter+1, x1, y1, z1) << '\n';
-            os << update_line(lines[cur+2], counter+2, x2, y2, z2) << '\n';
-            
-            // write possible extra sites
-            // M site (4-site models)
-            if (model_size == 4) {
-                os << update_line(lines[cur+2], "MW", counter+3, extras[0]/10.0,
-                                  extras[1]/10.0, extras[2]/10.0);
-                os << '\n';
-            }
-
-            // LP sites (5-site models)
-            if (model_size == 5) {
-                os << update_line(lines[cur+2], "LP1", counter+3,
-                        extras[0]/10.0, extras[1]/10.0, extras[2]/10.0);
-                os << '\n';
-                os << update_line(lines[cur+2], "LP2", counter+4,
-                        extras[3]/10.0, extras[4]/10.0, extras[5]/10.0);
-                os << '\n';
+            coordinates(lines[cur],x[0],x[1],x[2]);
+            coordinates(lines[cur+1],x[3],x[4],x[5]);
+            coordinates(lines[cur+2],x[6],x[7],x[8]);
 
+            // in the model geometry already (checked before the transform,
+            // then on its result): copy, renumbered; else idealise
+            // coordinates & store extra sites in extras
+            bool ideal{ ideal_water(lines, cur, tail, shape, x) };
+            if (!ideal && !wm.transform(x, extras)) {
+                throw(water_error(lines[cur]));
             }
 
-            // skip extra sites of original model if present
-            cur += 2; //add 2: the while loop will run at least once
-            an = "MW";
-            while ((cur < na + 2) && (an=="MW" || an=="LP" || an=="EP")) {
-                ++cur;
-                an = standardise(atom_name(lines[cur]));
+            if (ideal || unchanged_water(lines, cur, tail, model_size,
+                                         shape.names, x, extras)) {
+                for (int a = 0; a < model_size; ++a) {
+                    w.atom(lines[cur+a], counter+a);
+                }
+                if (kept) { ++*kept; }
+            } else {
+                // write updated water atoms (converted from Angstrom to nm)
+                w.atom(lines[cur], counter, x[0]/10.0, x[1]/10.0, x[2]/10.0);
+                w.atom(lines[cur+1], counter+1,
+                       x[3]/10.0, x[4]/10.0, x[5]/10.0);
+                w.atom(lines[cur+2], counter+2,
+                       x[6]/10.0, x[7]/10.0, x[8]/10.0);
+
+                // write extra sites (M site or LP sites) of the new model
+                for (int k = 0; k < model_size - 3; ++k) {
+                    w.atom(lines[cur+2], wm.extra_name(k), counter+3+k,
+                           extras[3*k]/10.0, extras[3*k+1]/10.0,
+                           extras[3*k+2]/10.0);
+                }
             }
+
+            // skip extra sites of original model if present
+            cur = tail;
             counter += model_size;
+            ++modified;
         } else {
             // replace atom counter, remove velocities
-            os << update_line(lines[cur],counter) << '\n';
+            w.atom(lines[cur],counter);
             ++cur;
             ++counter;
         }
-    } 
-    
-    // copy the rest of the file to output
-    while (cur < lines.size()) {
-        if (cur < na + 2) {       // still atoms
-            os <<  update_line(lines[cur],counter) << '\n';
-            ++cur; ++counter;
+    }
+
+    // the last atoms (too few to start a water)
+    while (cur < end && lines.has(cur)) {
+        lines.release(cur);
+        w.atom(lines[cur],counter);
+        ++cur; ++counter;
+    }
+
+    return modified;
+}
+
+// copy lines from cur to the end of the input unchanged
+template <class Lines>
+void copy_rest(gro_writer &w, Lines &lines, size_t cur) {
+    while (lines.has(cur)) {
+        lines.release(cur);
+        w.line(lines[cur]);
+        ++cur;
+    }
+}
+
+// check the first frame of a file held in memory; returns its atom count
+template <class Container>
+size_t check_first_frame(const Container &lines) {
+
+    size_t n{ lines.size() };
+
+    if (n < 5) {
+        std::string msg{ "file too short to contain a water molecule" };
+        std::string l{ std::to_string(n) };
+        throw(gro_error(msg,l));
+    }
+
+    size_t na{ atom_count(lines[1]) }; // number of atoms
+
+    if (n < na + 2) {
+        std::string msg{ "file too short for " };
+        msg += std::to_string(na) + " atoms";
+        throw(gro_error(msg, line_view(lines[1])));
+    }
+
+    return na;
+}
+
+// process a file held in memory, one frame after the other
+// (Container as for memory_lines)
+template <class Container>
+size_t process_lines(std::ostream &os, const Container &lines,
+                     const model &wm) {
+
+    size_t na{ check_first_frame(lines) }; // number of atoms
+
+    memory_lines<Container> src{ lines };
+    gro_writer w{ &os };
+    size_t modified{ 0 };
+    size_t f{ 0 }; // first line of current frame
+    std::vector<size_t> wat;  // first line of each water
+    std::vector<size_t> tail; // line after each water
+    do {
+        size_t nw{ 0 };  // number of water molecules
+        size_t nwa{ 0 }; // number of atoms in water molecules
+        wat.clear();
+        tail.clear();
+        count_waters(src, f, na, nw, nwa, &wat, &tail);
+        modified += write_frame(w, src, f, na, nw, nwa, wm,
+                                indexed_waters(wat, tail));
+        f += na + 2;
+        if (src.has(f)) { w.line(src[f]); ++f; } // box
+    } while (frame_at(src, f, na));
+
+    copy_rest(w, src, f);
+    w.flush();
+
+    return modified;
+}
+
+// check that an atom line can be written by gro_writer::atom()
+void check_atom_line(line_view l) {
+    if (l.length() < 44) {
+        std::string msg { "file format error (atom)" };
+        throw(gro_error(msg, l));
+    }
+}
+
+// the waters written in the places of the waters of a reordered frame
+// (see water_order.h): for place g, the O line of the water written there
+// (counted from the title line) and its number of lines
+struct water_source {
+    std::vector<size_t> line;
+    std::vector<uint32_t> sites;
+};
+
+// a block of consecutive atom lines, converted independently of the others
+// (the waters are kept as 32 bit line offsets from begin: a chunk is at most
+// max_chunk_lines long, see make_chunks())
+struct chunk {
+    size_t begin;               // first line
+    size_t end;                 // one past the last line
+    std::vector<uint32_t> wat;  // O atom of each water (offset from begin)
+    std::vector<uint32_t> tail; // line after its last site (offset)
+    size_t nwa;                 // number of atoms in water molecules
+    size_t counter;             // output number of the first atom
+    std::vector<double> xyz[9]; // O, H1, H2 coordinates (x, y, z each)
+    std::vector<double> axes[9]; // frame a, b, c of each water (x, y, z
+                                 // each; see orient_chunk())
+    std::exception_ptr err;     // first format error found by parse_chunk
+    std::string out;            // converted lines
+    size_t kept{ 0 };           // waters copied unchanged by convert_chunk
+    const water_source *from{ nullptr }; // reordered: the waters written
+    size_t frame_line{ 0 };     // title line of the frame (if reordered)
+    size_t first_water{ 0 };    // place of the first water in the frame
+
+    size_t water(size_t j) const { return begin + wat[j]; } // line of O
+    size_t water_end(size_t j) const { return begin + tail[j]; }
+    // the lines of the input water written in the place of water j
+    size_t source(size_t j) const {
+        return from ? frame_line + from->line[first_water + j] : water(j);
+    }
+    size_t source_end(size_t j) const {
+        return from ? source(j) + from->sites[first_water + j] : water_end(j);
+    }
+};
+
+// atom line l with the residue number of line r (in buf, if l is long
+// enough to be written as an atom)
+line_view renumbered(line_view l, line_view r, char (&buf)[44]) {
+    if (l.size() < 44 || r.size() < 5) { return l; }
+    std::memcpy(buf, l.data(), 44);
+    std::memcpy(buf, r.data(), 5);
+    return line_view(buf, 44);
+}
+
+// a frame of a file held in memory
+struct frame {
+    size_t first;              // title line
+    size_t na;                 // number of atoms
+    std::vector<chunk> chunks; // the atoms
+};
+
+// chunks are split so that they are at most this long (lines), except
+// where no chunk can start (see chunk_start_at())
+const size_t max_chunk_lines{ size_t{ 1 } << 24 };
+// and in large-system mode (see frame_processor)
+const size_t max_large_chunk_lines{ size_t{ 1 } << 18 };
+
+// true if a chunk may start at line i: the line cannot be part of a water
+// molecule started on an earlier line (any name except HW, MW, LP, EP)
+template <class Lines>
+bool chunk_start_at(Lines &lines, size_t i) {
+    try {
+        name_class c{ classify_atom(lines[i]) };
+        return c != NAME_HW && c != NAME_EXTRA;
+    }
+    catch (const gro_error &e) {
+        return false; // not here: the error is reported (in order) by the scan
+    }
+}
+
+// split the na atom lines starting at line first into at least n chunks
+// of at most max_lines lines each (if possible); a water molecule never
+// straddles two chunks
+template <class Lines>
+std::vector<chunk> make_chunks(Lines &lines, size_t first, size_t na,
+                               size_t n, size_t max_lines) {
+    n = std::max(n, (na + max_lines - 1) / max_lines);
+    size_t last{ first + std::max(na, size_t{ 2 }) - 2 }; // last line that
+                                                         // may start a water
+    size_t begin{ first };
+    std::vector<chunk> chunks;
+    for (size_t k = 1; k < n; ++k) {
+        size_t b{ first + na / n * k + na % n * k / n }; // na * k / n
+        if (b <= begin) { continue; }
+        while (b < last && !chunk_start_at(lines, b)) { ++b; }
+        if (b >= last) { break; } // rest goes to the last chunk
+        chunks.push_back(chunk());
+        chunks.back().begin = begin;
+        chunks.back().end = b;
+        begin = b;
+    }
+    chunks.push_back(chunk());
+    chunks.back().begin = begin;
+    chunks.back().end = first + na;
+    for (auto &c: chunks) {
+        if (c.end - c.begin > UINT32_MAX) {
+            std::string msg{ "too many atoms that cannot start a chunk" };
+            throw(gro_error(msg, lines[c.begin]));
+        }
+    }
+    return chunks;
+}
+
+// find the water molecules in a chunk, as count_waters() does for a frame
+// (end_atoms is one past the last atom line of the frame); with a selection
+// sel of the atoms from line first on, only the waters whose O atom is
+// selected are taken, and only the selected lines are looked at
+template <class Lines>
+void scan_chunk(Lines &lines, size_t end_atoms, chunk &c,
+                const atom_selection *sel = nullptr, size_t first = 0) {
+    c.wat.clear();
+    c.tail.clear();
+    c.nwa = 0;
+    size_t cur{ c.begin };
+    water_scanner<Lines> scan{ lines };
+    while (cur < c.end && cur + 2 < end_atoms) {
+        if (sel) { // skip to the next selected atom
+            size_t i{ sel->next(cur - first) };
+            if (i == atom_selection::npos) { break; }
+            cur = first + i;
+            if (cur >= c.end || cur + 2 >= end_atoms) { break; }
+        }
+        if (scan.water(cur)) {
+            c.wat.push_back(static_cast<uint32_t>(cur - c.begin));
+            c.nwa += 2; cur += 2;
+            c.nwa += scan.skip_tail(end_atoms, cur);
+            c.tail.push_back(static_cast<uint32_t>(cur - c.begin));
         } else {
-            os << lines[cur] << '\n';
             ++cur;
         }
     }
+}
+
+// check that the atoms of a selection are in the frame at line f, with na
+// atoms
+template <class Lines>
+void check_selection(Lines &lines, const atom_selection *sel, size_t f,
+                     size_t na) {
+    if (sel && sel->end() > na) {
+        std::string msg{ "index group has atom " + std::to_string(sel->end())
+                         + ", the frame has " + std::to_string(na)
+                         + " atoms" };
+        throw(gro_error(msg, lines[f + 1]));
+    }
+}
+
+// true if the atom names in a chunk are those of the reference chunk
+// (whose lines start shift lines earlier), so its layout can be reused
+bool same_names(const text_file &lines, const chunk &ref, size_t shift) {
+    for (size_t i = ref.begin; i < ref.end; ++i) {
+        line_view a{ lines[i] };
+        line_view b{ lines[i + shift] };
+        if (a.size() < 15 || b.size() < 15
+            || std::memcmp(a.data() + 10, b.data() + 10, 5) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// copy the layout of the reference chunk, shifted by shift lines
+void reuse_layout(const chunk &ref, size_t shift, chunk &c) {
+    c.begin = ref.begin + shift;
+    c.end = ref.end + shift;
+    c.nwa = ref.nwa;
+    c.wat = ref.wat; // offsets from begin: the same
+    c.tail = ref.tail;
+}
+
+// parse the coordinates of the waters in a chunk and check the other atom
+// lines; stops at the first error, which is kept in c.err (it is reported
+// after any bad water structure found before it, see convert_chunk())
+template <class Lines>
+void parse_chunk(Lines &lines, chunk &c) {
+    for (auto &v: c.xyz) {
+        v.clear();
+        v.reserve(c.wat.size());
+    }
+    c.err = nullptr;
+    size_t cur{ c.begin };
+    size_t j{ 0 }; // next water
+    try {
+        double x[9];
+        while (cur < c.end) {
+            if (j < c.wat.size() && cur == c.water(j)) {
+                size_t s{ c.source(j) };
+                coordinates(lines[s],x[0],x[1],x[2]);
+                coordinates(lines[s+1],x[3],x[4],x[5]);
+                coordinates(lines[s+2],x[6],x[7],x[8]);
+                for (int k = 0; k < 9; ++k) { c.xyz[k].push_back(x[k]); }
+                cur = c.water_end(j);
+                ++j;
+            } else {
+                check_atom_line(lines[cur]);
+                ++cur;
+            }
+        }
+    }
+    catch (...) {
+        c.err = std::current_exception();
+    }
+}
+
+// format the atoms of a chunk with the idealised waters (see convert_chunk):
+// new O, H1 and H2 in xyz, extra sites in ext (arrays of x, y, z each),
+// the first atom numbered counter; the waters flagged in ideal (if not
+// nullptr) were found in the model geometry by ideal_water() and are
+// copied without their new sites. Returns the number of waters copied
+// unchanged (a reordered water keeps the residue number of its place).
+template <class Lines>
+size_t format_chunk(Lines &lines, const model &wm, const chunk &c,
+                    size_t counter, const double *const *xyz,
+                    const double *const *ext, gro_writer &w,
+                    const unsigned char *ideal = nullptr) {
+    int model_size{ wm.size() };
+    size_t n{ c.xyz[0].size() };
+    const char *names[max_extra_sites]; // names of the extra sites
+    for (int k = 0; k < model_size - 3; ++k) { names[k] = wm.extra_name(k); }
+    written_names fields{ wm };
+    size_t j{ 0 }; // next water
+    size_t cur{ c.begin };
+    size_t kept{ 0 };
+    while (cur < c.end) {
+        if (j < n && cur == c.water(j)) {
+            double x[9]; // new O, H1, H2
+            double e[3 * max_extra_sites]; // new extra sites
+            for (int k = 0; k < 9; ++k) { x[k] = xyz[k][j]; }
+            for (int k = 0; k < 3 * (model_size - 3); ++k) { e[k] = ext[k][j]; }
+            size_t s{ c.source(j) }; // lines of the water written here
+            char buf[44];
+            auto line = [&](int a) {
+                return c.from ? renumbered(lines[s+a], lines[cur], buf)
+                              : lines[s+a];
+            };
+            if ((ideal && ideal[j])
+                || unchanged_water(lines, s, c.source_end(j), model_size,
+                                   fields, x, e)) {
+                for (int a = 0; a < model_size; ++a) {
+                    w.atom(line(a), counter+a);
+                }
+                ++kept;
+            } else {
+                // convert from Angstrom to nm for gro format
+                for (int k = 0; k < 9; ++k) { x[k] /= 10.0; }
+                w.atom(line(0), counter, x[0], x[1], x[2]);
+                w.atom(line(1), counter+1, x[3], x[4], x[5]);
+                w.atom(line(2), counter+2, x[6], x[7], x[8]);
+                for (int k = 0; k < model_size - 3; ++k) {
+                    w.atom(line(2), names[k], counter+3+k, e[3*k]/10.0,
+                           e[3*k+1]/10.0, e[3*k+2]/10.0);
+                }
+            }
+            counter += model_size;
+            cur = c.water_end(j);
+            ++j;
+        } else {
+            w.atom(lines[cur], counter);
+            ++cur;
+            ++counter;
+        }
+    }
+    return kept;
+}
+
+// pointers to the data of arrays of coordinates
+void data_of(std::vector<double> *v, int n, const double **p) {
+    for (int k = 0; k < n; ++k) { p[k] = v[k].data(); }
+}
+
+// add the input geometry of the waters of a parsed chunk to r: their O-H
+// distances and bisectors g (rOH1, rOH2, bisector; see shape_arrays) and
+// the distances of their extra sites from O, read from their lines (a line
+// whose coordinates cannot be read is left out, it is not converted anyway)
+template <class Lines>
+void report_input(Lines &lines, const chunk &c, const double *const *g,
+                  geometry_report &r) {
+    size_t n{ c.xyz[0].size() };
+    for (size_t j = 0; j < n; ++j) {
+        size_t s{ c.source(j) };
+        r.add_water(g[0][j], g[1][j], g[2][j], s + 1);
+        for (size_t l = s + 3; l < c.source_end(j); ++l) {
+            double x, y, z;
+            try {
+                coordinates(lines[l], x, y, z);
+            }
+            catch (const gro_error &) {
+                continue;
+            }
+            x -= c.xyz[0][j]; y -= c.xyz[1][j]; z -= c.xyz[2][j];
+            r.site_distance.add(std::sqrt(x*x + y*y + z*z), l + 1);
+        }
+    }
+}
+
+// add how far the H atoms of the waters of a chunk moved to d: from h0 to
+// h (H1 then H2, x, y, z each)
+void report_moved(const chunk &c, const double *const *h0,
+                  const double *const *h, distribution &d) {
+    size_t n{ c.xyz[0].size() };
+    for (size_t j = 0; j < n; ++j) {
+        size_t s{ c.source(j) };
+        for (int a = 0; a < 2; ++a) {
+            double dx{ h[3*a][j] - h0[3*a][j] };
+            double dy{ h[3*a+1][j] - h0[3*a+1][j] };
+            double dz{ h[3*a+2][j] - h0[3*a+2][j] };
+            d.add(std::sqrt(dx*dx + dy*dy + dz*dz), s + 2 + a);
+        }
+    }
+}
+
+// convert the atoms of a parsed chunk (c.counter must be set) into dest,
+// which has room for exactly the chunk's records, or into c.out if nullptr
+// errors are reported as write_frame() would: the first one in line order;
+// the waters are added to the report r (if not nullptr)
+template <class Lines>
+void convert_chunk(Lines &lines, const model &wm, chunk &c,
+                   char *dest = nullptr, geometry_report *r = nullptr) {
+
+    int model_size{ wm.size() };
+
+    // the waters in the model geometry already (see ideal_water()) are
+    // left out of the transform, unless the input geometry of all of them
+    // is reported
+    size_t n{ c.xyz[0].size() };
+    std::vector<unsigned char> ideal;
+    std::vector<size_t> todo; // the waters transformed, if not all
+    if (!r && n > 0) {
+        model_shape m{ wm };
+        ideal.resize(n);
+        double x[9];
+        for (size_t j = 0; j < n; ++j) {
+            for (int k = 0; k < 9; ++k) { x[k] = c.xyz[k][j]; }
+            if (ideal_water(lines, c.source(j), c.source_end(j), m, x)) {
+                ideal[j] = 1;
+            } else {
+                todo.push_back(j);
+            }
+        }
+        if (todo.size() == n) { ideal.clear(); } // none: transform in place
+    }
+    bool some{ !ideal.empty() };
+    std::vector<double> in[9]; // O, H1, H2 of the waters in todo
+    if (some) {
+        for (int k = 0; k < 9; ++k) {
+            in[k].resize(todo.size());
+            for (size_t i = 0; i < todo.size(); ++i) {
+                in[k][i] = c.xyz[k][todo[i]];
+            }
+        }
+    }
+    std::vector<double> *xyz{ some ? in : c.xyz }; // the waters transformed
+    size_t nt{ xyz[0].size() };
+
+    // transform: idealise all waters parsed (before any error) in one batch
+    std::vector<double> ext[3 * max_extra_sites]; // extra site coordinates
+    for (int k = 0; k < 3 * (model_size - 3); ++k) { ext[k].resize(nt); }
+    std::vector<double> shape[3]; // input geometry (reported only)
+    std::vector<double> h0[6];    // input H1, H2 (reported only)
+    if (nt > 0) {
+        site_arrays O{ &xyz[0][0], &xyz[1][0], &xyz[2][0] };
+        site_arrays H1{ &xyz[3][0], &xyz[4][0], &xyz[5][0] };
+        site_arrays H2{ &xyz[6][0], &xyz[7][0], &xyz[8][0] };
+        site_arrays extra[max_extra_sites];
+        for (int k = 0; k < max_extra_sites; ++k) {
+            extra[k] = site_arrays{ ext[3*k].data(), ext[3*k+1].data(),
+                                     ext[3*k+2].data() };
+        }
+        shape_arrays sh{ nullptr, nullptr, nullptr };
+        if (r) {
+            for (auto &v: shape) { v.resize(n); }
+            for (int k = 0; k < 6; ++k) { h0[k] = c.xyz[3 + k]; }
+            sh = shape_arrays{ shape[0].data(), shape[1].data(),
+                               shape[2].data() };
+        }
+        std::vector<unsigned char> bad(nt);
+        if (wm.transform(nt, O, H1, H2, extra, bad.data(),
+                         r ? &sh : nullptr) > 0) {
+            size_t j{ 0 };
+            while (!bad[j]) { ++j; }
+            throw(water_error(lines[c.source(some ? todo[j] : j)]));
+        }
+    }
+    if (some) {
+        // back in the places of the waters transformed
+        for (int k = 3; k < 9; ++k) {
+            for (size_t i = 0; i < nt; ++i) { c.xyz[k][todo[i]] = in[k][i]; }
+        }
+        for (int k = 0; k < 3 * (model_size - 3); ++k) {
+            std::vector<double> e(n);
+            for (size_t i = 0; i < nt; ++i) { e[todo[i]] = ext[k][i]; }
+            ext[k].swap(e);
+        }
+    }
+    if (c.err) { std::rethrow_exception(c.err); }
+    if (r && n > 0) {
+        const double *g[3];
+        const double *from[6];
+        const double *to[6];
+        data_of(shape, 3, g);
+        data_of(h0, 6, from);
+        data_of(c.xyz + 3, 6, to);
+        report_input(lines, c, g, *r);
+        report_moved(c, from, to, r->h_shift[0]);
+    }
+
+    // format: same lines as write_frame()
+    const double *x[9];
+    const double *e[3 * max_extra_sites];
+    data_of(c.xyz, 9, x);
+    data_of(ext, 3 * (model_size - 3), e);
+    size_t nout{ c.end - c.begin - c.nwa + n * model_size };
+    const unsigned char *copied{ some ? ideal.data() : nullptr };
+    if (dest) {
+        gro_writer w{ dest, dest + nout * 45 };
+        c.kept = format_chunk(lines, wm, c, c.counter, x, e, w, copied);
+    } else {
+        gro_writer w{ nullptr, nout * 45 };
+        c.kept = format_chunk(lines, wm, c, c.counter, x, e, w, copied);
+        c.out = w.release();
+    }
+    for (auto &v: c.xyz) { std::vector<double>().swap(v); }
+}
+
+// find the frames of the waters of a parsed chunk once for several models
+// (see place_chunk()); the first bad water structure, or else the format
+// error of the chunk, is left in c.err, in the order of convert_chunk().
+// The input geometry is added to the report r (if not nullptr).
+template <class Lines>
+void orient_chunk(Lines &lines, chunk &c, geometry_report *r = nullptr) {
+    size_t n{ c.xyz[0].size() };
+    for (auto &v: c.axes) { v.resize(n); }
+    if (n == 0) { return; }
+    site_arrays O{ &c.xyz[0][0], &c.xyz[1][0], &c.xyz[2][0] };
+    site_arrays H1{ &c.xyz[3][0], &c.xyz[4][0], &c.xyz[5][0] };
+    site_arrays H2{ &c.xyz[6][0], &c.xyz[7][0], &c.xyz[8][0] };
+    frame_arrays f{ { &c.axes[0][0], &c.axes[1][0], &c.axes[2][0] },
+                    { &c.axes[3][0], &c.axes[4][0], &c.axes[5][0] },
+                    { &c.axes[6][0], &c.axes[7][0], &c.axes[8][0] } };
+    std::vector<double> shape[3]; // input geometry (reported only)
+    shape_arrays sh{ nullptr, nullptr, nullptr };
+    if (r) {
+        for (auto &v: shape) { v.resize(n); }
+        sh = shape_arrays{ shape[0].data(), shape[1].data(), shape[2].data() };
+    }
+    std::vector<unsigned char> bad(n);
+    if (model::orient(n, O, H1, H2, f, bad.data(), r ? &sh : nullptr) > 0) {
+        size_t j{ 0 };
+        while (!bad[j]) { ++j; }
+        c.err = std::make_exception_ptr(water_error(lines[c.source(j)]));
+    } else if (r) {
+        const double *g[3];
+        data_of(shape, 3, g);
+        report_input(lines, c, g, *r);
+    }
+}
+
+// convert the atoms of a chunk prepared by orient_chunk() for model wm,
+// numbered from counter, into dest (room for exactly the chunk's records)
+// or, if nullptr, into out; returns the number of waters copied unchanged
+// (c is only read: it is converted for several models at the same time).
+// How far the H atoms move is added to moved (if not nullptr).
+template <class Lines>
+size_t place_chunk(Lines &lines, const model &wm, chunk &c, size_t counter,
+                   char *dest, std::string *out,
+                   distribution *moved = nullptr) {
+    int model_size{ wm.size() };
+    size_t n{ c.xyz[0].size() };
+    std::vector<double> h[6]; // H1, H2 (x, y, z each)
+    std::vector<double> ext[3 * max_extra_sites]; // extra site coordinates
+    for (auto &v: h) { v.resize(n); }
+    for (int k = 0; k < 3 * (model_size - 3); ++k) { ext[k].resize(n); }
+    if (n > 0) {
+        site_arrays O{ &c.xyz[0][0], &c.xyz[1][0], &c.xyz[2][0] };
+        frame_arrays f{ { &c.axes[0][0], &c.axes[1][0], &c.axes[2][0] },
+                        { &c.axes[3][0], &c.axes[4][0], &c.axes[5][0] },
+                        { &c.axes[6][0], &c.axes[7][0], &c.axes[8][0] } };
+        site_arrays extra[max_extra_sites];
+        for (int k = 0; k < max_extra_sites; ++k) {
+            extra[k] = site_arrays{ ext[3*k].data(), ext[3*k+1].data(),
+                                     ext[3*k+2].data() };
+        }
+        wm.place(n, O, f, site_arrays{ h[0].data(), h[1].data(), h[2].data() },
+                 site_arrays{ h[3].data(), h[4].data(), h[5].data() }, extra);
+        if (moved) {
+            const double *from[6];
+            const double *to[6];
+            data_of(c.xyz + 3, 6, from);
+            data_of(h, 6, to);
+            report_moved(c, from, to, *moved);
+        }
+    }
+
+    const double *x[9]{ c.xyz[0].data(), c.xyz[1].data(), c.xyz[2].data(),
+                        h[0].data(), h[1].data(), h[2].data(),
+                        h[3].data(), h[4].data(), h[5].data() };
+    const double *e[3 * max_extra_sites];
+    data_of(ext, 3 * (model_size - 3), e);
+    size_t nout{ c.end - c.begin - c.nwa + n * model_size };
+    if (dest) {
+        gro_writer w{ dest, dest + nout * 45 };
+        return format_chunk(lines, wm, c, counter, x, e, w);
+    }
+    gro_writer w{ nullptr, nout * 45 };
+    size_t kept{ format_chunk(lines, wm, c, counter, x, e, w) };
+    *out = w.release();
+    return kept;
+}
+
+// multi-frame processing of a file held in memory on several threads
+//
+// The atoms of each frame are split into chunks (never splitting a water)
+// and each frame goes through two stages:
+//  - layout and parsing: find the waters in each chunk (or copy the layout
+//    of the first frame if the atom names are the same) and parse their
+//    coordinates, all chunks in parallel
+//  - conversion: transform and format the chunks in parallel, numbering the
+//    atoms from a running counter, and write them in order
+// With more than one thread the stages are pipelined: frame k+1 is parsed
+// while frame k is converted and written.
+// Written to a mapped file, the chunks are formatted in place: atom records
+// are 45 bytes each, so a chunk's output starts (counter - 1) * 45 bytes
+// after the count line, and the threads write the file directly instead of
+// handing their output to a single writer.
+// With several outputs (one per model) the frames are scanned and parsed
+// once, the frame of each water is found once (orient_chunk()), and the
+// chunks of all outputs are converted together, each model only placing
+// its sites along the frames (place_chunk()).
+// In large-system mode the chunks are smaller and only scanned in stage 1;
+// each is parsed by the thread that converts it, just before, so the
+// coordinates of only a few chunks are held at a time instead of those of
+// the whole frame.
+// With a selection only the waters whose O atom is selected are converted
+// (the layout is found from the selected lines alone); the others are
+// copied like any other atom.
+// Reordered waters are written in the places of the waters of the input, in
+// the given order; each chunk parses and converts the waters written in it,
+// wherever they are in the frame.
+// A geometry report is filled chunk by chunk in the conversion, from the
+// lengths found by the transform; the report of each chunk is merged into
+// the total when it is done.
+// The output is the same as from process_lines() (unless reordered).
+class frame_processor {
+public:
+    frame_processor(const std::vector<gro_output> &outputs, const text_file &l,
+                    int threads, run_stats *s, bool large_system,
+                    const std::vector<size_t> *water_order = nullptr,
+                    geometry_report *geometry = nullptr,
+                    const atom_selection *selected = nullptr) :
+        lines(l), src(l), nthreads{ threads }, stats(s),
+        large{ large_system }, order(water_order), report(geometry),
+        sel(selected) {
+        for (const auto &o: outputs) {
+            targets.emplace_back(new target(o));
+        }
+    }
+
+    size_t run() {
+        std::vector<frame> frames;
+        {
+            phase_timer t{ stats, "scan" };
+            frames = find_frames();
+        }
+
+        // the first frame is done first: its layout is used for the others
+        prepare(frames[0]);
+        ref = frames[0].chunks;
+        for (auto &c: ref) {
+            for (auto &v: c.xyz) { std::vector<double>().swap(v); }
+        }
+
+        parallel_ordered(frames.size(), nthreads > 1 ? 2 : 1, 2,
+            [&](size_t k) { if (k > 0) { prepare(frames[k]); } },
+            [&](size_t k) {
+                if (targets.size() == 1) {
+                    convert(frames[k]);
+                } else {
+                    fan_out(frames[k]);
+                }
+                frames[k] = frame();
+            });
+
+        phase_timer t{ stats, "write" };
+        for (auto &p: targets) {
+            target &o{ *p };
+            copy_rest(o.w, src, rest);
+            if (o.map) { place(o, 0); } else { o.w.flush(); }
+        }
+        t.count(span(rest, lines.size()) * targets.size(),
+                (lines.size() - rest) * targets.size());
+        count_unchanged(stats, kept);
+        return modified;
+    }
+
+private:
+    // an output and its model
+    struct target {
+        explicit target(const gro_output &o) :
+            wm(*o.wm), w{ o.map ? nullptr : o.os,
+                          o.map ? size_t{ 256 } : size_t{ 1 } << 20 },
+            map{ o.map } {}
+        const model &wm;
+        gro_writer w;       // output (mapped: lines between the atoms)
+        mapped_output *map; // mapped output file (or nullptr)
+    };
+
+    const text_file &lines;
+    memory_lines<text_file> src;
+    int nthreads;
+    run_stats *stats;
+    bool large;               // large-system mode
+    const std::vector<size_t> *order; // the order of the waters (or nullptr)
+    water_source from{};      // where the waters are taken from, if reordered
+    geometry_report *report;  // geometry of the waters (or nullptr)
+    std::mutex report_lock{}; // for merging into report
+    const atom_selection *sel; // the atoms of the waters converted (or all)
+    std::vector<std::unique_ptr<target>> targets{};
+    std::vector<chunk> ref{}; // layout of the first frame
+    size_t rest{ 0 };         // first line after the last frame
+    size_t modified{ 0 };     // number of waters converted (per output)
+    size_t kept{ 0 };         // waters copied unchanged (all outputs)
+
+    // the frames of the file (the first one may lack the box line)
+    std::vector<frame> find_frames() {
+        std::vector<frame> frames;
+        frame fr;
+        fr.first = 0;
+        fr.na = check_first_frame(lines);
+        size_t f{ 0 };
+        do {
+            fr.first = f;
+            frames.push_back(fr);
+            f += fr.na + 2;
+            if (src.has(f)) { ++f; } // box
+        } while (frame_at(src, f, fr.na));
+        rest = f;
+        return frames;
+    }
+
+    // bytes of lines [b, e) in the file
+    size_t span(size_t b, size_t e) const {
+        if (b >= e) { return 0; }
+        const char *end{ lines[e - 1].data() + lines[e - 1].size() + 1 };
+        return static_cast<size_t>(std::min(end, lines.data() + lines.bytes())
+                                   - lines[b].data());
+    }
+
+    // stage 1: layout and parsing (only the layout in large-system mode)
+    void prepare(frame &fr) {
+        phase_timer scan{ stats, "scan" };
+        bool reuse{ fr.first > 0 && fr.na == frames_na() };
+        if (reuse) {
+            size_t shift{ fr.first };
+            std::vector<char> ok(ref.size(), 0);
+            parallel_for(ref.size(), nthreads, [&](size_t k) {
+                ok[k] = same_names(lines, ref[k], shift);
+            });
+            for (auto c: ok) { reuse = reuse && c; }
+        }
+        if (reuse) {
+            fr.chunks.resize(ref.size());
+            for (size_t k = 0; k < ref.size(); ++k) {
+                reuse_layout(ref[k], fr.first, fr.chunks[k]);
+            }
+        } else {
+            // several chunks per thread to balance the load, not tiny ones
+            size_t n{ std::min(static_cast<size_t>(nthreads) * 8,
+                               fr.na / 4096 + 1) };
+            fr.chunks = make_chunks(lines, fr.first + 2, fr.na, n,
+                                    large ? max_large_chunk_lines
+                                          : max_chunk_lines);
+            size_t end_atoms{ fr.first + fr.na + 2 };
+            check_selection(src, sel, fr.first, fr.na);
+            parallel_for(fr.chunks.size(), nthreads, [&](size_t k) {
+                scan_chunk(src, end_atoms, fr.chunks[k], sel, fr.first + 2);
+            });
+        }
+        size_t nw{ 0 };
+        for (auto &c: fr.chunks) { nw += c.wat.size(); }
+        if (order) { set_sources(fr, reuse); }
+        size_t atoms{ fr.first + 2 };
+        scan.count(span(atoms, atoms + fr.na), fr.na, nw);
+        if (large) { return; }
+
+        phase_timer parse{ stats, "parse", &scan };
+        parallel_for(fr.chunks.size(), nthreads, [&](size_t k) {
+            parse_chunk(src, fr.chunks[k]);
+        });
+        parse.count(span(atoms, atoms + fr.na), fr.na, nw);
+    }
+
+    // take the waters of a frame in the given order; the places of the
+    // waters are those of the first frame, which all frames must share
+    void set_sources(frame &fr, bool reused) {
+        if (fr.first == 0) {
+            std::vector<size_t> line; // the waters in input order
+            std::vector<uint32_t> sites;
+            for (auto &c: fr.chunks) {
+                for (size_t j = 0; j < c.wat.size(); ++j) {
+                    line.push_back(c.water(j));
+                    sites.push_back(c.tail[j] - c.wat[j]);
+                }
+            }
+            if (order->size() != line.size()) {
+                throw(std::invalid_argument("water order: "
+                      + std::to_string(order->size()) + " waters for "
+                      + std::to_string(line.size())));
+            }
+            std::vector<char> seen(line.size(), 0);
+            from.line.resize(line.size());
+            from.sites.resize(line.size());
+            for (size_t g = 0; g < line.size(); ++g) {
+                size_t s{ (*order)[g] };
+                if (s >= line.size() || seen[s]) {
+                    throw(std::invalid_argument("water order: not a "
+                                                "permutation"));
+                }
+                seen[s] = 1;
+                from.line[g] = line[s];
+                from.sites[g] = sites[s];
+            }
+        } else if (!reused) {
+            std::string msg{ "cannot reorder waters: frame with other atoms "
+                             "than the first" };
+            throw(gro_error(msg, lines[fr.first]));
+        }
+        size_t g{ 0 };
+        for (auto &c: fr.chunks) {
+            c.from = &from;
+            c.frame_line = fr.first;
+            c.first_water = g;
+            g += c.wat.size();
+        }
+    }
+
+    // add the report of a chunk to the total
+    void add_report(const geometry_report &part) {
+        std::lock_guard<std::mutex> guard{ report_lock };
+        report->merge(part);
+    }
+
+    // convert a chunk with the model of the only output (see convert())
+    void convert_one(const model &wm, chunk &c, char *dest) {
+        if (large) { parse_chunk(src, c); }
+        if (!report) {
+            convert_chunk(src, wm, c, dest);
+            return;
+        }
+        geometry_report part{ report->empty() };
+        convert_chunk(src, wm, c, dest, &part);
+        add_report(part);
+    }
+
+    size_t frames_na() const {
+        return ref.empty() ? 0 : ref.back().end - ref.front().begin;
+    }
+
+    // append what the writer of o holds to its mapped file followed by room
+    // for n more bytes; returns the start of the file
+    char *place(target &o, size_t n) {
+        std::string s{ o.w.release() };
+        size_t at{ o.map->size() };
+        char *p{ o.map->resize(at + s.size() + n) };
+        std::memcpy(p + at, s.data(), s.size());
+        return p;
+    }
+
+    // stage 2: conversion and output
+    void convert(frame &fr) {
+        phase_timer conv{ stats, "convert" };
+        target &o{ *targets[0] };
+        const model &wm{ o.wm };
+        gro_writer &w{ o.w };
+        int model_size{ wm.size() };
+
+        // running atom counter: number of the first atom of each chunk
+        size_t nw{ 0 };  // number of water molecules
+        size_t nwa{ 0 }; // number of atoms in water molecules
+        size_t counter{ 1 };
+        for (auto &c: fr.chunks) {
+            c.counter = counter;
+            counter += c.end - c.begin - c.nwa + c.wat.size() * model_size;
+            nw += c.wat.size();
+            nwa += c.nwa;
+        }
+
+        w.line(lines[fr.first]); // title line written unchanged
+        size_t nout{ fr.na - nwa + nw*model_size };
+        w.count(nout); // new number of atoms
+
+        if (o.map) {
+            char *p{ place(o, nout * 45) };
+            size_t at{ o.map->size() - nout * 45 }; // first atom record
+            std::vector<char> done(fr.chunks.size(), 0);
+            try {
+                parallel_for(fr.chunks.size(), nthreads, [&](size_t k) {
+                    chunk &c{ fr.chunks[k] };
+                    convert_one(wm, c, p + at + (c.counter - 1) * 45);
+                    done[k] = 1;
+                });
+            }
+            catch (...) {
+                // keep the chunks before the error, as the writer would
+                size_t k{ 0 };
+                while (done[k]) { ++k; }
+                o.map->resize(at + (fr.chunks[k].counter - 1) * 45);
+                throw;
+            }
+            for (auto &c: fr.chunks) { kept += c.kept; }
+        } else {
+            parallel_ordered(fr.chunks.size(), nthreads, 2 * nthreads,
+                [&](size_t k) { convert_one(wm, fr.chunks[k], nullptr); },
+                [&](size_t k) {
+                    phase_timer out{ stats, "write", &conv };
+                    const chunk &c{ fr.chunks[k] };
+                    out.count(c.out.size(), c.end - c.begin - c.nwa
+                                            + c.wat.size() * model_size);
+                    w.text(c.out);
+                    kept += c.kept;
+                    std::string().swap(fr.chunks[k].out); // release memory
+                });
+        }
+
+        size_t box{ fr.first + fr.na + 2 };
+        if (src.has(box)) { w.line(lines[box]); }
+        modified += nw;
+        conv.count(o.map ? nout * 45 : 0, nout, nw);
+    }
+
+    // stage 2 for several outputs: the frames of the waters once, then the
+    // chunks of all outputs (chunk by chunk, so that every output advances)
+    void fan_out(frame &fr) {
+        phase_timer conv{ stats, "convert" };
+        size_t nc{ fr.chunks.size() };
+        size_t nt{ targets.size() };
+
+        // the atom counter of each chunk in each output; title and count
+        size_t nw{ 0 };  // number of water molecules
+        size_t nwa{ 0 }; // number of atoms in water molecules
+        for (auto &c: fr.chunks) {
+            nw += c.wat.size();
+            nwa += c.nwa;
+        }
+        std::vector<size_t> counter(nc * nt); // [k * nt + t]
+        std::vector<char *> base(nt, nullptr); // mapped file (or nullptr)
+        std::vector<size_t> first(nt, 0);      // and its first atom record
+        size_t nout_all{ 0 };
+        for (size_t t = 0; t < nt; ++t) {
+            target &o{ *targets[t] };
+            int model_size{ o.wm.size() };
+            size_t c{ 1 };
+            for (size_t k = 0; k < nc; ++k) {
+                const chunk &ch{ fr.chunks[k] };
+                counter[k * nt + t] = c;
+                c += ch.end - ch.begin - ch.nwa + ch.wat.size() * model_size;
+            }
+            size_t nout{ fr.na - nwa + nw * model_size };
+            nout_all += nout;
+            o.w.line(lines[fr.first]); // title line written unchanged
+            o.w.count(nout); // new number of atoms
+            if (o.map) {
+                base[t] = place(o, nout * 45);
+                first[t] = o.map->size() - nout * 45;
+            }
+        }
+
+        // the chunks in windows (in large-system mode, otherwise all at
+        // once): their frames, then, up to any error, all their outputs
+        size_t win{ large ? 2 * static_cast<size_t>(nthreads) : nc };
+        std::vector<size_t> kept_by(std::min(win, nc) * nt, 0);
+        std::vector<std::string> out(std::min(win, nc) * nt);
+        for (size_t k0 = 0; k0 < nc; k0 += win) {
+            size_t k1{ std::min(nc, k0 + win) };
+            parallel_for(k1 - k0, nthreads, [&](size_t k) {
+                chunk &c{ fr.chunks[k0 + k] };
+                if (large) { parse_chunk(src, c); }
+                if (!report) {
+                    orient_chunk(src, c);
+                    return;
+                }
+                geometry_report part{ report->empty() };
+                orient_chunk(src, c, &part);
+                add_report(part);
+            });
+            size_t good{ k0 }; // chunks before the first error
+            while (good < k1 && !fr.chunks[good].err) { ++good; }
+
+            size_t i0{ k0 * nt }; // item i is out[i - i0]
+            auto item = [&](size_t i) {
+                size_t k{ i / nt };
+                size_t t{ i % nt };
+                char *dest{ base[t] ? base[t] + first[t]
+                                      + (counter[i] - 1) * 45
+                                    : nullptr };
+                if (!report) {
+                    kept_by[i - i0] = place_chunk(src, targets[t]->wm,
+                                                  fr.chunks[k], counter[i],
+                                                  dest, &out[i - i0]);
+                    return;
+                }
+                geometry_report part{ report->empty() };
+                kept_by[i - i0] = place_chunk(src, targets[t]->wm,
+                                              fr.chunks[k], counter[i],
+                                              dest, &out[i - i0],
+                                              &part.h_shift[t]);
+                add_report(part);
+            };
+            parallel_ordered((good - k0) * nt, nthreads, 2 * nthreads * nt,
+                [&](size_t i) { item(i0 + i); },
+                [&](size_t i) {
+                    std::string &s{ out[i] };
+                    target &o{ *targets[i % nt] };
+                    if (!o.map) {
+                        phase_timer wr{ stats, "write", &conv };
+                        wr.count(s.size(), s.size() / 45);
+                        o.w.text(s);
+                    }
+                    std::string().swap(s); // release memory
+                    kept += kept_by[i];
+                    if (i % nt == nt - 1) { // all outputs of a chunk
+                        chunk &c{ fr.chunks[k0 + i / nt] };
+                        for (auto &v: c.xyz) { std::vector<double>().swap(v); }
+                        for (auto &v: c.axes) {
+                            std::vector<double>().swap(v);
+                        }
+                    }
+                });
+            if (good < k1) {
+                // keep the chunks before the error, as the writer would
+                for (size_t t = 0; t < nt; ++t) {
+                    target &o{ *targets[t] };
+                    if (o.map) {
+                        o.map->resize(first[t]
+                                      + (counter[good * nt + t] - 1) * 45);
+                    }
+                }
+                std::rethrow_exception(fr.chunks[good].err);
+            }
+        }
+
+        size_t box{ fr.first + fr.na + 2 };
+        for (auto &p: targets) {
+            if (src.has(box)) { p->w.line(lines[box]); }
+        }
+        modified += nw;
+        conv.count(0, nout_all, nw * nt);
+    }
+};
+
+// the layout of the waters in the natoms atoms starting at line first,
+// found by scanning them in chunks (only the selected waters if sel is set)
+template <class Lines>
+water_layout layout_of(Lines &lines, size_t first, size_t natoms,
+                       const atom_selection *sel = nullptr) {
+    std::vector<chunk> chunks{ make_chunks(lines, first, natoms, 1,
+                                           max_chunk_lines) };
+    water_layout wl;
+    wl.natoms = natoms;
+    wl.other.assign((wl.natoms + 63) / 64, ~uint64_t{ 0 });
+    for (auto &c: chunks) {
+        scan_chunk(lines, first + natoms, c, sel, first);
+        wl.water_atoms += c.nwa;
+        for (size_t j = 0; j < c.wat.size(); ++j) {
+            size_t a{ c.water(j) - first };
+            wl.first.push_back(a);
+            wl.sites.push_back(c.tail[j] - c.wat[j]);
+            for (size_t i = a; i < a + wl.sites.back(); ++i) {
+                wl.other[i / 64] &= ~(uint64_t{ 1 } << (i % 64));
+            }
+        }
+        std::vector<uint32_t>().swap(c.wat); // release memory
+        std::vector<uint32_t>().swap(c.tail);
+    }
+    return wl;
+}
+
+// atom names given as an array, seen as atom lines with just the name
+// field filled in (enough for water_scanner); a line is only valid until
+// the next one is asked for
+class name_lines {
+public:
+    name_lines(const char *const *n, size_t count) : names(n), size(count) {}
+    bool has(size_t i) const { return i < size; }
+    line_view operator[](size_t i) {
+        std::memset(buf, ' ', sizeof(buf));
+        const char *p{ names[i] };
+        for (int k = 0; k < 5 && p[k] != '\0'; ++k) { buf[10 + k] = p[k]; }
+        return line_view(buf, sizeof(buf));
+    }
+    void release(size_t) const {}
+private:
+    const char *const *names;
+    size_t size;
+    char buf[15]; // residue (10 characters) and name (5 characters)
+};
+
+} // namespace
+
+size_t process_gro(std::ostream &os, const std::vector<std::string> &lines,
+                   const model &wm) {
+    return process_lines(os, lines, wm);
+}
+
+water_layout find_waters(const text_file &lines, size_t f,
+                         const atom_selection *sel) {
+    size_t natoms{ 0 };
+    memory_lines<text_file> src{ lines };
+    if (f == 0) {
+        natoms = check_first_frame(lines);
+    } else if (!frame_at(src, f, natoms)) {
+        throw(gro_error("no complete frame at line " + std::to_string(f + 1)));
+    }
+    check_selection(src, sel, f, natoms);
+    return layout_of(src, f + 2, natoms, sel);
+}
+
+water_layout find_waters(const char *const *names, size_t n) {
+    name_lines src{ names, n };
+    return layout_of(src, 0, n);
+}
+
+size_t process_gro(std::ostream &os, const text_file &lines, const model &wm,
+                   int threads, run_stats *stats, bool large) {
+    frame_processor p{ { gro_output{ &wm, &os, nullptr } }, lines, threads,
+                       stats, large };
+    return p.run();
+}
+
+size_t process_gro(mapped_output &out, const text_file &lines,
+                   const model &wm, int threads, run_stats *stats,
+                   bool large) {
+    frame_processor p{ { gro_output{ &wm, nullptr, &out } }, lines, threads,
+                       stats, large };
+    return p.run();
+}
+
+size_t process_gro(const std::vector<gro_output> &outputs,
+                   const text_file &lines, int threads, run_stats *stats,
+                   bool large, const std::vector<size_t> *order,
+                   geometry_report *report, const atom_selection *selection) {
+    if (outputs.empty()) {
+        throw(std::logic_error("process_gro: no output"));
+    }
+    if (report && report->h_shift.size() != outputs.size()) {
+        throw(std::invalid_argument("geometry report: "
+              + std::to_string(report->h_shift.size()) + " models for "
+              + std::to_string(outputs.size()) + " outputs"));
+    }
+    frame_processor p{ outputs, lines, threads, stats, large, order, report,
+                       selection };
+    return p.run();
+}
+
+size_t process_gro(std::ostream &os, std::istream &is, const model &wm,
+                   run_stats *stats) {
+
+    // the atom count in the output is only known once all waters are
+    // counted, so the input is read twice: seekable input is rewound,
+    // anything else (pipes) is copied to a spool file during the first pass
+    std::streampos start{ is.tellg() };
+    bool seekable{ start != std::streampos(-1) };
+    std::fstream spool;
+    if (!seekable) { open_spool(spool); }
+
+    // first pass: count the waters in each frame
+    struct frame_count {
+        size_t na; // number of atoms
+        size_t nw;  // number of water molecules
+        size_t nwa; // number of atoms in water molecules
+    };
+    std::vector<frame_count> frames;
+    {
+        phase_timer scan{ stats, "scan" };
+        stream_lines src{ is, seekable ? nullptr : &spool };
+        if (!src.has(4)) {
+            std::string msg{ "file too short to contain a water molecule" };
+            std::string l{ std::to_string(src.count()) };
+            throw(gro_error(msg,l));
+        }
+
+        frame_count fc{ atom_count(src[1]), 0, 0 };
+        std::string msg{ "file too short for " };
+        msg += std::to_string(fc.na) + " atoms";
+        std::string count_line{ src[1].str() };
+        src.on_eof(msg, count_line);
+
+        count_waters(src, 0, fc.na, fc.nw, fc.nwa);
+        if (!src.has(fc.na + 1)) {
+            throw(gro_error(msg, count_line));
+        }
+        frames.push_back(fc);
+
+        // further frames; an incomplete last frame is copied unchanged
+        size_t f{ fc.na + 3 }; // first line of the next frame
+        long nas{ 0l };
+        while (src.has(f + 1) && parse_long(src[f + 1], nas) && nas >= 0) {
+            fc.na = static_cast<size_t>(nas);
+            try {
+                count_waters(src, f, fc.na, fc.nw, fc.nwa);
+            }
+            catch (const frame_truncated &e) {
+                break;
+            }
+            if (!src.has(f + fc.na + 2)) { break; }
+            frames.push_back(fc);
+            f += fc.na + 3;
+        }
+
+        if (!seekable) { src.drain(); }
+        size_t nw{ 0 };
+        for (auto &fc: frames) { nw += fc.nw; }
+        scan.count(src.bytes(), src.count(), nw);
+    }
+
+    std::istream *second{ &spool };
+    if (seekable) {
+        is.clear();
+        is.seekg(start);
+        if (!is) {
+            throw(std::runtime_error("cannot rewind input"));
+        }
+        second = &is;
+    } else {
+        spool.flush();
+        spool.seekg(0);
+        if (!spool) {
+            throw(std::runtime_error("cannot rewind spool file"));
+        }
+    }
+
+    // second pass: write the frames
+    phase_timer conv{ stats, "convert" };
+    stream_lines src{ *second };
+    gro_writer w{ &os };
+    size_t modified{ 0 };
+    size_t kept{ 0 }; // waters copied unchanged
+    size_t f{ 0 }; // first line of current frame
+    for (auto &fc: frames) {
+        modified += write_frame(w, src, f, fc.na, fc.nw, fc.nwa, wm,
+                                scanned_waters<stream_lines>(src), &kept);
+        f += fc.na + 2;
+        if (src.has(f)) { w.line(src[f]); ++f; } // box
+    }
+    copy_rest(w, src, f);
+    w.flush();
+    conv.count(src.bytes(), src.count(), modified);
+    count_unchanged(stats, kept);
 
-    
-    
-    modified = nw;
-    
-    
     return modified;
 }
@@ -1,6 +1,12 @@
 #ifndef GRO_H
 #define GRO_H
+#include "geometry_report.h"
+#include "index_group.h"
+#include "mapped_output.h"
 #include "model.h"
+#include "readall.h"
+#include "stats.h"
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <iostream>
@@ -14,8 +20,216 @@
   *  \sa model.h
   *  \throws gro_error indicates error in parsing the input file
 */
-int process_gro(std::ostream &os, const std::vector<std::string> &lines,
-                const model &wm);
+size_t process_gro(std::ostream &os, const std::vector<std::string> &lines,
+                   const model &wm);
+
+//! Modify water molecules in a gro file held by a text_file
+/**
+  *  Same as above, but the atom lines are used in place (no copies).
+  *  With more than one thread the atoms are split into chunks (never
+  *  splitting a water molecule) that are converted in parallel and written
+  *  in order; the output is identical for any number of threads.
+  *  Waters whose lines already hold their converted sites, as they would
+  *  be written, are copied with new atom numbers only. Their O-H lengths,
+  *  H-O-H angle and extra sites are compared with the model first, within
+  *  the precision of the output, and those that match are not transformed
+  *  at all; the others are transformed and their new sites compared with
+  *  their lines.
+  *
+  *  \param os the output stream to write results to
+  *  \param lines the lines of the input gro file
+  *  \param wm the water model to be used in the output
+  *  \param threads number of threads to use
+  *  \param stats if not nullptr, the phases scan, parse, convert and write
+  *      are recorded here, and the number of waters copied unchanged
+  *      (see run_stats::fast_path_waters())
+  *  \param large large-system mode: the coordinates of a chunk are parsed
+  *      only when it is converted and chunks hold at most 2^18 lines, so
+  *      that apart from the input and output only a few bytes per atom are
+  *      kept (the line index and the water index) however large the frame;
+  *      parsing is then counted in the convert phase
+  *  \return the number of molecules changed
+  *  \throws gro_error indicates error in parsing the input file
+*/
+size_t process_gro(std::ostream &os, const text_file &lines, const model &wm,
+                   int threads = 1, run_stats *stats = nullptr,
+                   bool large = false);
+
+//! Modify water molecules in a gro file held by a text_file, writing a file
+/**
+  *  Same as above, but the output is appended to a mapped file: all atom
+  *  records are 45 bytes, so the position of each chunk's output is known
+  *  before it is converted and every thread formats its chunks in place,
+  *  without a single writer copying them in order. The file is not closed.
+  *
+  *  \param out the output file
+  *  \param lines the lines of the input gro file
+  *  \param wm the water model to be used in the output
+  *  \param threads number of threads to use
+  *  \param stats as above, except that the atoms are not in the write
+  *      phase (they are written in the convert phase)
+  *  \param large large-system mode (see above)
+  *  \return the number of molecules changed
+  *  \throws gro_error indicates error in parsing the input file
+  *  \throws std::runtime_error if the file cannot be extended
+*/
+size_t process_gro(mapped_output &out, const text_file &lines,
+                   const model &wm, int threads = 1,
+                   run_stats *stats = nullptr, bool large = false);
+
+//! An output of process_gro() for several water models
+struct gro_output {
+    const model *wm;     //!< the water model of this output
+    std::ostream *os;    //!< stream to write to (if map is nullptr)
+    mapped_output *map;  //!< mapped file to write to (or nullptr)
+};
+
+//! Convert a gro file held by a text_file to several water models at once
+/**
+  *  Same output as process_gro() called for each model (on a stream or a
+  *  mapped file), but the input is scanned and parsed once and the local
+  *  frame of each water (bisector, H-H direction and normal, see
+  *  model::orient()) is found once; each model then only places its sites
+  *  along the frames. The chunks of all outputs are converted together on
+  *  the threads, so all files are written at the same time.
+  *
+  *  \param outputs the models and their outputs (at least one)
+  *  \param lines the lines of the input gro file
+  *  \param threads number of threads to use
+  *  \param stats as above; the write phase and the waters copied unchanged
+  *      are counted over all outputs
+  *  \param large large-system mode (see above)
+  *  \param order if not nullptr, the waters are reordered: (*order)[g] is
+  *      the water of the first frame (numbered from 0 in input order)
+  *      written in the place of water g, and all frames must have the atoms
+  *      of the first. The other atoms keep their places, and each water
+  *      keeps the residue number of its place (see water_order()).
+  *  \param report if not nullptr, the geometry of the input waters of all
+  *      frames and the displacement of their H atoms in each output are
+  *      added to it (made for the models of outputs, in the same order);
+  *      line numbers are those of the input
+  *  \param selection if not nullptr, only the waters whose O atom is in it
+  *      (atoms numbered from 0 in each frame) are converted; the other
+  *      waters are copied like the other atoms, with new atom numbers. Only
+  *      the selected lines are scanned for waters.
+  *  \return the number of molecules changed (in each output)
+  *  \throws gro_error indicates error in parsing the input file
+  *  \throws std::runtime_error if a mapped file cannot be extended
+  *  \throws std::invalid_argument if order is not a permutation of the
+  *      waters of the first frame, or if report is for another number of
+  *      models
+  *  \throws gro_error if the selection has atoms beyond those of a frame
+*/
+size_t process_gro(const std::vector<gro_output> &outputs,
+                   const text_file &lines, int threads = 1,
+                   run_stats *stats = nullptr, bool large = false,
+                   const std::vector<size_t> *order = nullptr,
+                   geometry_report *report = nullptr,
+                   const atom_selection *selection = nullptr);
+
+//! Modify water molecules in a gro file read from a stream
+/**
+  *  Only a small window of lines is kept in memory and output is written
+  *  as the input is read. The input is read twice (the atom count in the
+  *  output depends on the number of waters): a seekable stream is rewound,
+  *  other input (e.g. a pipe) is copied to an unlinked temporary file in
+  *  $TMPDIR (or /tmp) during the first pass.
+  *
+  *  \param os the output stream to write results to
+  *  \param is the input stream, positioned at the start of the gro file
+  *  \param wm the water model to be used in the output
+  *  \param stats if not nullptr, the two passes are recorded here as the
+  *      phases scan and convert, and the waters copied unchanged (see
+  *      above)
+  *  \return the number of molecules changed
+  *  \throws gro_error indicates error in parsing the input file
+  *  \throws std::runtime_error if the input cannot be read or spooled
+*/
+size_t process_gro(std::ostream &os, std::istream &is, const model &wm,
+                   run_stats *stats = nullptr);
+
+//! Water molecules found in a frame of a gro file
+/**
+ *  A compact index made in one pass over the atom names: the first atom
+ *  and the number of atoms (sites, including any extra sites of the input
+ *  model) of each water, and a bitmap marking the atoms that are not part
+ *  of a water. Atoms are numbered from 0 in the order of the file.
+ *  The index can be used for later frames with the same atom names.
+ *  \sa find_waters()
+ */
+struct water_layout {
+    size_t natoms{ 0 };             //!< number of atoms in the frame
+    size_t water_atoms{ 0 };        //!< number of atoms in water molecules
+    std::vector<size_t> first{};    //!< the O atom of each water molecule
+    std::vector<uint32_t> sites{};  //!< number of atoms of each water
+    //! bit i set: atom i is not in a water (or not in a selected one)
+    std::vector<uint64_t> other{};
+
+    //! number of atoms after converting the waters to a model
+    size_t output_atoms(int model_size) const {
+        return natoms - water_atoms + first.size() * model_size;
+    }
+
+    //! true if atom i is part of a water molecule
+    bool in_water(size_t i) const {
+        return ((other[i / 64] >> (i % 64)) & 1u) == 0;
+    }
+};
+
+//! Find the water molecules in a frame of a gro file
+/**
+  *  Waters are recognised as by process_gro(): atoms named OW, HW, HW,
+  *  optionally followed by MW, LP or EP sites.
+  *
+  *  \param lines the lines of the gro file
+  *  \param f the title line of the frame (default: the first frame)
+  *  \param sel if not nullptr, only the waters whose O atom is in it (see
+  *      process_gro())
+  *  \return the layout of the water molecules
+  *  \throws gro_error indicates error in parsing the input file, or a
+  *      selection with atoms beyond the frame
+*/
+water_layout find_waters(const text_file &lines, size_t f = 0,
+                         const atom_selection *sel = nullptr);
+
+//! Find the water molecules in a list of atom names
+/**
+  *  Same as above, for the atoms of a system given as arrays (only the
+  *  first 5 characters of a name count, as in a gro file).
+  *
+  *  \param names the atom names
+  *  \param n number of atoms
+  *  \return the layout of the water molecules
+*/
+water_layout find_waters(const char *const *names, size_t n);
+
+//! Classes of atom names, as far as water molecules are concerned
+enum name_class : unsigned char {
+    NAME_OTHER, //!< not part of a water molecule
+    NAME_OW,    //!< water oxygen (name starting OW)
+    NAME_HW,    //!< water hydrogen (HW)
+    NAME_EXTRA  //!< extra site of a water model (MW, LP or EP)
+};
+
+//! Classify the atom name of an atom line
+/**
+  *  Only the first two characters of the name count, in upper or lower
+  *  case. The 5 characters of the name field are compared in place as one
+  *  packed integer, without making strings.
+  *
+  *  \param l the atom line
+  *  \return the class of the name
+  *  \throws gro_error if the line is too short to hold a name
+*/
+name_class classify_atom(line_view l);
+
+//! Read the coordinates of an atom line
+/**
+  *  \param l the atom line
+  *  \param[out] x,y,z the coordinates in Angstrom
+  *  \throws gro_error if the line has no valid coordinates
+*/
+void coordinates(line_view l, double &x, double &y, double &z);
 
 //! Exception class to reflect error in parsing gro file
 class gro_error: public std::runtime_error {
@@ -26,7 +240,39 @@ public:
      * \param line the line in which the error occurred
      */
     gro_error(const std::string & msg = "", const std::string & line = "") :
-        std::runtime_error(msg+"; current line:\n"+line) {}
+        std::runtime_error(msg+"; current line:\n"+line), at{ nullptr } {}
+    //! Constructor for an error in a line held in memory
+    /**
+     * \param msg description of the error
+     * \param line the line in which the error occurred; where() points to
+     *     its first character
+     */
+    gro_error(const std::string & msg, line_view line) :
+        std::runtime_error(msg+"; current line:\n"+line.str()),
+        at{ line.data() } {}
+    //! start of the line in error (nullptr if not known)
+    /**
+     * Only meaningful while the input is held in memory (not for input
+     * read from a stream). \sa text_file::line_of()
+     */
+    const char *where() const { return at; }
+private:
+    const char *at;
+};
+
+//! Exception class for a water molecule that cannot be idealised
+/**
+ * Raised for a water whose O-H bonds are too short or collinear.
+ */
+class water_error: public std::runtime_error {
+public:
+    //! \param line the O atom line of the water (see gro_error::where())
+    explicit water_error(line_view line) :
+        std::runtime_error("bad input water structure"), at{ line.data() } {}
+    //! start of the O atom line (nullptr if not known)
+    const char *where() const { return at; }
+private:
+    const char *at;
 };
 
 #endif
@@ -0,0 +1,485 @@
+#include "gro_cache.h"
+#include "gro.h"
+#include "gro_parse.h"
+#include "gro_writer.h"
+#include "mapped_output.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+const char cache_magic[8]{ 'W', 'A', 'T', 'C', 'A', 'C', 'H', 'E' };
+const uint32_t cache_version{ 1 };
+const uint32_t cache_byte_order{ 0x01020304 };
+
+// start of a cache file; the sections follow in the order of cache_layout
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;    // cache_byte_order as written
+    uint64_t file_size;     // of the cache file
+    uint64_t source_size;   // of the gro file
+    int64_t source_mtime;   // its modification time (ns since the epoch)
+    uint64_t source_hash;   // hash of its first and last 64 kB
+    uint64_t natoms;
+    uint64_t nwaters;
+    uint64_t nnames;        // distinct name fields
+    uint64_t title_bytes;
+    uint64_t box_bytes;
+    uint64_t has_box;
+};
+
+size_t pad8(size_t n) { return (n + 7) & ~size_t{ 7 }; }
+
+// offsets of the sections of a cache file, each 8 byte aligned
+struct cache_layout {
+    size_t title, box, names, x, y, z, resnr, resname, atomname, first,
+           sites, end;
+    explicit cache_layout(const cache_header &h) {
+        size_t n{ static_cast<size_t>(h.natoms) };
+        title = pad8(sizeof(cache_header));
+        box = title + pad8(h.title_bytes);
+        names = box + pad8(h.box_bytes);
+        x = names + 8 * h.nnames;
+        y = x + 8 * n;
+        z = y + 8 * n;
+        resnr = z + 8 * n;
+        resname = resnr + pad8(4 * n);
+        atomname = resname + pad8(2 * n);
+        first = atomname + pad8(2 * n);
+        sites = first + 8 * h.nwaters;
+        end = sites + pad8(h.nwaters);
+    }
+};
+
+// size, modification time and a hash of the first and last 64 kB of a file
+void source_id(const std::string &name, uint64_t &size, int64_t &mtime,
+               uint64_t &hash) {
+    int fd{ open(name.c_str(), O_RDONLY) };
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::string msg{ "cannot open '" + name + "': " };
+        msg += strerror(errno);
+        if (fd >= 0) { close(fd); }
+        throw(std::runtime_error(msg));
+    }
+    size = static_cast<uint64_t>(st.st_size);
+    mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000
+            + st.st_mtim.tv_nsec;
+    const size_t part{ 1 << 16 };
+    std::vector<char> buf(2 * part);
+    ssize_t a{ pread(fd, buf.data(), part, 0) };
+    off_t tail{ static_cast<off_t>(size > part ? size - part : 0) };
+    ssize_t b{ pread(fd, buf.data() + part, part, tail) };
+    close(fd);
+    hash = 14695981039346656037ull; // FNV-1a
+    for (ssize_t i = 0; i < a; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(buf[i])) * 1099511628211ull;
+    }
+    for (ssize_t i = 0; i < b; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(buf[part + i]))
+               * 1099511628211ull;
+    }
+}
+
+// "%5d" for residue numbers of at most 5 characters
+void format_resnr(int32_t r, char *p) {
+    bool neg{ r < 0 };
+    uint32_t u{ static_cast<uint32_t>(neg ? -r : r) };
+    int i{ 4 };
+    do {
+        p[i--] = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u > 0 && i >= 0);
+    if (neg && i >= 0) { p[i--] = '-'; }
+    while (i >= 0) { p[i--] = ' '; }
+}
+
+// a block of whole waters and the atoms up to the next block
+struct piece {
+    size_t wbegin, wend; // waters
+    size_t abegin, aend; // atoms
+    size_t counter;      // output number of the first atom
+    size_t nout;         // number of output atoms
+    std::string out;     // converted lines
+};
+
+// idealise and format the waters and atoms of a piece into dest (room for
+// exactly its records) or, if nullptr, into p.out
+void convert_piece(const gro_cache &c, const model &wm, piece &p,
+                   char *dest) {
+    int model_size{ wm.size() };
+    const uint64_t *first{ c.water_first() };
+    const uint8_t *sites{ c.water_sites() };
+    const double *xyz[3]{ c.x(), c.y(), c.z() };
+
+    // transform in one batch, in Angstrom as from the text
+    size_t m{ p.wend - p.wbegin };
+    std::vector<double> w[9];
+    std::vector<double> ext[3 * max_extra_sites];
+    for (int k = 0; k < 9; ++k) {
+        w[k].resize(m);
+        for (size_t j = 0; j < m; ++j) {
+            w[k][j] = xyz[k % 3][first[p.wbegin + j] + k / 3] * 10.0;
+        }
+    }
+    for (int k = 0; k < 3 * (model_size - 3); ++k) { ext[k].resize(m); }
+    if (m > 0) {
+        site_arrays O{ &w[0][0], &w[1][0], &w[2][0] };
+        site_arrays H1{ &w[3][0], &w[4][0], &w[5][0] };
+        site_arrays H2{ &w[6][0], &w[7][0], &w[8][0] };
+        site_arrays extra[max_extra_sites];
+        for (int k = 0; k < max_extra_sites; ++k) {
+            extra[k] = site_arrays{ ext[3*k].data(), ext[3*k+1].data(),
+                                     ext[3*k+2].data() };
+        }
+        std::vector<unsigned char> bad(m);
+        if (wm.transform(m, O, H1, H2, extra, bad.data()) > 0) {
+            throw(water_error(line_view()));
+        }
+    }
+
+    // format: an atom line made of the prefix for each record
+    char rec[44];
+    std::memset(rec, ' ', sizeof(rec));
+    line_view l{ rec, sizeof(rec) };
+    std::unique_ptr<gro_writer> wr{ dest
+        ? new gro_writer(dest, dest + p.nout * 45)
+        : new gro_writer(nullptr, p.nout * 45) };
+    gro_writer &out{ *wr };
+    size_t counter{ p.counter };
+    size_t j{ 0 }; // next water of the piece
+    for (size_t i = p.abegin; i < p.aend; ) {
+        if (j < m && i == first[p.wbegin + j]) {
+            for (int a = 0; a < 3; ++a) {
+                c.prefix(i + a, rec);
+                out.atom(l, counter++, w[3*a][j] / 10.0, w[3*a+1][j] / 10.0,
+                         w[3*a+2][j] / 10.0);
+            }
+            for (int k = 0; k < model_size - 3; ++k) {
+                out.atom(l, wm.extra_name(k), counter++, ext[3*k][j] / 10.0,
+                         ext[3*k+1][j] / 10.0, ext[3*k+2][j] / 10.0);
+            }
+            i += sites[p.wbegin + j];
+            ++j;
+        } else {
+            c.prefix(i, rec);
+            out.atom(l, counter++, xyz[0][i], xyz[1][i], xyz[2][i]);
+            ++i;
+        }
+    }
+    if (!dest) { p.out = out.release(); }
+}
+
+// convert_cache() into a stream or a mapped file
+size_t convert_to(std::ostream *os, mapped_output *map, const gro_cache &c,
+                  const model &wm, int threads, run_stats *stats) {
+    phase_timer conv{ stats, "convert" };
+    int model_size{ wm.size() };
+    size_t n{ c.atoms() };
+    size_t nw{ c.waters() };
+    const uint64_t *first{ c.water_first() };
+    const uint8_t *sites{ c.water_sites() };
+
+    // pieces of whole waters, several per thread
+    size_t np{ std::min(static_cast<size_t>(threads > 0 ? threads : 1) * 8,
+                        nw / 16384 + 1) };
+    std::vector<piece> pieces(np);
+    size_t counter{ 1 };
+    for (size_t k = 0; k < np; ++k) {
+        piece &p{ pieces[k] };
+        p.wbegin = nw * k / np;
+        p.wend = nw * (k + 1) / np;
+        p.abegin = k == 0 ? 0 : first[p.wbegin];
+        p.aend = k + 1 == np ? n : first[p.wend];
+        size_t nwa{ 0 };
+        for (size_t j = p.wbegin; j < p.wend; ++j) { nwa += sites[j]; }
+        p.counter = counter;
+        p.nout = p.aend - p.abegin - nwa + (p.wend - p.wbegin) * model_size;
+        counter += p.nout;
+    }
+    size_t nout{ counter - 1 };
+
+    gro_writer w{ os, map ? 256 : size_t{ 1 } << 20 };
+    w.line(c.title());
+    w.count(nout);
+    if (map) {
+        // title and count, then the atoms in place (see process_gro())
+        std::string head{ w.release() };
+        size_t at{ map->size() + head.size() };
+        char *p{ map->resize(at + nout * 45) };
+        std::memcpy(p + at - head.size(), head.data(), head.size());
+        std::vector<char> done(np, 0);
+        try {
+            parallel_for(np, threads, [&](size_t k) {
+                convert_piece(c, wm, pieces[k],
+                              p + at + (pieces[k].counter - 1) * 45);
+                done[k] = 1;
+            });
+        }
+        catch (...) {
+            // keep the pieces before the error, as the writer would
+            size_t k{ 0 };
+            while (done[k]) { ++k; }
+            map->resize(at + (pieces[k].counter - 1) * 45);
+            throw;
+        }
+    } else {
+        parallel_ordered(np, threads, 2 * threads,
+            [&](size_t k) { convert_piece(c, wm, pieces[k], nullptr); },
+            [&](size_t k) {
+                phase_timer out{ stats, "write", &conv };
+                out.count(pieces[k].out.size(), pieces[k].nout);
+                w.text(pieces[k].out);
+                std::string().swap(pieces[k].out); // release memory
+            });
+    }
+    if (c.has_box()) { w.line(c.box()); }
+    if (map) {
+        std::string tail{ w.release() };
+        size_t at{ map->size() };
+        std::memcpy(map->resize(at + tail.size()) + at, tail.data(),
+                    tail.size());
+    } else {
+        w.flush();
+    }
+    conv.count(map ? nout * 45 : 0, nout, nw);
+    return nw;
+}
+
+} // namespace
+
+gro_cache::gro_cache(const std::string &name) {
+    int fd{ open(name.c_str(), O_RDONLY) };
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::string msg{ "cannot open '" + name + "': " };
+        msg += strerror(errno);
+        if (fd >= 0) { close(fd); }
+        throw(std::runtime_error(msg));
+    }
+    nbytes = static_cast<size_t>(st.st_size);
+    std::string bad{ "'" + name + "' is not a valid cache file" };
+    if (nbytes < sizeof(cache_header)) {
+        close(fd);
+        throw(std::runtime_error(bad));
+    }
+    void *p{ mmap(nullptr, nbytes, PROT_READ, MAP_PRIVATE, fd, 0) };
+    close(fd);
+    if (p == MAP_FAILED) {
+        std::string msg{ "cannot map '" + name + "': " };
+        msg += strerror(errno);
+        throw(std::runtime_error(msg));
+    }
+    map = p;
+    const char *base{ static_cast<const char *>(p) };
+    cache_header h;
+    std::memcpy(&h, base, sizeof(h));
+
+    // everything is checked that could lead outside the mapping
+    bool ok{ std::memcmp(h.magic, cache_magic, 8) == 0
+             && h.version == cache_version
+             && h.byte_order == cache_byte_order && h.file_size == nbytes
+             && h.natoms < nbytes && h.nwaters < nbytes && h.nnames <= 65536
+             && h.title_bytes < nbytes && h.box_bytes < nbytes
+             && cache_layout(h).end == nbytes };
+    if (ok) {
+        cache_layout at{ h };
+        natoms = static_cast<size_t>(h.natoms);
+        nwaters = static_cast<size_t>(h.nwaters);
+        title_line = line_view(base + at.title, h.title_bytes);
+        box_line = line_view(base + at.box, h.box_bytes);
+        box_present = h.has_box != 0;
+        names = base + at.names;
+        xs = reinterpret_cast<const double *>(base + at.x);
+        ys = reinterpret_cast<const double *>(base + at.y);
+        zs = reinterpret_cast<const double *>(base + at.z);
+        resnr = reinterpret_cast<const int32_t *>(base + at.resnr);
+        resname = reinterpret_cast<const uint16_t *>(base + at.resname);
+        atomname = reinterpret_cast<const uint16_t *>(base + at.atomname);
+        first = reinterpret_cast<const uint64_t *>(base + at.first);
+        sites = reinterpret_cast<const uint8_t *>(base + at.sites);
+        for (size_t i = 0; ok && i < natoms; ++i) {
+            ok = resname[i] < h.nnames && atomname[i] < h.nnames;
+        }
+        uint64_t next{ 0 }; // first atom after the previous water
+        for (size_t j = 0; ok && j < nwaters; ++j) {
+            ok = first[j] >= next && sites[j] >= 3
+                 && first[j] + sites[j] <= natoms;
+            next = first[j] + sites[j];
+        }
+    }
+    if (!ok) {
+        munmap(map, nbytes);
+        map = nullptr;
+        throw(std::runtime_error(bad));
+    }
+    src_size = h.source_size;
+    src_mtime = h.source_mtime;
+    src_hash = h.source_hash;
+}
+
+gro_cache::~gro_cache() {
+    if (map) { munmap(map, nbytes); }
+}
+
+std::string gro_cache::name_for(const std::string &source) {
+    return source + ".wcache";
+}
+
+bool gro_cache::matches(const std::string &source) const {
+    uint64_t size, hash;
+    int64_t mtime;
+    try {
+        source_id(source, size, mtime, hash);
+    }
+    catch (const std::runtime_error &) {
+        return false;
+    }
+    return size == src_size && mtime == src_mtime && hash == src_hash;
+}
+
+void gro_cache::prefix(size_t i, char *p) const {
+    format_resnr(resnr[i], p);
+    std::memcpy(p + 5, names + 8 * resname[i], 5);
+    std::memcpy(p + 10, names + 8 * atomname[i], 5);
+}
+
+bool gro_cache::write(const std::string &name, const text_file &lines,
+                      const std::string &source) {
+    water_layout wl{ find_waters(lines, 0) };
+    size_t n{ wl.natoms };
+    bool box{ lines.size() == n + 3 };
+    if (lines.size() != n + 2 && !box) { return false; } // not one frame
+
+    // every record must be what the writer makes of its values
+    std::vector<double> xyz[3];
+    for (auto &v: xyz) { v.resize(n); }
+    std::vector<int32_t> rn(n);
+    std::vector<uint16_t> rname(n), aname(n);
+    std::unordered_map<std::string, uint16_t> index;
+    std::string table; // the name fields, 8 bytes each
+    auto intern = [&](line_view f, uint16_t &k) {
+        std::string s{ f.str() };
+        auto e = index.find(s);
+        if (e != index.end()) {
+            k = e->second;
+            return true;
+        }
+        if (index.size() == 65536) { return false; }
+        k = static_cast<uint16_t>(index.size());
+        index[s] = k;
+        s.resize(8, ' ');
+        table += s;
+        return true;
+    };
+    for (size_t i = 0; i < n; ++i) {
+        line_view l{ lines[i + 2] };
+        if (l.size() < 44) { return false; }
+        long r;
+        char f[8];
+        if (!parse_long(l.substr(0, 5), r) || r < -9999 || r > 99999) {
+            return false;
+        }
+        rn[i] = static_cast<int32_t>(r);
+        format_resnr(rn[i], f);
+        if (std::memcmp(f, l.data(), 5) != 0) { return false; }
+        if (!intern(l.substr(5, 5), rname[i])
+            || !intern(l.substr(10, 5), aname[i])) {
+            return false;
+        }
+        for (int k = 0; k < 3; ++k) {
+            line_view c{ l.substr(20 + 8 * k, 8) };
+            if (!parse_real(c, xyz[k][i]) || !format_fixed83(xyz[k][i], f)
+                || std::memcmp(f, c.data(), 8) != 0) {
+                return false;
+            }
+        }
+    }
+    for (size_t j = 0; j < wl.first.size(); ++j) {
+        if (wl.sites[j] > 255) { return false; }
+    }
+
+    cache_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, cache_magic, 8);
+    h.version = cache_version;
+    h.byte_order = cache_byte_order;
+    source_id(source, h.source_size, h.source_mtime, h.source_hash);
+    h.natoms = n;
+    h.nwaters = wl.first.size();
+    h.nnames = index.size();
+    h.title_bytes = lines[0].size();
+    h.box_bytes = box ? lines[n + 2].size() : 0;
+    h.has_box = box ? 1 : 0;
+    cache_layout at{ h };
+    h.file_size = at.end;
+
+    // written under a temporary name: a cache file is always complete
+    std::string tmp{ name + ".tmp" };
+    {
+        mapped_output out{ tmp };
+        char *p{ out.resize(at.end) };
+        std::memset(p, 0, at.end);
+        std::memcpy(p, &h, sizeof(h));
+        std::memcpy(p + at.title, lines[0].data(), h.title_bytes);
+        if (box) { std::memcpy(p + at.box, lines[n + 2].data(), h.box_bytes); }
+        std::memcpy(p + at.names, table.data(), table.size());
+        std::memcpy(p + at.x, xyz[0].data(), 8 * n);
+        std::memcpy(p + at.y, xyz[1].data(), 8 * n);
+        std::memcpy(p + at.z, xyz[2].data(), 8 * n);
+        std::memcpy(p + at.resnr, rn.data(), 4 * n);
+        std::memcpy(p + at.resname, rname.data(), 2 * n);
+        std::memcpy(p + at.atomname, aname.data(), 2 * n);
+        uint64_t *f{ reinterpret_cast<uint64_t *>(p + at.first) };
+        uint8_t *s{ reinterpret_cast<uint8_t *>(p + at.sites) };
+        for (size_t j = 0; j < wl.first.size(); ++j) {
+            f[j] = wl.first[j];
+            s[j] = static_cast<uint8_t>(wl.sites[j]);
+        }
+        out.close();
+    }
+    if (std::rename(tmp.c_str(), name.c_str()) != 0) {
+        std::string msg{ "cannot write '" + name + "': " };
+        msg += strerror(errno);
+        unlink(tmp.c_str());
+        throw(std::runtime_error(msg));
+    }
+    return true;
+}
+
+size_t convert_cache(std::ostream &os, const gro_cache &c, const model &wm,
+                     int threads, run_stats *stats) {
+    return convert_to(&os, nullptr, c, wm, threads, stats);
+}
+
+size_t convert_cache(mapped_output &out, const gro_cache &c,
+                     const model &wm, int threads, run_stats *stats) {
+    return convert_to(nullptr, &out, c, wm, threads, stats);
+}
+
+void export_cache(std::ostream &os, const gro_cache &c) {
+    gro_writer w{ &os };
+    w.line(c.title());
+    w.count(c.atoms());
+    char rec[44];
+    std::memset(rec, ' ', sizeof(rec));
+    for (size_t i = 0; i < c.atoms(); ++i) {
+        c.prefix(i, rec);
+        w.atom(line_view(rec, sizeof(rec)), i + 1, c.x()[i], c.y()[i],
+               c.z()[i]);
+    }
+    if (c.has_box()) { w.line(c.box()); }
+    w.flush();
+}
@@ -0,0 +1,130 @@
+#ifndef GRO_CACHE_H
+#define GRO_CACHE_H
+#include "mapped_output.h"
+#include "model.h"
+#include "readall.h"
+#include "stats.h"
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+/** \defgroup gro_cache Binary cache of a gro file
+ * A parsed single frame gro file in a compact binary form, for converting
+ * one large structure to several models in a row without parsing its text
+ * each time. The cache file holds the title and box lines, the atoms as
+ * arrays (x, y and z in nm, residue numbers, and residue and atom names
+ * as indices into a table of the distinct 5 character fields), and the
+ * water molecules found in them. It is read through a mapping, without
+ * any parsing, and the source file it was made from is recognised by its
+ * size, modification time and a hash of its first and last 64 kB.
+ *
+ * Only files that can be written back unchanged from the arrays are
+ * cached: a single frame whose atom records are in the "%5d%-5s%5s%5d
+ * %8.3f%8.3f%8.3f" format (velocities are dropped, as in any conversion).
+ * Converting from the cache then gives the same output as from the text.
+ * @{
+ */
+
+//! A cache file, mapped into memory
+class gro_cache {
+public:
+    //! Map a cache file
+    /**
+     * \param name the cache file
+     * \throw runtime_error if it cannot be read or is not a cache file
+     *     (or was written on a machine of a different byte order)
+     */
+    explicit gro_cache(const std::string &name);
+    ~gro_cache();
+
+    gro_cache(const gro_cache &) = delete;
+    gro_cache &operator=(const gro_cache &) = delete;
+
+    //! Write the cache of a gro file held in memory
+    /**
+     * \param name the cache file
+     * \param lines the gro file
+     * \param source its name (for the size, time and hash)
+     * \return false (and nothing written) if the file cannot be cached:
+     *     not a single frame, or not in the standard format
+     * \throw runtime_error if the cache file cannot be written
+     * \throw gro_error if the file is not a valid gro file
+     */
+    static bool write(const std::string &name, const text_file &lines,
+                      const std::string &source);
+
+    //! name of the cache of a gro file ("x.gro" -> "x.gro.wcache")
+    static std::string name_for(const std::string &source);
+
+    //! true if the cache was made from the file source as it is now
+    bool matches(const std::string &source) const;
+
+    size_t atoms() const { return natoms; }   //!< number of atoms
+    size_t waters() const { return nwaters; } //!< number of waters
+    line_view title() const { return title_line; } //!< title line
+    bool has_box() const { return box_present; } //!< false: no box line
+    line_view box() const { return box_line; }     //!< box line
+
+    //! residue number, residue name and atom name of atom i as the
+    //! first 15 columns of its atom record
+    void prefix(size_t i, char *p) const;
+
+    const double *x() const { return xs; } //!< x coordinates (nm)
+    const double *y() const { return ys; } //!< y coordinates (nm)
+    const double *z() const { return zs; } //!< z coordinates (nm)
+    //! the O atom of each water molecule
+    const uint64_t *water_first() const { return first; }
+    //! number of atoms of each water molecule
+    const uint8_t *water_sites() const { return sites; }
+
+private:
+    void *map{ nullptr };
+    size_t nbytes{ 0 };
+    uint64_t src_size{ 0 };
+    int64_t src_mtime{ 0 };
+    uint64_t src_hash{ 0 };
+    size_t natoms{ 0 };
+    size_t nwaters{ 0 };
+    line_view title_line{};
+    line_view box_line{};
+    bool box_present{ false };
+    const char *names{ nullptr };    //!< 8 bytes per name field
+    const double *xs{ nullptr };
+    const double *ys{ nullptr };
+    const double *zs{ nullptr };
+    const int32_t *resnr{ nullptr };
+    const uint16_t *resname{ nullptr };
+    const uint16_t *atomname{ nullptr };
+    const uint64_t *first{ nullptr };
+    const uint8_t *sites{ nullptr };
+};
+
+//! Modify the water molecules of a cached gro file to match model wm
+/**
+ * The output is the same as from process_gro() on the source file.
+ *
+ * \param os the output stream to write results to
+ * \param c the cache
+ * \param wm the water model to be used in the output
+ * \param threads number of threads to use
+ * \param stats if not nullptr, the conversion is recorded as the phases
+ *     convert and write
+ * \return the number of molecules changed
+ * \throws water_error for a bad water structure (where() is not known)
+ */
+size_t convert_cache(std::ostream &os, const gro_cache &c, const model &wm,
+                     int threads = 1, run_stats *stats = nullptr);
+
+//! As above, formatting the atoms in place in a mapped file (see the
+//! process_gro() for a mapped_output)
+size_t convert_cache(mapped_output &out, const gro_cache &c,
+                     const model &wm, int threads = 1,
+                     run_stats *stats = nullptr);
+
+//! Write a cached file back as a gro file (without velocities)
+void export_cache(std::ostream &os, const gro_cache &c);
+
+/**@}*/
+
+#endif
@@ -0,0 +1,111 @@
+#include "gro_parse.h"
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// powers of ten that are exact doubles
+static const double pow10[]{ 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+                             1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+
+// white space as for isspace() in the C locale
+static bool is_space(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+// slow path: copy to a terminated buffer for strtod
+static bool parse_real_strtod(line_view f, double &v) {
+    char buf[64];
+    if (f.size() >= sizeof(buf)) { return false; }
+    std::memcpy(buf, f.data(), f.size());
+    buf[f.size()] = '\0';
+    char *end;
+    errno = 0;
+    double d{ std::strtod(buf, &end) };
+    if (end == buf || errno == ERANGE) { return false; }
+    v = d;
+    return true;
+}
+
+bool parse_real(line_view f, double &v) {
+    size_t n{ f.size() };
+    size_t i{ 0 };
+    while (i < n && f[i] == ' ') { ++i; }
+
+    bool neg{ false };
+    if (i < n && (f[i] == '-' || f[i] == '+')) {
+        neg = f[i] == '-';
+        ++i;
+    }
+
+    // digits[.digits] as an integer mantissa and a number of decimals
+    unsigned long long m{ 0 };
+    int digits{ 0 };
+    int decimals{ 0 };
+    while (i < n && f[i] >= '0' && f[i] <= '9') {
+        m = 10 * m + static_cast<unsigned>(f[i] - '0');
+        ++digits; ++i;
+    }
+    if (i < n && f[i] == '.') {
+        ++i;
+        while (i < n && f[i] >= '0' && f[i] <= '9') {
+            m = 10 * m + static_cast<unsigned>(f[i] - '0');
+            ++digits; ++decimals; ++i;
+        }
+    }
+
+    // the whole field must be used up (anything else: strtod decides),
+    // and the mantissa must be exact
+    if (i != n || digits == 0 || digits > 15) {
+        return parse_real_strtod(f, v);
+    }
+
+    // both numbers are exact, so the division is correctly rounded,
+    // as is the result of strtod
+    double d{ static_cast<double>(m) / pow10[decimals] };
+    v = neg ? -d : d;
+    return true;
+}
+
+bool parse_long(line_view f, long &v) {
+    size_t n{ f.size() };
+    size_t i{ 0 };
+    while (i < n && is_space(f[i])) { ++i; }
+
+    bool neg{ false };
+    if (i < n && (f[i] == '-' || f[i] == '+')) {
+        neg = f[i] == '-';
+        ++i;
+    }
+
+    size_t first{ i };
+    unsigned long m{ 0 };
+    const unsigned long limit{ neg ? 0ul - static_cast<unsigned long>(LONG_MIN)
+                                   : static_cast<unsigned long>(LONG_MAX) };
+    while (i < n && f[i] >= '0' && f[i] <= '9') {
+        unsigned d{ static_cast<unsigned>(f[i] - '0') };
+        if (m > (limit - d) / 10) { return false; } // overflow
+        m = 10 * m + d;
+        ++i;
+    }
+    if (i == first) { return false; }
+
+    v = neg ? static_cast<long>(0ul - m) : static_cast<long>(m);
+    return true;
+}
+
+int parse_box(line_view l, double box[9]) {
+    for (int k = 0; k < 9; ++k) { box[k] = 0.0; }
+    int k{ 0 };
+    size_t i{ 0 };
+    size_t n{ l.size() };
+    while (k < 9) {
+        while (i < n && is_space(l[i])) { ++i; }
+        size_t b{ i };
+        while (i < n && !is_space(l[i])) { ++i; }
+        if (i == b || !parse_real(l.substr(b, i - b), box[k])) { break; }
+        ++k;
+    }
+    return k;
+}
@@ -0,0 +1,47 @@
+#ifndef GRO_PARSE_H
+#define GRO_PARSE_H
+#include "readall.h"
+
+/** \defgroup gro_parse Parsing of .gro fields
+ * Locale independent parsers for the numeric fields of .gro files, which
+ * need no allocation. Numbers written as "%8.3f" (or with any other number
+ * of decimals) are read as scaled integers; other forms, e.g. with an
+ * exponent, go through strtod. The results are the same as from std::stod
+ * and std::stol.
+ * @{
+ */
+
+//! Read a real number from a field, like std::stod
+/**
+ * Leading white space is skipped, characters after the number are ignored.
+ *
+ * \param f the field (e.g. 8 columns of an atom line)
+ * \param[out] v the value read
+ * \return false if the field does not start with a number (or overflows)
+ */
+bool parse_real(line_view f, double &v);
+
+//! Read an integer from a field, like std::stol
+/**
+ * Leading white space is skipped, characters after the number are ignored.
+ *
+ * \param f the field (e.g. the atom count line)
+ * \param[out] v the value read
+ * \return false if the field does not start with a number (or overflows)
+ */
+bool parse_long(line_view f, long &v);
+
+//! Read the box vectors from the last line of a frame
+/**
+ * The line holds 3 (rectangular box) or 9 numbers in free format.
+ * Missing values are set to zero.
+ *
+ * \param l the box line
+ * \param[out] box v1(x) v2(y) v3(z) v1(y) v1(z) v2(x) v2(z) v3(x) v3(y)
+ * \return the number of values read
+ */
+int parse_box(line_view l, double box[9]);
+
+/**@}*/
+
+#endif
@@ -0,0 +1,175 @@
+#include "gro_writer.h"
+#include "gro.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+bool format_fixed83(double x, char *p) {
+    // at most 4 digits before the point ("-999.999" / "9999.999")
+    if (!(x > -1000.0 && x < 10000.0)) { return false; } // also NaN
+
+    // x in units of 0.001; the product is within 1e-9 of the exact value
+    double t{ x * 1000.0 };
+    double f{ std::floor(t) };
+    double frac{ t - f };
+    if (std::fabs(frac - 0.5) < 1.0e-6) { return false; } // printf decides
+    long long r{ static_cast<long long>(f) + (frac > 0.5 ? 1 : 0) };
+
+    bool neg{ std::signbit(x) }; // printf writes -0.000 for these too
+    unsigned long long u{ static_cast<unsigned long long>(neg ? -r : r) };
+    if (u > (neg ? 999999ull : 9999999ull)) { return false; } // rounded up
+
+    // fill from the right: 3 decimals, point, integer part, sign, spaces
+    int i{ 7 };
+    for (int k = 0; k < 3; ++k) {
+        p[i--] = static_cast<char>('0' + u % 10);
+        u /= 10;
+    }
+    p[i--] = '.';
+    do {
+        p[i--] = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u > 0);
+    if (neg) { p[i--] = '-'; }
+    while (i >= 0) { p[i--] = ' '; }
+    return true;
+}
+
+// "%5d" of the number modulo 100000, as GROMACS writes atom numbers
+static void format_counter(size_t c, char *p) {
+    c %= 100000;
+    char d[5]; // digits, least significant first
+    int n{ 0 };
+    do {
+        d[n++] = static_cast<char>('0' + c % 10);
+        c /= 10;
+    } while (c > 0);
+    int i{ 0 };
+    for (; i < 5 - n; ++i) { p[i] = ' '; }
+    for (int k = n - 1; i < 5; ++i, --k) { p[i] = d[k]; }
+}
+
+gro_writer::gro_writer(std::ostream *os, size_t block_size) :
+    out{ os }, block{ block_size }, buf{}, used{ 0 }, dest{ nullptr },
+    capacity{ 0 } {
+    buf.resize(block + 256);
+}
+
+gro_writer::gro_writer(char *begin, char *end) :
+    out{ nullptr }, block{ static_cast<size_t>(end - begin) }, buf{},
+    used{ 0 }, dest{ begin }, capacity{ block } {}
+
+gro_writer::~gro_writer() {
+    try {
+        flush();
+    }
+    catch (...) {} // stream state shows the error
+}
+
+char *gro_writer::room(size_t n) {
+    if (dest) {
+        if (used + n > capacity) {
+            throw(std::length_error("gro_writer: output array too small"));
+        }
+        char *p{ dest + used };
+        used += n;
+        return p;
+    }
+    if (out && used + n > block) { flush(); }
+    if (used + n > buf.size()) {
+        buf.resize(std::max(2 * buf.size(), used + n));
+    }
+    char *p{ &buf[used] };
+    used += n;
+    return p;
+}
+
+void gro_writer::flush() {
+    if (out && used > 0) {
+        out->write(buf.data(), static_cast<std::streamsize>(used));
+        used = 0;
+    }
+}
+
+std::string gro_writer::release() {
+    buf.resize(used);
+    std::string r;
+    r.swap(buf);
+    used = 0;
+    buf.resize(block + 256);
+    return r;
+}
+
+void gro_writer::line(line_view l) {
+    char *p{ room(l.size() + 1) };
+    std::memcpy(p, l.data(), l.size());
+    p[l.size()] = '\n';
+}
+
+void gro_writer::text(line_view s) {
+    if (out && s.size() > block) { // no point in copying
+        flush();
+        out->write(s.data(), static_cast<std::streamsize>(s.size()));
+        return;
+    }
+    char *p{ room(s.size()) };
+    std::memcpy(p, s.data(), s.size());
+}
+
+void gro_writer::count(size_t n) {
+    char d[24];
+    int k{ 0 };
+    do {
+        d[k++] = static_cast<char>('0' + n % 10);
+        n /= 10;
+    } while (n > 0);
+    char *p{ room(static_cast<size_t>(k) + 1) };
+    while (k > 0) { *p++ = d[--k]; }
+    *p = '\n';
+}
+
+char *gro_writer::record(line_view l, size_t c) {
+    if (l.length() < 44) {
+        std::string msg { "file format error (atom)" };
+        throw(gro_error(msg, l));
+    };
+    char *p{ room(45) };
+    std::memcpy(p, l.data(), 15);
+    format_counter(c, p + 15);
+    p[44] = '\n';
+    return p;
+}
+
+void gro_writer::atom(line_view l, size_t c) {
+    char *p{ record(l, c) };
+    std::memcpy(p + 20, l.data() + 20, 24);
+}
+
+char *gro_writer::record(line_view l, size_t c, double x, double y,
+                         double z) {
+    char *p{ record(l, c) };
+    if (!format_fixed83(x, p + 20) || !format_fixed83(y, p + 28)
+        || !format_fixed83(z, p + 36)) {
+        // a field does not fit (or is a tie): leave it all to printf,
+        // which also cuts the three fields to 24 characters
+        char tmp[32];
+        std::snprintf(tmp, 25, "%8.3f%8.3f%8.3f", x, y, z);
+        std::memcpy(p + 20, tmp, 24);
+    }
+    return p;
+}
+
+void gro_writer::atom(line_view l, size_t c, double x, double y, double z) {
+    record(l, c, x, y, z);
+}
+
+void gro_writer::atom(line_view l, const char *name, size_t c,
+                      double x, double y, double z) {
+    char *p{ record(l, c, x, y, z) + 10 };
+    size_t n{ std::strlen(name) };
+    if (n > 5) { n = 5; }
+    std::memset(p, ' ', 5 - n);
+    std::memcpy(p + 5 - n, name, n);
+}
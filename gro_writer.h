@@ -0,0 +1,95 @@
+#ifndef GRO_WRITER_H
+#define GRO_WRITER_H
+#include "readall.h"
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+//! Writer of .gro records into a large reusable buffer
+/**
+ * Atom records are built from an input atom line: residue number and name
+ * and atom name (columns 1-15) are kept, the atom number is replaced and
+ * velocities are dropped. The number is written modulo 100000 as "%5d"
+ * (atom 100000 is 0, as in files written by GROMACS), coordinates as
+ * "%8.3f" using integer fixed point arithmetic (printf is only used for
+ * ties and very large values), so the result is the same as with snprintf,
+ * without allocations.
+ *
+ * If a stream is given, the buffer is written to it in large blocks,
+ * otherwise it grows to hold all output (see release()). A writer can also
+ * fill an array of a known size in place, such as the part of a mapped
+ * output file that a chunk of atoms ends up in.
+ */
+class gro_writer {
+public:
+    //! Constructor
+    /**
+     * \param os stream to write to (nullptr: keep everything in the buffer)
+     * \param block size of the blocks written to the stream
+     */
+    explicit gro_writer(std::ostream *os = nullptr, size_t block = 1 << 20);
+    //! Write into an array instead of a buffer of its own
+    /**
+     * \param begin start of the array (must outlive the writer)
+     * \param end end of the array; writing more throws std::length_error
+     */
+    gro_writer(char *begin, char *end);
+    ~gro_writer(); //!< writes what is left in the buffer
+
+    gro_writer(const gro_writer &) = delete;
+    gro_writer &operator=(const gro_writer &) = delete;
+
+    //! copy a line unchanged
+    void line(line_view l);
+
+    //! copy text unchanged (no newline added)
+    void text(line_view s);
+
+    //! write a number on a line of its own (atom count)
+    void count(size_t n);
+
+    //! copy an atom line with atom number c, without velocities
+    /** \throws gro_error if the line is too short for an atom record */
+    void atom(line_view l, size_t c);
+
+    //! as atom(l, c) with new coordinates (in nm)
+    void atom(line_view l, size_t c, double x, double y, double z);
+
+    //! as atom(l, c, x, y, z) with a new atom name
+    void atom(line_view l, const char *name, size_t c,
+              double x, double y, double z);
+
+    //! write the buffer to the stream (if any)
+    void flush();
+
+    size_t size() const { return used; } //!< number of bytes in the buffer
+
+    //! take the contents of the buffer, leaving it empty (not for arrays)
+    std::string release();
+
+private:
+    std::ostream *out; //!< destination (or nullptr)
+    size_t block;      //!< flush threshold
+    std::string buf;   //!< the buffer (only [0, used) is output)
+    size_t used;       //!< number of bytes in the buffer
+    char *dest;        //!< array written instead of buf (or nullptr)
+    size_t capacity;   //!< size of the array
+
+    char *room(size_t n); //!< make room for n more bytes
+    char *record(line_view l, size_t c); //!< first 20 columns of a record
+    //! a record with new coordinates (returned for changes)
+    char *record(line_view l, size_t c, double x, double y, double z);
+};
+
+//! Write x in the format "%8.3f"
+/**
+ * Integer fixed point version of snprintf(p, 9, "%8.3f", x), exact for
+ * all values that fit in 8 characters and are not (near) a tie.
+ *
+ * \param x the value to write
+ * \param[out] p the 8 characters written (no terminating zero)
+ * \return false (and nothing written) if x cannot be done this way
+ */
+bool format_fixed83(double x, char *p);
+
+#endif
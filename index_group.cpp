@@ -0,0 +1,131 @@
+#include "index_group.h"
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+
+namespace {
+
+// s without leading and trailing white space
+std::string trimmed(const std::string &s) {
+    size_t b{ 0 };
+    size_t e{ s.size() };
+    while (b < e && std::isspace(static_cast<unsigned char>(s[b]))) { ++b; }
+    while (e > b && std::isspace(static_cast<unsigned char>(s[e - 1]))) {
+        --e;
+    }
+    return s.substr(b, e - b);
+}
+
+bool same_name(const std::string &a, const std::string &b) {
+    if (a.size() != b.size()) { return false; }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(a[i]))
+            != std::tolower(static_cast<unsigned char>(b[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the group number given as a name, or npos if it is not a number
+size_t group_number(const std::string &g) {
+    if (g.empty() || g.size() > 9) { return atom_selection::npos; }
+    for (char c: g) {
+        if (c < '0' || c > '9') { return atom_selection::npos; }
+    }
+    return static_cast<size_t>(std::strtoul(g.c_str(), nullptr, 10));
+}
+
+} // namespace
+
+void atom_selection::add(size_t i) {
+    if (i / 64 >= bits.size()) { bits.resize(i / 64 + 1, 0); }
+    uint64_t b{ uint64_t{ 1 } << (i % 64) };
+    if (!(bits[i / 64] & b)) {
+        bits[i / 64] |= b;
+        ++n;
+    }
+}
+
+size_t atom_selection::next(size_t i) const {
+    size_t w{ i / 64 };
+    if (w >= bits.size()) { return npos; }
+    uint64_t b{ bits[w] & (~uint64_t{ 0 } << (i % 64)) };
+    while (b == 0) {
+        if (++w >= bits.size()) { return npos; }
+        b = bits[w];
+    }
+    return w * 64 + static_cast<size_t>(__builtin_ctzll(b));
+}
+
+size_t atom_selection::end() const {
+    for (size_t w = bits.size(); w > 0; --w) {
+        if (bits[w - 1]) {
+            return (w - 1) * 64 + 64
+                   - static_cast<size_t>(__builtin_clzll(bits[w - 1]));
+        }
+    }
+    return 0;
+}
+
+atom_selection read_index_group(std::istream &is, const std::string &group,
+                                const std::string &source) {
+    std::string want{ trimmed(group) };
+    size_t number{ group_number(want) };
+    atom_selection by_name;
+    atom_selection by_number;
+    bool named{ false };    // a group of that name was found
+    bool numbered{ false }; // the group of that number was found
+    atom_selection *into{ nullptr }; // where the current group goes
+    size_t groups{ 0 };     // groups read so far
+    std::string l;
+    size_t n{ 0 }; // line number
+    while (std::getline(is, l)) {
+        ++n;
+        size_t b{ l.find_first_not_of(" \t\r") };
+        if (b == std::string::npos) { continue; } // empty line
+        if (l[b] == '[') {
+            size_t e{ l.find(']', b) };
+            if (e == std::string::npos) {
+                throw(index_error("']' expected", source, n));
+            }
+            std::string name{ trimmed(l.substr(b + 1, e - b - 1)) };
+            into = nullptr;
+            if (!named && same_name(name, want)) {
+                named = true;
+                into = &by_name;
+            } else if (groups == number && !named) {
+                numbered = true;
+                into = &by_number;
+            }
+            ++groups;
+            continue;
+        }
+        if (groups == 0) {
+            throw(index_error("'[ group ]' expected", source, n));
+        }
+        const char *p{ l.c_str() + b };
+        while (*p != '\0') {
+            if (std::isspace(static_cast<unsigned char>(*p))) {
+                ++p;
+                continue;
+            }
+            char *q;
+            errno = 0;
+            unsigned long long a{ std::strtoull(p, &q, 10) };
+            bool end{ *q == '\0'
+                      || std::isspace(static_cast<unsigned char>(*q)) };
+            if (q == p || errno != 0 || a == 0 || *p == '-' || !end) {
+                throw(index_error("atom number expected", source, n));
+            }
+            if (into) { into->add(static_cast<size_t>(a - 1)); }
+            p = q;
+        }
+    }
+    if (is.bad()) {
+        throw(index_error("read error", source, n));
+    }
+    if (named) { return by_name; }
+    if (numbered) { return by_number; }
+    throw(index_error("no group '" + want + "'", source, 0));
+}
@@ -0,0 +1,76 @@
+#ifndef INDEX_GROUP_H
+#define INDEX_GROUP_H
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/** \defgroup index_group Index groups
+ * Atoms selected by a group of a GROMACS index (.ndx) file, so that only
+ * some of the waters are converted (see process_gro()).
+ * @{
+ */
+
+//! A set of atoms of a frame as a bitmap (atoms numbered from 0)
+class atom_selection {
+public:
+    //! the position returned by next() after the last selected atom
+    static constexpr size_t npos{ static_cast<size_t>(-1) };
+
+    //! add atom i to the set
+    void add(size_t i);
+
+    //! true if atom i is in the set
+    bool has(size_t i) const {
+        return i / 64 < bits.size() && ((bits[i / 64] >> (i % 64)) & 1u);
+    }
+
+    //! the first atom of the set at or after atom i (npos if none)
+    size_t next(size_t i) const;
+
+    size_t count() const { return n; } //!< number of atoms in the set
+    //! one past the highest atom in the set (0 if empty)
+    size_t end() const;
+
+private:
+    std::vector<uint64_t> bits{};
+    size_t n{ 0 };
+};
+
+//! Error in an index file
+class index_error: public std::runtime_error {
+public:
+    //! Constructor of index_error class
+    /**
+     * \param msg description of the error
+     * \param source name of the index file
+     * \param line number of the line in which the error occurred (0: none)
+     */
+    index_error(const std::string &msg, const std::string &source,
+                size_t line) :
+        std::runtime_error(source + (line > 0 ? ":" + std::to_string(line)
+                                              : std::string()) + ": " + msg) {}
+};
+
+//! Read a group of a GROMACS index file
+/**
+ * The file is made of groups, each a line "[ name ]" followed by atom
+ * numbers (from 1, in the order of the gro file) separated by white space.
+ * The group is found by its name, ignoring case (the first of that name),
+ * or, if no group has that name, by its number (from 0) as listed by the
+ * GROMACS tools.
+ *
+ * \param is the index file
+ * \param group name or number of the group
+ * \param source name of the file (for messages)
+ * \return the atoms of the group, numbered from 0
+ * \throws index_error for a bad file or if the group is not found
+ */
+atom_selection read_index_group(std::istream &is, const std::string &group,
+                                const std::string &source);
+
+/**@}*/
+
+#endif
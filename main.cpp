@@ -1,26 +1,111 @@
 #include "model.h"
 #include "readall.h"
 #include "gro.h"
+#include "parallel.h"
+#include "stats.h"
+#include "xtc.h"
+#include "batch.h"
+#include "codec.h"
+#include "gro_cache.h"
+#include "uring.h"
+#include "water_order.h"
+#include "geometry_report.h"
+#include "index_group.h"
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <cerrno>
 #include <cstring>
 #include <vector>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
 
 //! Print unix style usage information
 /**
  * \param a  name of the current executable
 */
 void print_help(const std::string a) {
-    std::cout << "Usage: " << a << " [-m model] infile [outfile]\n";
+    std::cout << "Usage: " << a << " [-m model] [-j N] [-s] infile [outfile]\n";
+    std::cout << "       " << a << " -m model -m model ... [-j N] infile ";
+    std::cout << "outfile outfile ...\n";
+    std::cout << "       " << a << " [-m model] -r ref.gro in.xtc out.xtc\n";
+    std::cout << "       " << a << " [-m model] [-j N] -b [-o pattern] ";
+    std::cout << "file|dir|- ...\n";
     std::cout << "Convert MD coordinate file for use with a different ";
     std::cout << "water model.\n\n";
+    std::cout << "Options:\n";
+    std::cout << "  -m model      water model to use in the output; several ";
+    std::cout << "-m convert the\n";
+    std::cout << "                input once to all of them, one outfile ";
+    std::cout << "per model in order\n";
+    std::cout << "  -j N          use N threads (0: all cores); the output ";
+    std::cout << "does not depend on N\n";
+    std::cout << "  -s, --stream  read the input in constant memory ";
+    std::cout << "(implied if infile is -,\n";
+    std::cout << "                single threaded)\n";
+    std::cout << "  --large       large-system mode: parse each part of a ";
+    std::cout << "frame only when it\n";
+    std::cout << "                is converted, so memory per atom stays ";
+    std::cout << "small\n";
+    std::cout << "  --reorder[=hilbert|morton]  sort the waters along a ";
+    std::cout << "space-filling curve\n";
+    std::cout << "                through the box (default hilbert); other ";
+    std::cout << "atoms keep their\n";
+    std::cout << "                places\n";
+    std::cout << "  --reorder-map=file  write the permutation of the waters ";
+    std::cout << "to file\n";
+    std::cout << "  --uring       read and write files through io_uring, ";
+    std::cout << "several large requests\n";
+    std::cout << "                in flight (if the kernel allows it)\n";
+    std::cout << "  --cache       use infile.wcache, a binary copy of ";
+    std::cout << "infile, if it is up to\n";
+    std::cout << "                date, otherwise write it after the ";
+    std::cout << "conversion\n";
+    std::cout << "  --export      write a .wcache infile back as a gro file ";
+    std::cout << "(no conversion)\n\n";
+    std::cout << "  --stats[=file]  report time, throughput and memory of ";
+    std::cout << "each phase on\n";
+    std::cout << "                stderr (or as JSON in file)\n";
+    std::cout << "  --report[=file]  report the geometry of the input ";
+    std::cout << "waters and how far\n";
+    std::cout << "                their H atoms move, on stderr (or as ";
+    std::cout << "JSON in file)\n";
+    std::cout << "  -r ref.gro    structure with the atoms of the trajectory ";
+    std::cout << "(for .xtc input)\n";
+    std::cout << "  -p file       load more models from a parameter file ";
+    std::cout << "(may be repeated)\n";
+    std::cout << "  -n index.ndx -g group  convert only the waters whose O ";
+    std::cout << "atom is in group\n";
+    std::cout << "                (name or number) of the index file; ";
+    std::cout << "the other waters are\n";
+    std::cout << "                copied unchanged\n";
+    std::cout << "  -b, --batch   convert many files: the arguments are gro ";
+    std::cout << "files, directories\n";
+    std::cout << "                (all .gro files in them) or - (list of ";
+    std::cout << "files on stdin);\n";
+    std::cout << "                -j N converts N files at a time\n";
+    std::cout << "  -o pattern    output file of each input in batch mode; ";
+    std::cout << "{} stands for the\n";
+    std::cout << "                input name without directory and .gro ";
+    std::cout << "(default: stdout,\n";
+    std::cout << "                in input order)\n\n";
+    std::cout << "If infile is - the input is read from stdin.\n";
+    std::cout << "Compressed input (gzip, zstd) is recognised by its ";
+    std::cout << "contents; output files\nending in .gz or .zst are ";
+    std::cout << "compressed.\n";
+    std::cout << "An .xtc trajectory is converted frame by frame; the ";
+    std::cout << "water molecules are\nthose of the reference structure.\n";
+    std::cout << "An infile ending in .wcache is a cache made by --cache.\n";
+    std::cout << "In batch mode a file that fails is reported and skipped; ";
+    std::cout << "the exit code is that\nof the worst failure.\n\n";
     std::cout << "Supported models:\n";
     std::vector<std::string> m = model::catalog();
     for (auto i = m.begin(); i != m.end(); ++i) {
         std::cout << "  " << *i;
         if (i == m.begin()) { std::cout << " (default)"; }
+        if (!model::builtin(*i)) { std::cout << " (from parameter file)"; }
         std::cout << std::endl;
     }
 }
@@ -33,88 +118,735 @@ enum return_t {
     RET_FILE_FORMAT_ERROR
 };
 
+//! True if two names refer to the same existing file
+/**
+ * \param a,b  the file names ("-" is stdin)
+ * \return true if both exist and have the same device and inode
+*/
+bool same_file(const std::string &a, const std::string &b) {
+    auto find = [](const std::string &name, struct stat &st) {
+        return name == "-" ? fstat(STDIN_FILENO, &st) == 0
+                           : stat(name.c_str(), &st) == 0;
+    };
+    struct stat sa;
+    struct stat sb;
+    return find(a, sa) && find(b, sb) && sa.st_dev == sb.st_dev
+           && sa.st_ino == sb.st_ino;
+}
+
+//! Convert the waters of an xtc trajectory
+/**
+ * \param a  name of the current executable
+ * \param ref_name  reference structure (gro file) with the same atoms
+ * \param in_name  input trajectory
+ * \param out_name  output trajectory
+ * \param m  water model to be used in the output
+ * \param sel  the atoms of the waters to convert (nullptr: all)
+ * \return exit code of the program
+*/
+int convert_xtc(const std::string &a, const std::string &ref_name,
+                const std::string &in_name, const std::string &out_name,
+                const model &m, const atom_selection *sel) {
+    water_layout wl;
+    try {
+        text_file ref{ ref_name };
+        wl = find_waters(ref, 0, sel);
+    }
+    catch(const gro_error & e) {
+        std::cerr << a << ": " << e.what() << std::endl;
+        std::cerr << "  in '" << ref_name << "'" << std::endl;
+        return RET_FILE_FORMAT_ERROR;
+    }
+    catch(const std::runtime_error & e) {
+        std::cerr << a << ": " << e.what() << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
+
+    // frames are read while the output is written: it cannot be the input
+    if (same_file(in_name, out_name)) {
+        std::cerr << a << ": cannot convert '" << in_name;
+        std::cerr << "' in place" << std::endl;
+        return RET_COMMAND_ERROR;
+    }
+    std::ifstream inf{ in_name, std::ios::binary };
+    if (!inf.good()) {
+        std::cerr << a << ": cannot open '" << in_name;
+        std::cerr << "': " << strerror(errno) << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
+    std::ofstream of{ out_name, std::ios::binary };
+    if (!of.good()) {
+        std::cerr << a << ": cannot open '" << out_name;
+        std::cerr << "': " << strerror(errno) << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
+
+    long nf; // frames converted
+    try {
+        nf = process_xtc(of, inf, wl, m);
+    }
+    catch(const xtc_error & e) {
+        std::cerr << a << ": " << e.what() << std::endl;
+        std::cerr << "  in '" << in_name << "'" << std::endl;
+        return RET_FILE_FORMAT_ERROR;
+    }
+    catch(const std::runtime_error & e) {
+        std::cerr << a << ": " << e.what() << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
+
+    std::clog << "Processed " << wl.first.size() << " water molecules in ";
+    std::clog << nf << " frames.\n";
+
+    of.close();
+    if (!of) {
+        std::cerr << a << ": error writing results" << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
+    return RET_OK;
+}
+
+//! An output file of a conversion, or stdout
+struct output_file {
+    std::ofstream of;
+    std::unique_ptr<uring_ostream> uout{}; // writing through io_uring
+    std::unique_ptr<compress_ostream> zout{}; // compressing the output
+    std::unique_ptr<mapped_output> mout{}; // output written in place
+    std::ostream *out{ &std::cout }; // the stream (unless mout is used)
+};
+
+//! Open an output file
+/**
+ * .gz and .zst files are compressed on a thread of their own, other
+ * regular files are mapped and written in place by all threads (or with
+ * --uring written through io_uring).
+ *
+ * \param a  name of the current executable
+ * \param name  the file (nullptr: stdout)
+ * \param mappable  false if the output must be written as a stream
+ * \param uring  write regular files through io_uring
+ * \param stats  statistics of the run (or nullptr)
+ * \param[out] o  the output
+ * \return exit code of the program (RET_OK if the file is open)
+*/
+int open_output(const std::string &a, const char *name, bool mappable,
+                bool uring, run_stats *stats, output_file &o) {
+    if (!name) { return RET_OK; }
+    codec_t c{ codec_of_name(name) };
+    bool regular{ mapped_output::possible(name) };
+    if (regular && mappable && !uring && c == CODEC_NONE) {
+        try {
+            o.mout.reset(new mapped_output(name));
+        }
+        catch (const std::runtime_error & e) {
+            std::cerr << a << ": " << e.what() << std::endl;
+            return RET_FILE_IO_ERROR;
+        }
+        return RET_OK;
+    }
+    if (!codec_supported(c)) {
+        std::cerr << a << ": cannot write '" << name;
+        std::cerr << "': " << codec_name(c) << " compression is not ";
+        std::cerr << "supported by this build" << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
+    if (regular && uring) {
+        try {
+            o.uout.reset(new uring_ostream(name));
+        }
+        catch (const std::runtime_error & e) {
+            std::cerr << a << ": " << e.what() << std::endl;
+            return RET_FILE_IO_ERROR;
+        }
+        o.out = o.uout.get();
+    } else {
+        o.of.open(name, std::ios::binary);
+        if (!o.of.good()) {
+            std::cerr << a << ": cannot open '" << name;
+            std::cerr << "': " << strerror(errno) << std::endl;
+            return RET_FILE_IO_ERROR;
+        }
+        o.out = &o.of;
+    }
+    if (c != CODEC_NONE) {
+        o.zout.reset(new compress_ostream(*o.out, c, name, stats));
+        o.out = o.zout.get();
+    }
+    return RET_OK;
+}
+
+//! Close an output file and check it for errors
+/**
+ * \param a  name of the current executable
+ * \param o  the output
+ * \return exit code of the program
+*/
+int close_output(const std::string &a, output_file &o) {
+    o.out->flush(); // error state only correct after flush (also by endl)
+    if (o.zout || o.mout || o.uout) {
+        try {
+            if (o.zout) { o.zout->finish(); }
+            if (o.mout) { o.mout->close(); }
+            if (o.uout) { o.uout->finish(); }
+        }
+        catch(const std::runtime_error & e) {
+            std::cerr << a << ": " << e.what() << std::endl;
+            return RET_FILE_IO_ERROR;
+        }
+    }
+    if (o.of.is_open()) { o.of.close(); }
+    // close flushes, but explicit flush still needed for stdout
+    if (!*o.out || (o.zout && !o.of)) {
+        std::cerr << a << ": error writing results" << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
+    return RET_OK;
+}
+
+//! Finish the statistics of the run and write them
+/**
+ * \param a  name of the current executable
+ * \param stats  statistics of the run
+ * \param stats_name  JSON file to write ("": table on stderr)
+ * \return exit code of the program
+*/
+int report_stats(const std::string &a, run_stats &stats,
+                 const std::string &stats_name) {
+    stats.finish();
+    if (stats_name.empty()) {
+        stats.write(std::cerr);
+    } else {
+        std::ofstream sf{ stats_name };
+        stats.write_json(sf);
+        sf.close();
+        if (!sf) {
+            std::cerr << a << ": cannot write '" << stats_name;
+            std::cerr << "'" << std::endl;
+            return RET_FILE_IO_ERROR;
+        }
+    }
+    return RET_OK;
+}
+
+//! Write the geometry report of a run
+/**
+ * \param a  name of the current executable
+ * \param report  the report
+ * \param name  JSON file to write ("": text on stderr)
+ * \return exit code of the program
+*/
+int write_report(const std::string &a, const geometry_report &report,
+                 const std::string &name) {
+    if (name.empty()) {
+        report.write(std::cerr);
+        return RET_OK;
+    }
+    std::ofstream rf{ name };
+    report.write_json(rf);
+    rf.close();
+    if (!rf) {
+        std::cerr << a << ": cannot write '" << name << "'" << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
+    return RET_OK;
+}
+
+//! Convert many gro files
+/**
+ * \param a  name of the current executable
+ * \param names  files, directories, or - (manifest on stdin)
+ * \param pattern  output file names (see batch_output_name())
+ * \param m  water model to be used in the output
+ * \param threads  number of files converted at a time
+ * \param stats  statistics of the run (or nullptr)
+ * \param stats_name  JSON file for the statistics ("": stderr)
+ * \param uring  file I/O through io_uring
+ * \return exit code of the program: that of the worst failure
+*/
+int convert_batch(const std::string &a, const std::vector<std::string> &names,
+                  const std::string &pattern, const model &m, int threads,
+                  run_stats *stats, const std::string &stats_name,
+                  bool uring) {
+    std::vector<batch_item> items;
+    std::vector<std::string> files;
+    try {
+        for (const auto &name: names) {
+            if (name == "-") {
+                batch_add_files(files, pattern, items);
+                files.clear();
+                batch_add_manifest(std::cin, pattern, items);
+            } else {
+                files.push_back(name);
+            }
+        }
+        batch_add_files(files, pattern, items);
+    }
+    catch (const std::runtime_error & e) {
+        std::cerr << a << ": " << e.what() << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
+    if (!pattern.empty() && items.size() > 1
+        && pattern.find("{}") == std::string::npos) {
+        std::cerr << a << ": output pattern '" << pattern;
+        std::cerr << "' needs {} for more than one file" << std::endl;
+        return RET_COMMAND_ERROR;
+    }
+
+    batch_result r{ run_batch(items, m, threads, std::cout, std::cerr, a,
+                              stats, uring) };
+    size_t failed{ r.format_errors + r.other_errors };
+    std::clog << "Processed " << r.waters << " water molecules in ";
+    std::clog << r.files << " files";
+    if (failed > 0) { std::clog << " (" << failed << " failed)"; }
+    std::clog << ".\n";
+
+    std::cout.flush();
+    if (!std::cout) {
+        std::cerr << a << ": error writing results" << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
+    int ret{ r.format_errors > 0 ? RET_FILE_FORMAT_ERROR
+             : r.other_errors > 0 ? RET_FILE_IO_ERROR : RET_OK };
+    if (stats) {
+        int sr{ report_stats(a, *stats, stats_name) };
+        if (ret == RET_OK) { ret = sr; }
+    }
+    return ret;
+}
+
 int main(int argc, char **argv) {
 
     // give help if requested
     
     if (argc == 1) { print_help(argv[0]); return RET_OK; }
-    std::string arg{ argv[1] };
-    if (arg == "-h" || arg == "--help") { print_help(argv[0]); return RET_OK; }
-    
-    // select water model
+
+    // parse options: select water model, input mode
     
     int n{ 1 }; // index of current command line argument
-    model m; // selected model
-    if (arg == "-m") {
-        if (argc < 4) { print_help(argv[0]); return RET_COMMAND_ERROR; }
-        std::string nm{ argv[2] };
-        if (!m.initialise(nm)) {
+    std::vector<std::string> model_names; // selected models (-m)
+    bool stream{ false }; // read input through a bounded window
+    int threads{ 1 }; // number of threads (not used when streaming)
+    std::string ref_name; // reference structure for xtc input
+    bool want_stats{ false }; // measure the phases of the run
+    std::string stats_name; // JSON file for the statistics ("": stderr)
+    bool batch{ false }; // convert the files listed in the arguments
+    std::string pattern; // output file names in batch mode ("": stdout)
+    bool uring{ false }; // file I/O through io_uring
+    bool use_cache{ false }; // read or write the binary cache of the input
+    bool export_gro{ false }; // write a cache input back as a gro file
+    bool large{ false }; // large-system mode (bounded working set)
+    bool reorder{ false }; // sort the waters along a space-filling curve
+    space_curve curve{ space_curve::hilbert }; // the curve
+    std::string map_name; // file for the permutation of the waters
+    bool want_report{ false }; // report the geometry of the waters
+    std::string index_name; // index file selecting the waters to convert
+    std::string group_name; // the group of the index file
+    std::string report_name; // JSON file for the report ("": stderr)
+    while (n < argc && argv[n][0] == '-' && argv[n][1] != '\0') {
+        std::string arg{ argv[n] };
+        if (arg == "-h" || arg == "--help") {
+            print_help(argv[0]);
+            return RET_OK;
+        } else if (arg == "-m") {
+            if (n + 1 >= argc) { print_help(argv[0]); return RET_COMMAND_ERROR; }
+            model_names.push_back(argv[n+1]);
+            n += 2;
+        } else if (arg == "-p") {
+            if (n + 1 >= argc) { print_help(argv[0]); return RET_COMMAND_ERROR; }
+            std::ifstream pf{ argv[n+1] };
+            if (!pf.good()) {
+                std::cerr << argv[0] << ": cannot open '" << argv[n+1];
+                std::cerr << "': " << strerror(errno) << std::endl;
+                return RET_FILE_IO_ERROR;
+            }
+            try {
+                model::load(pf, argv[n+1]);
+            }
+            catch (const model_error & e) {
+                std::cerr << argv[0] << ": " << e.what() << std::endl;
+                return RET_FILE_FORMAT_ERROR;
+            }
+            n += 2;
+        } else if (arg == "-j") {
+            if (n + 1 >= argc) { print_help(argv[0]); return RET_COMMAND_ERROR; }
+            try {
+                threads = thread_count(std::stoi(argv[n+1]));
+            }
+            catch (const std::logic_error & e) {
+                print_help(argv[0]);
+                return RET_COMMAND_ERROR;
+            }
+            n += 2;
+        } else if (arg == "-n") {
+            if (n + 1 >= argc) { print_help(argv[0]); return RET_COMMAND_ERROR; }
+            index_name = argv[n+1];
+            n += 2;
+        } else if (arg == "-g") {
+            if (n + 1 >= argc) { print_help(argv[0]); return RET_COMMAND_ERROR; }
+            group_name = argv[n+1];
+            n += 2;
+        } else if (arg == "-r") {
+            if (n + 1 >= argc) { print_help(argv[0]); return RET_COMMAND_ERROR; }
+            ref_name = argv[n+1];
+            n += 2;
+        } else if (arg == "--stats" || arg.compare(0, 8, "--stats=") == 0) {
+            want_stats = true;
+            if (arg.size() > 8) { stats_name = arg.substr(8); }
+            ++n;
+        } else if (arg == "--report"
+                   || arg.compare(0, 9, "--report=") == 0) {
+            want_report = true;
+            if (arg.size() > 9) { report_name = arg.substr(9); }
+            ++n;
+        } else if (arg == "-b" || arg == "--batch") {
+            batch = true;
+            ++n;
+        } else if (arg == "-o") {
+            if (n + 1 >= argc) { print_help(argv[0]); return RET_COMMAND_ERROR; }
+            pattern = argv[n+1];
+            n += 2;
+        } else if (arg == "-s" || arg == "--stream") {
+            stream = true;
+            ++n;
+        } else if (arg == "--uring") {
+            uring = true;
+            ++n;
+        } else if (arg == "--large") {
+            large = true;
+            ++n;
+        } else if (arg == "--reorder" || arg == "--reorder=hilbert") {
+            reorder = true;
+            curve = space_curve::hilbert;
+            ++n;
+        } else if (arg == "--reorder=morton") {
+            reorder = true;
+            curve = space_curve::morton;
+            ++n;
+        } else if (arg.compare(0, 14, "--reorder-map=") == 0
+                   && arg.size() > 14) {
+            map_name = arg.substr(14);
+            ++n;
+        } else if (arg == "--cache") {
+            use_cache = true;
+            ++n;
+        } else if (arg == "--export") {
+            export_gro = true;
+            ++n;
+        } else {
             print_help(argv[0]);
             return RET_COMMAND_ERROR;
         }
-        n = 3;
-    } else {
-        m.initialise(0); // default model is the first
     }
+    if (model_names.empty()) { // default is the first
+        model_names.push_back(model::catalog()[0]);
+    }
+    std::vector<model> models(model_names.size());
+    for (size_t i = 0; i < models.size(); ++i) {
+        if (!models[i].initialise(model_names[i])) { n = argc; }
+    }
+    if (n >= argc) {
+        print_help(argv[0]);
+        return RET_COMMAND_ERROR;
+    }
+    const model &m{ models[0] };
 
-    // open input file
-    
-    std::vector<std::string> lines{};
-    long rd; // lines read
-    try {
-        rd = readall(argv[n],lines);
+    // several models: one input, converted once to all of them, and an
+    // output file for each
+    bool fan_out{ models.size() > 1 };
+    if (fan_out && (batch || stream || export_gro || !ref_name.empty()
+                    || argc - n - 1 != static_cast<int>(models.size()))) {
+        print_help(argv[0]);
+        return RET_COMMAND_ERROR;
     }
-    catch (const std::runtime_error & e) {
-        std::cerr << argv[0] << ": " << e.what() << std::endl;
-        return RET_FILE_IO_ERROR;
+
+    std::unique_ptr<run_stats> stats{};
+    if (want_stats) { stats.reset(new run_stats(true)); }
+    std::unique_ptr<geometry_report> report{};
+    if (want_report) { report.reset(new geometry_report(model_names)); }
+    uring = uring && io_ring::available(); // otherwise plain reads and writes
+    if ((!batch && !pattern.empty()) || (!map_name.empty() && !reorder)
+        || (reorder && (batch || stream || use_cache || export_gro
+                        || !ref_name.empty()))
+        || (want_report && (batch || stream || use_cache || export_gro
+                            || !ref_name.empty()))
+        || (index_name.empty() != group_name.empty())
+        || (!index_name.empty() && (batch || stream || use_cache
+                                    || export_gro))) {
+        print_help(argv[0]);
+        return RET_COMMAND_ERROR;
+    }
+
+    // the waters to convert, from a group of an index file
+
+    std::unique_ptr<atom_selection> selection{};
+    if (!index_name.empty()) {
+        std::ifstream nf{ index_name };
+        if (!nf.good()) {
+            std::cerr << argv[0] << ": cannot open '" << index_name;
+            std::cerr << "': " << strerror(errno) << std::endl;
+            return RET_FILE_IO_ERROR;
+        }
+        try {
+            selection.reset(new atom_selection(read_index_group(
+                nf, group_name, index_name)));
+        }
+        catch (const index_error & e) {
+            std::cerr << argv[0] << ": " << e.what() << std::endl;
+            return RET_FILE_FORMAT_ERROR;
+        }
+    }
+
+    if (batch) {
+        if (stream || !ref_name.empty() || use_cache || export_gro) {
+            print_help(argv[0]);
+            return RET_COMMAND_ERROR;
+        }
+        return convert_batch(argv[0], std::vector<std::string>(argv + n,
+                             argv + argc), pattern, m, threads, stats.get(),
+                             stats_name, uring);
+    }
+
+    std::string in_name{ argv[n] };
+    bool xtc{ in_name.size() > 4
+              && in_name.compare(in_name.size() - 4, 4, ".xtc") == 0 };
+    if (xtc != !ref_name.empty() || (xtc && n + 1 >= argc)) {
+        print_help(argv[0]);
+        return RET_COMMAND_ERROR;
+    }
+    if (xtc) {
+        return convert_xtc(argv[0], ref_name, in_name, argv[n+1], m,
+                           selection.get());
+    }
+
+    // a binary cache replaces the text: given as the input, or with --cache
+    // found next to it and made from the input as it is now
+
+    if (in_name == "-") { stream = true; }
+    bool cache_input{ in_name.size() > 7
+        && in_name.compare(in_name.size() - 7, 7, ".wcache") == 0 };
+    if ((export_gro && !cache_input)
+        || (stream && (use_cache || cache_input))
+        || ((reorder || want_report || selection)
+            && (stream || cache_input))) {
+        print_help(argv[0]);
+        return RET_COMMAND_ERROR;
+    }
+    std::unique_ptr<gro_cache> cache{};
+    if (cache_input || use_cache) {
+        phase_timer t{ stats.get(), "read" };
+        try {
+            cache.reset(new gro_cache(cache_input ? in_name
+                                      : gro_cache::name_for(in_name)));
+            if (!cache_input && !cache->matches(in_name)) { cache.reset(); }
+        }
+        catch (const std::runtime_error & e) {
+            if (cache_input) {
+                std::cerr << argv[0] << ": " << e.what() << std::endl;
+                return RET_FILE_IO_ERROR;
+            }
+            // no usable cache: it is written after the conversion
+        }
+        if (cache) { t.count(0, cache->atoms()); }
+    }
+
+    // an output may be the input itself (converted in place). Opening it
+    // truncates the file, so the input is then read into memory instead of
+    // mapped; streamed or cached input cannot be converted in place
+
+    bool in_place{ !map_name.empty() && same_file(map_name, in_name) };
+    int last_out{ std::min(argc, n + 1 + static_cast<int>(models.size())) };
+    for (int i = n + 1; i < last_out; ++i) {
+        std::string o{ argv[i] };
+        for (int k = n + 1; k < i; ++k) {
+            if (o == argv[k] || same_file(o, argv[k])) {
+                std::cerr << argv[0] << ": '" << o << "' is given twice ";
+                std::cerr << "as output" << std::endl;
+                return RET_COMMAND_ERROR;
+            }
+        }
+        bool is_input{ same_file(o, in_name) };
+        if (is_input && (stream || use_cache || cache_input)) {
+            std::cerr << argv[0] << ": cannot convert '" << in_name;
+            std::cerr << "' in place with -s or a cache" << std::endl;
+            return RET_COMMAND_ERROR;
+        }
+        if (use_cache && same_file(o, gro_cache::name_for(in_name))) {
+            std::cerr << argv[0] << ": cannot write the cache '" << o;
+            std::cerr << "' as output" << std::endl;
+            return RET_COMMAND_ERROR;
+        }
+        in_place = in_place || is_input;
     }
+
+    // open input file ('-' is stdin, always streamed)
     
-    //basic format check
+    std::unique_ptr<text_file> lines{};
+    std::ifstream inf;
+    std::unique_ptr<decompress_istream> zin{}; // decompressing the input
+    std::istream *in{ &std::cin };
+    if (stream) {
+        if (in_name != "-") {
+            inf.open(in_name, std::ios::binary);
+            if (!inf.good()) {
+                std::cerr << argv[0] << ": cannot open '" << in_name;
+                std::cerr << "': " << strerror(errno) << std::endl;
+                return RET_FILE_IO_ERROR;
+            }
+            in = &inf;
+        }
+        try {
+            codec_t c{ codec_of_stream(*in) };
+            if (c != CODEC_NONE) {
+                zin.reset(new decompress_istream(*in, c, in_name,
+                                                 stats.get()));
+                in = zin.get();
+            }
+            if (in->peek() == std::char_traits<char>::eof()) {
+                std::cerr << argv[0] << ": cannot process input: '";
+                std::cerr << in_name << "' is empty" << std::endl;
+                return RET_FILE_FORMAT_ERROR;
+            }
+        }
+        catch (const std::runtime_error & e) {
+            std::cerr << argv[0] << ": " << e.what() << std::endl;
+            return RET_FILE_IO_ERROR;
+        }
+    } else if (!cache) {
+        long rd; // lines read
+        try {
+            phase_timer t{ stats.get(), "read" };
+            lines.reset(new text_file(in_name, uring, in_place));
+            rd = static_cast<long>(lines->size());
+            t.count(lines->bytes(), lines->size());
+        }
+        catch (const std::runtime_error & e) {
+            std::cerr << argv[0] << ": " << e.what() << std::endl;
+            return RET_FILE_IO_ERROR;
+        }
     
-    if (rd < 1) {
-        std::cerr << argv[0] << ": cannot process input: '";
-        std::cerr << argv[n] << "' is empty" << std::endl;
-        return RET_FILE_FORMAT_ERROR;
+        //basic format check
+    
+        if (rd < 1) {
+            std::cerr << argv[0] << ": cannot process input: '";
+            std::cerr << in_name << "' is empty" << std::endl;
+            return RET_FILE_FORMAT_ERROR;
+        }
     }
     
-    // open output file or use stdout if none given
+    // the order of the waters, from the first frame (before any output
+    // file is created)
+
+    std::vector<size_t> order;
+    if (reorder) {
+        try {
+            phase_timer t{ stats.get(), "order" };
+            water_layout wl{ find_waters(*lines, 0, selection.get()) };
+            order = water_order(*lines, wl, curve, threads);
+            t.count(0, wl.natoms, order.size());
+            if (!map_name.empty()) {
+                std::ofstream mf{ map_name };
+                std::vector<int> sizes;
+                for (const auto &mi: models) { sizes.push_back(mi.size()); }
+                write_water_order(mf, wl, order, sizes);
+                mf.close();
+                if (!mf) {
+                    std::cerr << argv[0] << ": error writing '" << map_name;
+                    std::cerr << "'" << std::endl;
+                    return RET_FILE_IO_ERROR;
+                }
+            }
+        }
+        catch (const gro_error & e) {
+            std::cerr << argv[0] << ": " << e.what() << std::endl;
+            std::cerr << "  in '" << in_name << "'" << std::endl;
+            return RET_FILE_FORMAT_ERROR;
+        }
+    }
+
+    // open output files or use stdout if none given
     
     ++n;
-    std::ofstream of;
-    std::ostream *out{ &std::cout };
-    if (n < argc) {
-        of.open(argv[n]);
-        if (!of.good()) {
-            std::cerr << argv[0] << ": cannot open '" << argv[n];
-            std::cerr << "': " << strerror(errno) << std::endl;
-            return RET_FILE_IO_ERROR;
-        }
-        out = &of;
+    std::vector<output_file> outs(models.size());
+    for (size_t i = 0; i < outs.size(); ++i) {
+        int r{ open_output(argv[0], n + static_cast<int>(i) < argc
+                           ? argv[n + i] : nullptr, !stream && !export_gro,
+                           uring, stats.get(), outs[i]) };
+        if (r != RET_OK) { return r; }
     }
+    std::ostream *out{ outs[0].out };
     
     // produce output
     
-    int wf; // water mols. found & modified
+    size_t wf{ 0 }; // water mols. found & modified
     try {
-        wf = process_gro(*out,lines,m);
+        if (stream) {
+            wf = process_gro(*out,*in,m,stats.get());
+        } else if (cache && export_gro) {
+            export_cache(*out,*cache);
+            wf = 0;
+        } else if (cache) {
+            for (size_t i = 0; i < outs.size(); ++i) {
+                output_file &o{ outs[i] };
+                const model &mi{ models[i] };
+                run_stats *st{ stats.get() };
+                wf = o.mout ? convert_cache(*o.mout,*cache,mi,threads,st)
+                            : convert_cache(*o.out,*cache,mi,threads,st);
+            }
+        } else {
+            std::vector<gro_output> go;
+            for (size_t i = 0; i < outs.size(); ++i) {
+                go.push_back(gro_output{ &models[i], outs[i].out,
+                                         outs[i].mout.get() });
+            }
+            wf = process_gro(go,*lines,threads,stats.get(),large,
+                             reorder ? &order : nullptr,report.get(),
+                             selection.get());
+        }
     }
     catch(const gro_error & e) {
         std::cerr << argv[0] << ": " << e.what() << std::endl;
-        std::cerr << "  in '" << argv[n-1] << "'" << std::endl;
+        std::cerr << "  in '" << in_name << "'" << std::endl;
         return RET_FILE_FORMAT_ERROR;
     }
+    catch(const std::runtime_error & e) {
+        std::cerr << argv[0] << ": " << e.what() << std::endl;
+        return RET_FILE_IO_ERROR;
+    }
     
-    std::clog << "Processed " << wf << " water molecules.\n";
+    std::clog << "Processed " << wf << " water molecules";
+    if (fan_out) { std::clog << " for " << models.size() << " models"; }
+    std::clog << ".\n";
     
     // close & check output for errors
     
-    out->flush();  // error state only correct after flush (also done by endl)
-    if (of.is_open()) { of.close(); }
-    // close flushes, but explicit flush still needed for stdout
-    if (!*out) {
-        std::cerr << argv[0] << ": error writing results" << std::endl;
-        return RET_FILE_IO_ERROR;
+    for (auto &o: outs) {
+        int r{ close_output(argv[0], o) };
+        if (r != RET_OK) { return r; }
+    }
+
+    // cache the parsed input for the next run (failing to is not an error)
+
+    if (use_cache && !cache) {
+        try {
+            phase_timer t{ stats.get(), "cache" };
+            if (!gro_cache::write(gro_cache::name_for(in_name), *lines,
+                                  in_name)) {
+                std::clog << "Not cached: '" << in_name << "' is not a ";
+                std::clog << "single frame in the standard format.\n";
+            }
+        }
+        catch (const std::runtime_error & e) {
+            std::cerr << argv[0] << ": warning: " << e.what() << std::endl;
+        }
+    }
+
+    // report the geometry of the waters and statistics
+
+    if (report) {
+        int r{ write_report(argv[0], *report, report_name) };
+        if (r != RET_OK) { return r; }
     }
+    if (stats) { return report_stats(argv[0], *stats, stats_name); }
     
     return RET_OK;
 
@@ -0,0 +1,76 @@
+#include "mapped_output.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+mapped_output::mapped_output(const std::string &name) : file{ name } {
+    fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        std::string msg{ "cannot open '" + name + "': " };
+        msg += strerror(errno);
+        throw(std::runtime_error(msg));
+    }
+}
+
+mapped_output::~mapped_output() {
+    try {
+        close();
+    }
+    catch (...) {}
+}
+
+char *mapped_output::resize(size_t n) {
+    used = n;
+    if (used <= mapped) { return base; }
+
+    // grow geometrically, in whole pages
+    size_t page{ static_cast<size_t>(sysconf(_SC_PAGESIZE)) };
+    size_t m{ std::max(used, std::max(2 * mapped, size_t{ 1 } << 20)) };
+    m = (m + page - 1) / page * page;
+    int r{ posix_fallocate(fd, static_cast<off_t>(mapped),
+                           static_cast<off_t>(m - mapped)) };
+    if (r != 0) {
+        std::string msg{ "cannot write '" + file + "': " };
+        msg += strerror(r);
+        throw(std::runtime_error(msg));
+    }
+    if (base) { munmap(base, mapped); }
+    base = nullptr;
+    mapped = 0;
+    void *p{ mmap(nullptr, m, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) };
+    if (p == MAP_FAILED) {
+        std::string msg{ "cannot map '" + file + "': " };
+        msg += strerror(errno);
+        throw(std::runtime_error(msg));
+    }
+    base = static_cast<char *>(p);
+    mapped = m;
+    return base;
+}
+
+void mapped_output::close() {
+    if (fd < 0) { return; }
+    int err{ 0 }; // first error
+    if (base && munmap(base, mapped) != 0) { err = errno; }
+    base = nullptr;
+    mapped = 0;
+    if (ftruncate(fd, static_cast<off_t>(used)) != 0 && !err) { err = errno; }
+    if (::close(fd) != 0 && !err) { err = errno; }
+    fd = -1;
+    if (err) {
+        std::string msg{ "error writing '" + file + "': " };
+        msg += strerror(err);
+        throw(std::runtime_error(msg));
+    }
+}
+
+bool mapped_output::possible(const std::string &name) {
+    struct stat st;
+    if (stat(name.c_str(), &st) != 0) { return errno == ENOENT; }
+    return S_ISREG(st.st_mode);
+}
@@ -0,0 +1,52 @@
+#ifndef MAPPED_OUTPUT_H
+#define MAPPED_OUTPUT_H
+#include <cstddef>
+#include <string>
+
+//! Output file written in place through a shared memory mapping
+/**
+ * Whoever knows where a piece of output ends up in the file can write it
+ * there directly, so several threads can fill the file at the same time.
+ * The file is extended with disk space allocated up front (a full disk is
+ * an error from resize(), not a crash on a later write) and cut to its
+ * final size by close(). Only regular files can be mapped, see possible().
+ */
+class mapped_output {
+public:
+    //! Create a file, or truncate an existing one
+    /** \throw runtime_error if the file cannot be opened */
+    explicit mapped_output(const std::string &name);
+    ~mapped_output(); //!< close(), errors ignored
+
+    mapped_output(const mapped_output &) = delete;
+    mapped_output &operator=(const mapped_output &) = delete;
+
+    //! Make the file n bytes long
+    /**
+     * Bytes already written are kept (up to n). The mapping may move:
+     * pointers into it are only valid until the next call.
+     *
+     * \return the start of the file
+     * \throw runtime_error if the file cannot be extended or mapped
+     */
+    char *resize(size_t n);
+
+    size_t size() const { return used; } //!< size of the file
+
+    //! Unmap the file, cut it to size() bytes and close it
+    /** \throw runtime_error on a write error (only the first call) */
+    void close();
+
+    //! true if the file name can be written through a mapping: a regular
+    //! file or one that does not exist yet (not a device or pipe)
+    static bool possible(const std::string &name);
+
+private:
+    std::string file;
+    int fd;
+    char *base{ nullptr }; //!< the mapping (or nullptr)
+    size_t mapped{ 0 };    //!< bytes mapped and allocated in the file
+    size_t used{ 0 };      //!< size of the file
+};
+
+#endif
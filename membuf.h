@@ -0,0 +1,76 @@
+#ifndef MEMBUF_H
+#define MEMBUF_H
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <streambuf>
+#include <string>
+
+/** \defgroup membuf Output to memory
+ * Stream buffers for writing a converted file into memory through a
+ * std::ostream, without the copies made by std::ostringstream.
+ * @{
+ */
+
+//! Stream buffer appending to a string
+/**
+ * The string keeps its capacity when it is cleared, so a buffer used for
+ * one file after another stops allocating once it is large enough.
+ */
+class string_buffer: public std::streambuf {
+public:
+    //! \param s string to append to (must outlive the buffer)
+    explicit string_buffer(std::string &s) : str(s) {}
+protected:
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            str.push_back(traits_type::to_char_type(c));
+        }
+        return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char *p, std::streamsize n) override {
+        str.append(p, static_cast<size_t>(n));
+        return n;
+    }
+private:
+    std::string &str;
+};
+
+//! Stream buffer writing into an array of fixed size
+/**
+ * Writing never fails: what does not fit is counted but dropped, so that
+ * the size needed is known afterwards (see needed()).
+ */
+class array_buffer: public std::streambuf {
+public:
+    //! Write to an array
+    /**
+     * \param p array to write to (must outlive the buffer)
+     * \param n size of the array in bytes
+     */
+    array_buffer(char *p, size_t n) : arr(p), cap(n), len{ 0 } {}
+    size_t needed() const { return len; } //!< bytes written (or dropped)
+    bool overflowed() const { return len > cap; } //!< some bytes dropped
+protected:
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            char ch{ traits_type::to_char_type(c) };
+            xsputn(&ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+    std::streamsize xsputn(const char *p, std::streamsize n) override {
+        size_t k{ static_cast<size_t>(n) };
+        if (len < cap) { std::memcpy(arr + len, p, std::min(k, cap - len)); }
+        len += k;
+        return n;
+    }
+private:
+    char *arr;
+    size_t cap;
+    size_t len;
+};
+
+/**@}*/
+
+#endif
@@ -1,5 +1,9 @@
 #include "model.h"
+#include "model_kernel.h"
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
 #include <stdexcept>
 // for debug: #include <iostream>
 
@@ -10,36 +14,195 @@ constexpr model_param const model::models[];
 const double degree = 0.017453292519943295769139;
 
 
+namespace {
+
+// the built-in parameters as a model definition
+model_definition definition_of(const model_param &p) {
+    model_definition d;
+    d.name = p.name;
+    d.rOH = p.rOH;
+    d.angle = p.angle;
+    // M site is along the bisector of H-O-H, ie. 'a' vector
+    if (std::fabs(p.rOM) > 1.0e-4) {
+        d.sites.push_back(virtual_site{ "MW", p.rOM, 0.0, 0.0 });
+    }
+    // lone pairs: along a -cos(lpangle/2)*rOL, along c +/- sin(lpangle/2)*rOL
+    if (std::fabs(p.rOL) > 1.0e-4) {
+        double cosl{ std::cos(p.lpangle*degree/2.0)*p.rOL };
+        double sinl{ std::sin(p.lpangle*degree/2.0)*p.rOL };
+        d.sites.push_back(virtual_site{ "LP1", -cosl, 0.0, sinl });
+        d.sites.push_back(virtual_site{ "LP2", -cosl, 0.0, -sinl });
+    }
+    return d;
+}
+
+// a usable atom name: 1 to 5 printable characters without blanks
+bool good_site_name(const std::string &s) {
+    if (s.empty() || s.size() > 5) { return false; }
+    for (char c: s) {
+        if (c <= ' ' || c > '~') { return false; }
+    }
+    return true;
+}
+
+// reason why a definition cannot be used, or nullptr if it can
+const char *bad_definition(const model_definition &d) {
+    if (!(d.rOH > 0.0)) { return "rOH must be positive"; }
+    if (!(d.angle > 0.0 && d.angle < 180.0)) {
+        return "angle must be between 0 and 180 degrees";
+    }
+    if (d.sites.size() > static_cast<size_t>(max_extra_sites)) {
+        return "too many sites";
+    }
+    for (const auto &s: d.sites) {
+        if (!good_site_name(s.name)) { return "bad site name"; }
+        if (!std::isfinite(s.along_a) || !std::isfinite(s.along_b)
+            || !std::isfinite(s.along_c)) {
+            return "bad site coefficients";
+        }
+    }
+    return nullptr;
+}
+
+bool known(const std::string &name) {
+    for (const auto &m: model::catalog()) {
+        if (m == name) { return true; }
+    }
+    return false;
+}
+
+} // namespace
+
+std::vector<model_definition> &model::loaded() {
+    static std::vector<model_definition> m;
+    return m;
+}
+
 std::vector<std::string> model::catalog() {
     std::vector<std::string> m;
     m.clear();
     for (int i = 0; i < n_models; ++i) {
         m.push_back(models[i].name);
     }
+    for (const auto &d: loaded()) {
+        m.push_back(d.name);
+    }
     return m;
 }
 
+bool model::builtin(const std::string &name) {
+    for (int i = 0; i < n_models; ++i) {
+        if (name == models[i].name) { return true; }
+    }
+    return false;
+}
+
+int model::load(std::istream &is, const std::string &source) {
+    std::vector<model_definition> added;
+    std::vector<size_t> start; // line of each "model" keyword
+    std::vector<bool> have; // rOH and angle given for the current model
+    std::string l;
+    size_t n{ 0 }; // line number
+    while (std::getline(is, l)) {
+        ++n;
+        size_t hash{ l.find('#') };
+        if (hash != std::string::npos) { l.erase(hash); }
+        std::istringstream ls{ l };
+        std::string key;
+        if (!(ls >> key)) { continue; } // empty line
+        if (key == "model") {
+            model_definition d{};
+            if (!(ls >> d.name)) {
+                throw(model_error("model name expected", source, n));
+            }
+            if (known(d.name)) {
+                throw(model_error("model '" + d.name + "' already exists",
+                                  source, n));
+            }
+            for (const auto &a: added) {
+                if (a.name == d.name) {
+                    throw(model_error("model '" + d.name + "' defined twice",
+                                      source, n));
+                }
+            }
+            added.push_back(d);
+            start.push_back(n);
+            have.push_back(false);
+            have.push_back(false);
+        } else if (added.empty()) {
+            throw(model_error("'model NAME' expected", source, n));
+        } else if (key == "rOH") {
+            if (!(ls >> added.back().rOH)) {
+                throw(model_error("number expected after rOH", source, n));
+            }
+            have[have.size() - 2] = true;
+        } else if (key == "angle") {
+            if (!(ls >> added.back().angle)) {
+                throw(model_error("number expected after angle", source, n));
+            }
+            have.back() = true;
+        } else if (key == "site") {
+            virtual_site v;
+            if (!(ls >> v.name >> v.along_a >> v.along_b >> v.along_c)) {
+                throw(model_error("site NAME A B C expected", source, n));
+            }
+            added.back().sites.push_back(v);
+        } else {
+            throw(model_error("unknown keyword '" + key + "'", source, n));
+        }
+        std::string rest;
+        if (ls >> rest) {
+            throw(model_error("unexpected '" + rest + "'", source, n));
+        }
+    }
+    if (is.bad()) {
+        throw(model_error("read error", source, n));
+    }
+    for (size_t i = 0; i < added.size(); ++i) {
+        if (!have[2 * i] || !have[2 * i + 1]) {
+            throw(model_error("model '" + added[i].name
+                              + "' needs rOH and angle", source, start[i]));
+        }
+        const char *why{ bad_definition(added[i]) };
+        if (why) {
+            throw(model_error("model '" + added[i].name + "': " + why,
+                              source, start[i]));
+        }
+    }
+    loaded().insert(loaded().end(), added.begin(), added.end());
+    return static_cast<int>(added.size());
+}
 
 bool model::initialise(int id) {
-    if (id >= n_models || id < 0) {
+    int n_loaded{ static_cast<int>(loaded().size()) };
+    if (id >= n_models + n_loaded || id < 0) {
         is_initialised = false;
-    } else {
-        parameters = models[id];
-        is_initialised = true;
+        return false;
     }
-    return is_initialised;
+    return initialise(id < n_models ? definition_of(models[id])
+                                    : loaded()[id - n_models]);
 }
 
 
 bool model::initialise(const std::string &name) {
     is_initialised = false;
     bool m{ false };
-    for (int i = 0; i < n_models; ++i) {
-        if (name == models[i].name) { m = initialise(i); }
+    std::vector<std::string> c{ catalog() };
+    for (size_t i = 0; i < c.size(); ++i) {
+        if (name == c[i]) { m = initialise(static_cast<int>(i)); }
     }
     return m;
 }
 
+bool model::initialise(const model_definition &d) {
+    is_initialised = false;
+    if (bad_definition(d)) { return false; }
+    parameters = d;
+    choose_kernels();
+    is_initialised = true;
+    return true;
+}
+
 void model::check() const {
     if (!is_initialised) {
         throw(std::logic_error("access to uninitialised model"));
@@ -48,121 +211,228 @@ void model::check() const {
 
 int model::size() const {
     check();
-    int s{ 3 };
-    if (std::fabs(parameters.rOM) > 1.0e-4) { ++s; }
-    if (std::fabs(parameters.rOL) > 1.0e-4) { s += 2; }
-    return s;
+    return 3 + static_cast<int>(parameters.sites.size());
+}
+
+const model_definition &model::definition() const {
+    check();
+    return parameters;
 }
 
-static double vec_length(double x, double y, double z)
-{
-    return std::sqrt(x*x + y*y + z*z);
+const char *model::extra_name(int k) const {
+    check();
+    return parameters.sites[k].name.c_str();
 }
 
 std::vector<double> model::transform(double &xO, double &yO, double &zO,
                                   double &x1, double &y1, double &z1,
                                   double &x2, double &y2, double &z2) const {
     check();
-    // O-H vectors and their lengths (v1, v2)
-    double vx1{ x1 - xO };
-    double vy1{ y1 - yO };
-    double vz1{ z1 - zO };
-    double lv1 { vec_length(vx1,vy1,vz1) };
-    double vx2{ x2 - xO }; 
-    double vy2{ y2 - yO }; 
-    double vz2{ z2 - zO };
-    double lv2{ vec_length(vx2, vy2, vz2) };
-    
-    // if either O-H is too short, bail out (cut-off 0.0001 A)
-    if (lv1 < 1.0e-4 || lv2 < 1.0e-4) {
+    double w[9]{ xO, yO, zO, x1, y1, z1, x2, y2, z2 };
+    double extra[3 * max_extra_sites];
+    if (!transform(w, extra)) {
         throw(std::runtime_error("bad input water structure"));
     }
- 
-    // normalise O-H vectors (v1, v2)
-    vx1 /= lv1; vy1 /= lv1; vz1 /= lv1;
-    vx2 /= lv2; vy2 /= lv2; vz2 /= lv2;
-    
-    // bisector direction: sum of unit vectors along O-H bonds
-    double ax{ vx1 + vx2 };
-    double ay{ vy1 + vy2 };
-    double az{ vz1 + vz2 };
-    double la{ vec_length(ax, ay, az) }; // length of bisector
-    
-    // if OH vectors are collinear this is either 0 or 2
-    if (la < 1.0e-4 || la > 1.9999) {
-        throw(std::runtime_error("bad input water structure"));
+    x1 = w[3]; y1 = w[4]; z1 = w[5];
+    x2 = w[6]; y2 = w[7]; z2 = w[8];
+    return std::vector<double>(extra, extra + 3 * parameters.sites.size());
+}
+
+bool model::transform(double *w, double *extra) const {
+    check();
+    return one(geometry, w, extra);
+}
+
+namespace {
+
+// one double per "vector": plain C++ version of the kernels
+struct v_scalar {
+    typedef double type;
+    static const unsigned width{ 1 };
+    static type load(const double *p) { return *p; }
+    static void store(double *p, type v) { *p = v; }
+    static type set1(double d) { return d; }
+    static type add(type a, type b) { return a + b; }
+    static type sub(type a, type b) { return a - b; }
+    static type mul(type a, type b) { return a * b; }
+    static type div(type a, type b) { return a / b; }
+    static type sqrt(type a) { return std::sqrt(a); }
+    static unsigned bad(type lv1, type lv2, type la) {
+        return (lv1 < 1.0e-4 || lv2 < 1.0e-4 || la < 1.0e-4 || la > 1.9999)
+               ? 1u : 0u;
+    }
+};
+
+// one water: the scalar kernel on arrays of length 1
+template <int E>
+bool transform_one(const model_geometry &g, double *w, double *extra) {
+    kernel_args a;
+    a.xO = w; a.yO = w + 1; a.zO = w + 2;
+    for (int s = 0; s < 2 + E; ++s) {
+        double *p{ s < 2 ? w + 3 + 3 * s : extra + 3 * (s - 2) };
+        a.x[s] = p; a.y[s] = p + 1; a.z[s] = p + 2;
+    }
+    a.bad = nullptr;
+    a.shape[0] = a.shape[1] = a.shape[2] = nullptr;
+    return transform_block<v_scalar, E>(0, 1, a, g) == 0;
+}
+
+// batch kernel for the best available instruction set
+struct isa_choice {
+    const kernel_fn *fns; // per number of extra sites; nullptr: scalar only
+    const char *name; // as reported by model::batch_isa()
+    orient_fn orient; // frames (model::orient()); nullptr: scalar only
+    const place_fn *place; // as fns, for model::place()
+};
+
+isa_choice detect_isa() {
+    static const char *const names[]{ "scalar", "sse2", "avx2", "avx512" };
+    int cap{ 3 }; // highest level allowed by WATCOR_SIMD
+    const char *env{ std::getenv("WATCOR_SIMD") };
+    for (int i = 0; env && i < 4; ++i) {
+        if (std::strcmp(env, names[i]) == 0) { cap = i; }
     }
-    // normalise bisector (this is unit vector a)
-    ax /= la; ay /= la; az /= la;
-    
-    // diff v1-v2 is roughly the H...H direction (perpendicular to a)
-    // (this is now unit vector b)
-    double bx{ vx1 - vx2 };
-    double by{ vy1 - vy2 };
-    double bz{ vz1 - vz2 };
-    double lb{ vec_length(bx, by, bz) };
-    bx /= lb; by /= lb; bz /= lb; // O-Hs not collinear, so length > 0
-    
+    isa_choice c{ nullptr, names[0], nullptr, nullptr };
+#if defined(WATCOR_HAVE_SSE2) || defined(WATCOR_HAVE_AVX2) \
+    || defined(WATCOR_HAVE_AVX512)
+    __builtin_cpu_init();
+#endif
+#ifdef WATCOR_HAVE_SSE2
+    if (cap >= 1 && __builtin_cpu_supports("sse2")) {
+        c = isa_choice{ transform_sse2, names[1], orient_sse2,
+                        place_sse2 };
+    }
+#endif
+#ifdef WATCOR_HAVE_AVX2
+    if (cap >= 2 && __builtin_cpu_supports("avx2")) {
+        c = isa_choice{ transform_avx2, names[2], orient_avx2,
+                        place_avx2 };
+    }
+#endif
+#ifdef WATCOR_HAVE_AVX512
+    if (cap >= 3 && __builtin_cpu_supports("avx512f")) {
+        c = isa_choice{ transform_avx512, names[3], orient_avx512,
+                        place_avx512 };
+    }
+#endif
+    (void)cap;
+    return c;
+}
+
+const isa_choice &isa() {
+    static const isa_choice c{ detect_isa() }; // decided on first use
+    return c;
+}
+
+} // namespace
+
+const char *model::batch_isa() {
+    return isa().name;
+}
+
+void model::choose_kernels() {
     // new O-H vectors: [ a*cos(angle/2) +/- b*sin(angle/2) ] * length
     double cosa{ std::cos(parameters.angle*degree/2.0)*parameters.rOH };
-    double acx{ ax * cosa }; // components along bisector (vec. a)
-    double acy{ ay * cosa };
-    double acz{ az * cosa };
     double sinb{ std::sin(parameters.angle*degree/2.0)*parameters.rOH };
-    double bsx{ bx * sinb }; // components along vector b 
-    double bsy{ by * sinb }; 
-    double bsz{ bz * sinb };
-    
-    // add these components to position of O atom
-    x1 = xO + acx + bsx;
-    x2 = xO + acx - bsx;
-    y1 = yO + acy + bsy;
-    y2 = yO + acy - bsy;
-    z1 = zO + acz + bsz;
-    z2 = zO + acz - bsz;
-    
-    // build up extra sites
-    std::vector<double> sites{};
-    
-    // M site is along the bisector of H-O-H, ie. 'a' vector
-    if (std::fabs(parameters.rOM) > 1.0e-4) {
-        double xm{ xO + ax * parameters.rOM };
-        double ym{ yO + ay * parameters.rOM };
-        double zm{ zO + az * parameters.rOM };
-        sites.push_back(xm);
-        sites.push_back(ym);
-        sites.push_back(zm);
-    }
-
-    // calculate lone pair sites if rOL is not 
-    if (std::fabs(parameters.rOL) > 1.0e-4) {
-        // c vector is perp. to water plane (cross product of a & b)
-        double cx{ ay * bz - az * by };
-        double cy{ az * bx - ax * bz };
-        double cz{ ax * by - ay * bx };
-
-        // components of O-Lp vector
-        // along a: - cos(lpangle/2)*rOL
-        double cosl{ std::cos(parameters.lpangle*degree/2.0)*parameters.rOL };
-        // along c: +/- sin(lpangle/2)*rOL
-        double sinl{ std::sin(parameters.lpangle*degree/2.0)*parameters.rOL };
-        // add xyz components of these vectors to O coordinates -> Lp coords
-        double xl1{ xO + cx * sinl - ax * cosl };
-        double xl2{ xO - cx * sinl - ax * cosl };
-        double yl1{ yO + cy * sinl - ay * cosl };
-        double yl2{ yO - cy * sinl - ay * cosl };
-        double zl1{ zO + cz * sinl - az * cosl };
-        double zl2{ zO - cz * sinl - az * cosl };
-
-        sites.push_back(xl1);
-        sites.push_back(yl1);
-        sites.push_back(zl1);
-        sites.push_back(xl2);
-        sites.push_back(yl2);
-        sites.push_back(zl2);
-
-    }
-
-    return sites;
-    
+    geometry = model_geometry{};
+    geometry.site[0] = site_coefficients{ cosa, sinb, 0.0 };
+    geometry.site[1] = site_coefficients{ cosa, -sinb, 0.0 };
+    for (size_t k = 0; k < parameters.sites.size(); ++k) {
+        const virtual_site &v{ parameters.sites[k] };
+        geometry.site[2 + k] = site_coefficients{ v.along_a, v.along_b,
+                                                  v.along_c };
+    }
+
+    int e{ static_cast<int>(parameters.sites.size()) };
+    static_assert(max_extra_sites == 4, "update the kernel tables");
+    static const water_kernel ones[]{ transform_one<0>, transform_one<1>,
+                                      transform_one<2>, transform_one<3>,
+                                      transform_one<4> };
+    static const rest_kernel rests[]{ transform_block<v_scalar, 0>,
+                                      transform_block<v_scalar, 1>,
+                                      transform_block<v_scalar, 2>,
+                                      transform_block<v_scalar, 3>,
+                                      transform_block<v_scalar, 4> };
+    static const place_rest_kernel place_rests[]{
+        place_block<v_scalar, 0>, place_block<v_scalar, 1>,
+        place_block<v_scalar, 2>, place_block<v_scalar, 3>,
+        place_block<v_scalar, 4> };
+    one = ones[e];
+    rest = rests[e];
+    batch = isa().fns ? isa().fns[e] : nullptr;
+    place_rest = place_rests[e];
+    place_batch = isa().place ? isa().place[e] : nullptr;
+}
+
+size_t model::transform(size_t n, const site_arrays &O, const site_arrays &H1,
+                        const site_arrays &H2, const site_arrays *extra,
+                        unsigned char *bad, const shape_arrays *shape) const {
+    check();
+
+    kernel_args a;
+    std::memset(&a, 0, sizeof(a));
+    a.xO = O.x; a.yO = O.y; a.zO = O.z;
+    a.x[0] = H1.x; a.y[0] = H1.y; a.z[0] = H1.z;
+    a.x[1] = H2.x; a.y[1] = H2.y; a.z[1] = H2.z;
+    for (size_t k = 0; k < parameters.sites.size(); ++k) {
+        a.x[2 + k] = extra[k].x; a.y[2 + k] = extra[k].y;
+        a.z[2 + k] = extra[k].z;
+    }
+    a.bad = bad;
+    if (shape) {
+        a.shape[0] = shape->rOH1; a.shape[1] = shape->rOH2;
+        a.shape[2] = shape->bisector;
+    }
+
+    // whole vectors with the selected instruction set, the rest in C++
+    size_t done{ 0 };
+    size_t nbad{ 0 };
+    if (batch) { nbad = batch(n, a, geometry, done); }
+    nbad += rest(done, n, a, geometry);
+    return nbad;
+}
+
+size_t model::orient(size_t n, const site_arrays &O, const site_arrays &H1,
+                     const site_arrays &H2, const frame_arrays &f,
+                     unsigned char *bad, const shape_arrays *shape) {
+    kernel_args a;
+    std::memset(&a, 0, sizeof(a));
+    a.xO = O.x; a.yO = O.y; a.zO = O.z;
+    a.x[0] = H1.x; a.y[0] = H1.y; a.z[0] = H1.z;
+    a.x[1] = H2.x; a.y[1] = H2.y; a.z[1] = H2.z;
+    a.bad = bad;
+    if (shape) {
+        a.shape[0] = shape->rOH1; a.shape[1] = shape->rOH2;
+        a.shape[2] = shape->bisector;
+    }
+    frame_args v{ { f.a.x, f.a.y, f.a.z, f.b.x, f.b.y, f.b.z,
+                    f.c.x, f.c.y, f.c.z } };
+
+    size_t done{ 0 };
+    size_t nbad{ 0 };
+    if (isa().orient) { nbad = isa().orient(n, a, v, done); }
+    nbad += orient_block<v_scalar>(done, n, a, v);
+    return nbad;
+}
+
+void model::place(size_t n, const site_arrays &O, const frame_arrays &f,
+                  const site_arrays &H1, const site_arrays &H2,
+                  const site_arrays *extra) const {
+    check();
+
+    kernel_args a;
+    std::memset(&a, 0, sizeof(a));
+    a.xO = O.x; a.yO = O.y; a.zO = O.z;
+    a.x[0] = H1.x; a.y[0] = H1.y; a.z[0] = H1.z;
+    a.x[1] = H2.x; a.y[1] = H2.y; a.z[1] = H2.z;
+    for (size_t k = 0; k < parameters.sites.size(); ++k) {
+        a.x[2 + k] = extra[k].x; a.y[2 + k] = extra[k].y;
+        a.z[2 + k] = extra[k].z;
+    }
+    frame_args v{ { f.a.x, f.a.y, f.a.z, f.b.x, f.b.y, f.b.z,
+                    f.c.x, f.c.y, f.c.z } };
+
+    size_t done{ 0 };
+    if (place_batch) { place_batch(n, a, v, geometry, done); }
+    place_rest(done, n, a, v, geometry);
 }
@@ -1,7 +1,10 @@
 #ifndef MODEL_H
 #define MODEL_H
+#include <istream>
+#include <stdexcept>
 #include <string>
 #include <vector>
+#include <cstddef>
 
 
 //! Geometric parameters of a water model
@@ -17,15 +20,143 @@ struct model_param {
     double lpangle;   //!< Lp-O-Lp angle (in plane perp. to HOH plane)
 };
 
+//! A site placed relative to the O atom of a water
+/**
+ * The position is O + a * along_a + b * along_b + c * along_c, with the
+ * unit vectors of the local frame of the idealised water: a along the
+ * bisector of the H-O-H angle (pointing to the H atoms), b along the
+ * H2 -> H1 direction and c = a x b, normal to the water plane. An M site is
+ * (rOM, 0, 0); the Lp sites of tip5p are (-cos(lpangle/2) * rOL, 0,
+ * +/- sin(lpangle/2) * rOL).
+ */
+struct virtual_site {
+    std::string name; //!< atom name in the output (1 to 5 characters)
+    double along_a;   //!< component along the bisector a (Angstrom)
+    double along_b;   //!< component along the H2 -> H1 direction b
+    double along_c;   //!< component along the normal c
+};
+
+//! Complete description of a water model
+/**
+ * Built-in models (model_param) and models loaded from a parameter file
+ * (see model::load()) are both turned into this form.
+ */
+struct model_definition {
+    std::string name;               //!< model name
+    double rOH;                     //!< O-H distance
+    double angle;                   //!< H-O-H angle
+    std::vector<virtual_site> sites; //!< extra sites, in output order
+};
+
+//! Error in a model parameter file
+class model_error: public std::runtime_error {
+public:
+    //! Constructor of model_error class
+    /**
+     * \param msg description of the error
+     * \param source name of the parameter file
+     * \param line number of the line in which the error occurred
+     */
+    model_error(const std::string &msg, const std::string &source,
+                size_t line) :
+        std::runtime_error(source + ":" + std::to_string(line) + ": " + msg) {}
+};
+
+//! Maximum number of extra sites of a model
+constexpr int max_extra_sites{ 4 };
+
+//! Coefficients of a site along the local frame vectors (see virtual_site)
+struct site_coefficients {
+    double a; //!< along the bisector
+    double b; //!< along the H2 -> H1 direction
+    double c; //!< along the normal of the water plane
+};
+
+//! Constants of a model, as used by the transforms
+/**
+ * Computed once by model::initialise(): every generated site (the two H
+ * atoms, then the extra sites) is a fixed linear combination of the frame
+ * vectors, so the transform needs no trigonometry.
+ */
+struct model_geometry {
+    site_coefficients site[2 + max_extra_sites]; //!< H1, H2, extra sites
+};
+
+struct kernel_args; // coordinate arrays of a batch (see model_kernel.h)
+struct frame_args;  // frame vectors of a batch (see model_kernel.h)
+
+//! Coordinates of one kind of site for a batch of waters
+/**
+ * Structure of arrays: x[i], y[i], z[i] belong to water i.
+ */
+struct site_arrays {
+    double *x; //!< x coordinates
+    double *y; //!< y coordinates
+    double *z; //!< z coordinates
+};
+
+//! Local frames of a batch of waters
+/**
+ * The unit vectors a, b and c of virtual_site for each water, as arrays
+ * like site_arrays: a.x[i], a.y[i], a.z[i] belong to water i.
+ */
+struct frame_arrays {
+    site_arrays a; //!< along the bisector of the H-O-H angle
+    site_arrays b; //!< along the H2 -> H1 direction
+    site_arrays c; //!< normal to the water plane
+};
+
+//! Input geometry of a batch of waters, as found by the transforms
+/**
+ * For water i: rOH1[i] and rOH2[i] are its O-H distances, bisector[i] the
+ * length of the sum of its two unit O-H vectors, 2 cos(angle / 2) for an
+ * H-O-H angle.
+ */
+struct shape_arrays {
+    double *rOH1;     //!< O-H1 distances
+    double *rOH2;     //!< O-H2 distances
+    double *bisector; //!< lengths of the unnormalised bisectors
+};
+
 //! Class to set up and perform geometric caclulations using a water model
 class model {
 public:
     //! Constructor; takes no parameters
-    model() : is_initialised{ false } {}
+    model() : is_initialised{ false }, geometry{}, one{ nullptr },
+              batch{ nullptr }, rest{ nullptr }, place_batch{ nullptr },
+              place_rest{ nullptr } {}
 
     //! return list of known model names
+    /**
+     * The built-in models come first (the first one is the default),
+     * followed by the models loaded with load().
+     */
     static std::vector<std::string> catalog();
 
+    //! true if name is one of the built-in models
+    static bool builtin(const std::string &name);
+
+    //! add the models of a parameter file to the catalog
+    /**
+     * The file describes one or more models. Empty lines and text after
+     * '#' are ignored; each model is a block of lines
+     * \code
+     * model NAME           (starts a new model)
+     * rOH   DISTANCE       (O-H distance, Angstrom)
+     * angle ANGLE          (H-O-H angle, degrees)
+     * site  NAME A B C     (extra site; coefficients as in virtual_site)
+     * \endcode
+     * with up to max_extra_sites site lines, in output order. rOH and
+     * angle are required. Call it before the models are used (it is not
+     * thread safe); a failed load adds no model.
+     *
+     * \param is stream to read the parameters from
+     * \param source name of the file, for error messages
+     * \return the number of models added
+     * \throws model_error for a bad file or a name that is already known
+     */
+    static int load(std::istream &is, const std::string &source);
+
     //! set up model params based on model name
     /**
      * Models must be succesfully initialised before any other method
@@ -46,7 +177,21 @@ public:
      */
     bool initialise(int id);
 
+    //! set up a model from its definition
+    /**
+     * \param d complete description of the model
+     * \return true if set-up is successful (false for a definition with a
+     *     bad geometry, too many sites or bad site names)
+     */
+    bool initialise(const model_definition &d);
+
     int size() const;  //!< gives the number of sites in current model
+
+    //! description of the current model
+    const model_definition &definition() const;
+
+    //! name of extra site k (0 <= k < size() - 3), e.g. MW, or LP1 and LP2
+    const char *extra_name(int k) const;
     
     //! change water coordinates to idealised model geometry
     /**
@@ -56,21 +201,129 @@ public:
      * \param[in,out] xO,yO,zO coordinates of the O atom
      * \param[in,out] x1,y1,z1,x2,y2,z2 coordinates of the two H atoms
      *
-     * \returns a vector of either x, y, z coordinates for a single M site
-     *     or x1, y1, z1, x2, y2, z2 for the two Lp sites (both are optional)
+     * \returns a vector with the x, y, z coordinates of each extra site, in
+     *     the order of extra_name() (empty for 3-site models)
      *
-     * \note The algorithm in gro.cpp does not work with both M and Lp sites
-     *     althogh this routine would support it (I know of no such model)
+     * \note Compatibility wrapper around transform(double*, double*),
+     *     which needs no allocation
+     * \throws std::runtime_error for a bad input structure
         */
     std::vector<double> transform(double &xO, double &yO, double &zO,  // Ow
                            double &x1, double &y1, double &z1,         // Hw1
                            double &x2, double &y2, double &z2) const;  // Hw2
+
+    //! change the coordinates of one water to idealised model geometry
+    /**
+     * Same calculation as the other transforms (with identical results),
+     * by a kernel specialised for the number of extra sites of the model,
+     * chosen once by initialise(): no branches on the model and no
+     * allocation.
+     *
+     * \param[in,out] w coordinates of O, H1 and H2 (x, y, z each); O is
+     *     not changed
+     * \param[out] extra coordinates of the extra sites, in the order of
+     *     extra_name() (x, y, z each; 3 * (size() - 3) values)
+     * \return false if the input structure is bad; the coordinates are
+     *     then meaningless
+     */
+    bool transform(double *w, double *extra) const;
+
+    //! change coordinates of a batch of waters to idealised model geometry
+    /**
+     * Same calculation as the single water transform() (with identical
+     * results), on arrays of coordinates. Depending on the processor the
+     * work is done with SSE2, AVX2 or AVX-512 instructions (see batch_isa()).
+     *
+     * \param n number of waters
+     * \param O coordinates of the O atoms (not changed)
+     * \param[in,out] H1,H2 coordinates of the two H atoms
+     * \param[out] extra arrays for the extra sites, in the order of
+     *     extra_name() (size() - 3 arrays); may be nullptr for 3-site models
+     * \param[out] bad if not nullptr, bad[i] is set to 1 if water i has a
+     *     bad input structure and to 0 otherwise; coordinates of bad waters
+     *     are meaningless after the call
+     * \param[out] shape if not nullptr, the input geometry of each water,
+     *     which the transform finds anyway (at no extra cost but the stores)
+     * \return the number of waters with bad input structure
+     */
+    size_t transform(size_t n, const site_arrays &O, const site_arrays &H1,
+                     const site_arrays &H2, const site_arrays *extra,
+                     unsigned char *bad = nullptr,
+                     const shape_arrays *shape = nullptr) const;
+
+    //! local frames of a batch of waters: the first half of transform()
+    /**
+     * The frame of a water does not depend on the model, so for several
+     * models it can be found once and the sites of each model placed along
+     * it with place(). Together they give the same results as transform().
+     *
+     * \param n number of waters
+     * \param O,H1,H2 coordinates of the atoms (not changed)
+     * \param[out] f the frames
+     * \param[out] bad as for transform()
+     * \param[out] shape as for transform()
+     * \return the number of waters with bad input structure
+     */
+    static size_t orient(size_t n, const site_arrays &O, const site_arrays &H1,
+                         const site_arrays &H2, const frame_arrays &f,
+                         unsigned char *bad = nullptr,
+                         const shape_arrays *shape = nullptr);
+
+    //! sites of the model along frames found by orient()
+    /**
+     * \param n number of waters
+     * \param O coordinates of the O atoms
+     * \param f their frames
+     * \param[out] H1,H2 coordinates of the two H atoms
+     * \param[out] extra as for transform()
+     */
+    void place(size_t n, const site_arrays &O, const frame_arrays &f,
+               const site_arrays &H1, const site_arrays &H2,
+               const site_arrays *extra) const;
+
+    //! name of the instruction set used by the batch transform()
+    /**
+     * One of "scalar", "sse2", "avx2" or "avx512": the best one supported
+     * by both the build and the processor. The environment variable
+     * WATCOR_SIMD can be set to one of these names to cap the choice.
+     */
+    static const char *batch_isa();
 protected:
-    model_param parameters; //!< a copy of the current model parameters
+    //! kernel for one water (see transform(double*, double*))
+    typedef bool (*water_kernel)(const model_geometry &g, double *w,
+                                 double *extra);
+    //! kernel for a batch: does [0, n) in whole vectors, sets done
+    typedef size_t (*batch_kernel)(size_t n, const kernel_args &a,
+                                   const model_geometry &g, size_t &done);
+    //! kernel for the waters [begin, end) of a batch, in plain C++
+    typedef size_t (*rest_kernel)(size_t begin, size_t end,
+                                  const kernel_args &a,
+                                  const model_geometry &g);
+    //! kernel placing sites along frames (see place()), as batch_kernel
+    typedef void (*place_kernel)(size_t n, const kernel_args &a,
+                                 const frame_args &f,
+                                 const model_geometry &g, size_t &done);
+    //! kernel placing sites for the waters [begin, end), in plain C++
+    typedef void (*place_rest_kernel)(size_t begin, size_t end,
+                                      const kernel_args &a,
+                                      const frame_args &f,
+                                      const model_geometry &g);
+
+    model_definition parameters; //!< a copy of the current model
     bool is_initialised;    //!< flag to show the model is initialised
+    model_geometry geometry; //!< coefficients derived from the parameters
+    water_kernel one;       //!< single water kernel for the model's sites
+    batch_kernel batch;     //!< batch kernel (best instruction set) or null
+    rest_kernel rest;       //!< batch kernel for the remainder
+    place_kernel place_batch;    //!< place() kernel (best instruction set)
+    place_rest_kernel place_rest; //!< place() kernel for the remainder
     void check() const;    //!< throw a logic_error if model is not initialised
+    void choose_kernels(); //!< set geometry and kernels
+
+    //! models added by load()
+    static std::vector<model_definition> &loaded();
 
-    static constexpr int n_models{ 12 }; //!< number of known models
+    static constexpr int n_models{ 12 }; //!< number of built-in models
 
     //! contains all parameters for the known models
     static constexpr model_param const models[] = {
@@ -0,0 +1,36 @@
+#include "model_kernel.h"
+
+#ifdef WATCOR_HAVE_AVX2
+#include <immintrin.h>
+
+namespace {
+
+// four doubles per vector (AVX2)
+struct v_avx2 {
+    typedef __m256d type;
+    static const unsigned width{ 4 };
+    static type load(const double *p) { return _mm256_loadu_pd(p); }
+    static void store(double *p, type v) { _mm256_storeu_pd(p, v); }
+    static type set1(double d) { return _mm256_set1_pd(d); }
+    static type add(type a, type b) { return _mm256_add_pd(a, b); }
+    static type sub(type a, type b) { return _mm256_sub_pd(a, b); }
+    static type mul(type a, type b) { return _mm256_mul_pd(a, b); }
+    static type div(type a, type b) { return _mm256_div_pd(a, b); }
+    static type sqrt(type a) { return _mm256_sqrt_pd(a); }
+    static unsigned bad(type lv1, type lv2, type la) {
+        type lo{ _mm256_set1_pd(1.0e-4) };
+        type hi{ _mm256_set1_pd(1.9999) };
+        type m{ _mm256_or_pd(
+            _mm256_or_pd(_mm256_cmp_pd(lv1, lo, _CMP_LT_OQ),
+                         _mm256_cmp_pd(lv2, lo, _CMP_LT_OQ)),
+            _mm256_or_pd(_mm256_cmp_pd(la, lo, _CMP_LT_OQ),
+                         _mm256_cmp_pd(la, hi, _CMP_GT_OQ))) };
+        return static_cast<unsigned>(_mm256_movemask_pd(m));
+    }
+};
+
+} // namespace
+
+WATCOR_KERNEL_TABLE(avx2, v_avx2);
+
+#endif
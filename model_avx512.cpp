@@ -0,0 +1,35 @@
+#include "model_kernel.h"
+
+#ifdef WATCOR_HAVE_AVX512
+#include <immintrin.h>
+
+namespace {
+
+// eight doubles per vector (AVX-512F)
+struct v_avx512 {
+    typedef __m512d type;
+    static const unsigned width{ 8 };
+    static type load(const double *p) { return _mm512_loadu_pd(p); }
+    static void store(double *p, type v) { _mm512_storeu_pd(p, v); }
+    static type set1(double d) { return _mm512_set1_pd(d); }
+    static type add(type a, type b) { return _mm512_add_pd(a, b); }
+    static type sub(type a, type b) { return _mm512_sub_pd(a, b); }
+    static type mul(type a, type b) { return _mm512_mul_pd(a, b); }
+    static type div(type a, type b) { return _mm512_div_pd(a, b); }
+    static type sqrt(type a) { return _mm512_sqrt_pd(a); }
+    static unsigned bad(type lv1, type lv2, type la) {
+        type lo{ _mm512_set1_pd(1.0e-4) };
+        type hi{ _mm512_set1_pd(1.9999) };
+        __mmask8 m = _mm512_cmp_pd_mask(lv1, lo, _CMP_LT_OQ)
+                   | _mm512_cmp_pd_mask(lv2, lo, _CMP_LT_OQ)
+                   | _mm512_cmp_pd_mask(la, lo, _CMP_LT_OQ)
+                   | _mm512_cmp_pd_mask(la, hi, _CMP_GT_OQ);
+        return static_cast<unsigned>(m);
+    }
+};
+
+} // namespace
+
+WATCOR_KERNEL_TABLE(avx512, v_avx512);
+
+#endif
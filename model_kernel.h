@@ -0,0 +1,285 @@
+#ifndef MODEL_KERNEL_H
+#define MODEL_KERNEL_H
+#include "model.h"
+#include <cstddef>
+
+// Internal header: the batch (structure of arrays) version of
+// model::transform(), written once against a small vector "traits" class
+// V and instantiated for scalar code and each supported instruction set.
+// The ISA specific instantiations live in their own translation units
+// (model_sse2.cpp, model_avx2.cpp, model_avx512.cpp), compiled with the
+// matching compiler flags; model.cpp picks one at run time.
+//
+// Every generated site (H1, H2 and the extra sites) is O plus a linear
+// combination of the frame vectors a, b, c with the coefficients of
+// model_geometry, evaluated as ((O + c*kc) + a*ka) + b*kb; this order
+// reproduces the rounding of the original H, M and Lp formulas. The
+// kernels are instantiated for each number of extra sites, so the site
+// loop is unrolled and has no branches on the model; model.cpp picks the
+// instantiations once, in model::initialise(). The single water transform
+// is the scalar kernel run on one water.
+//
+// For several models the transform is also done in two steps: the frame
+// of each water (orient_block, the same for all models) and the sites of a
+// model placed along it (place_block). Both use the code of transform_block
+// (water_frame and place_site), so the results are the same.
+//
+// The arithmetic is the same operation by operation for all versions (no
+// fused multiply-add), so they all give identical results.
+//
+// A traits class provides:
+//   type         vector of doubles; width  number of lanes
+//   load/store   unaligned memory access
+//   set1         broadcast a constant
+//   add sub mul div sqrt
+//   bad(lv1, lv2, la)  bit mask of lanes with a bad water structure
+
+// pointers to the coordinate arrays of a batch
+struct kernel_args {
+    const double *xO, *yO, *zO;        // O atoms (unchanged)
+    // generated sites: H1 and H2 (in/out), then the extra sites (out)
+    double *x[2 + max_extra_sites];
+    double *y[2 + max_extra_sites];
+    double *z[2 + max_extra_sites];
+    unsigned char *bad;                // per water flag (out, may be null)
+    double *shape[3];  // O-H1, O-H2 lengths and la (out, may all be null)
+};
+
+// pointers to the frame vectors of a batch: a, b, c (x, y, z each)
+struct frame_args {
+    double *v[9];
+};
+
+// the ISA specific entry points, one per number of extra sites:
+// process waters [0, n) in whole vectors, set done to the number of
+// waters processed, return the number of bad ones
+typedef size_t (*kernel_fn)(size_t n, const kernel_args &a,
+                            const model_geometry &p, size_t &done);
+
+// the same for the two steps: the frames of waters [0, n) (the bad flags
+// in a.bad; no generated sites are used), and the sites of a model
+typedef size_t (*orient_fn)(size_t n, const kernel_args &a,
+                            const frame_args &f, size_t &done);
+typedef void (*place_fn)(size_t n, const kernel_args &a, const frame_args &f,
+                         const model_geometry &p, size_t &done);
+
+extern const kernel_fn transform_sse2[max_extra_sites + 1];
+extern const kernel_fn transform_avx2[max_extra_sites + 1];
+extern const kernel_fn transform_avx512[max_extra_sites + 1];
+extern const orient_fn orient_sse2;
+extern const orient_fn orient_avx2;
+extern const orient_fn orient_avx512;
+extern const place_fn place_sse2[max_extra_sites + 1];
+extern const place_fn place_avx2[max_extra_sites + 1];
+extern const place_fn place_avx512[max_extra_sites + 1];
+
+// the local frame of V::width waters
+template <class V>
+struct water_frame {
+    typedef typename V::type vec;
+    vec ax, ay, az; // bisector
+    vec bx, by, bz; // H2 -> H1
+    vec cx, cy, cz; // normal
+};
+
+// the frame of the waters at i, with O at xO, yO, zO; returns the bit mask
+// of bad waters. The lengths found on the way are stored in a.shape if it
+// is set (see model::transform()).
+template <class V>
+unsigned frame_of(const kernel_args &a, size_t i, typename V::type xO,
+                  typename V::type yO, typename V::type zO,
+                  water_frame<V> &f) {
+    typedef typename V::type vec;
+
+    // O-H vectors and their lengths (v1, v2)
+    vec vx1{ V::sub(V::load(a.x[0] + i), xO) };
+    vec vy1{ V::sub(V::load(a.y[0] + i), yO) };
+    vec vz1{ V::sub(V::load(a.z[0] + i), zO) };
+    vec lv1{ V::sqrt(V::add(V::add(V::mul(vx1, vx1), V::mul(vy1, vy1)),
+                            V::mul(vz1, vz1))) };
+    vec vx2{ V::sub(V::load(a.x[1] + i), xO) };
+    vec vy2{ V::sub(V::load(a.y[1] + i), yO) };
+    vec vz2{ V::sub(V::load(a.z[1] + i), zO) };
+    vec lv2{ V::sqrt(V::add(V::add(V::mul(vx2, vx2), V::mul(vy2, vy2)),
+                            V::mul(vz2, vz2))) };
+
+    // normalise O-H vectors
+    vx1 = V::div(vx1, lv1); vy1 = V::div(vy1, lv1); vz1 = V::div(vz1, lv1);
+    vx2 = V::div(vx2, lv2); vy2 = V::div(vy2, lv2); vz2 = V::div(vz2, lv2);
+
+    // bisector (unit vector a)
+    vec ax{ V::add(vx1, vx2) };
+    vec ay{ V::add(vy1, vy2) };
+    vec az{ V::add(vz1, vz2) };
+    vec la{ V::sqrt(V::add(V::add(V::mul(ax, ax), V::mul(ay, ay)),
+                           V::mul(az, az))) };
+    unsigned bad{ V::bad(lv1, lv2, la) };
+    if (a.shape[0]) {
+        V::store(a.shape[0] + i, lv1);
+        V::store(a.shape[1] + i, lv2);
+        V::store(a.shape[2] + i, la);
+    }
+    ax = V::div(ax, la); ay = V::div(ay, la); az = V::div(az, la);
+
+    // H...H direction (unit vector b)
+    vec bx{ V::sub(vx1, vx2) };
+    vec by{ V::sub(vy1, vy2) };
+    vec bz{ V::sub(vz1, vz2) };
+    vec lb{ V::sqrt(V::add(V::add(V::mul(bx, bx), V::mul(by, by)),
+                           V::mul(bz, bz))) };
+    bx = V::div(bx, lb); by = V::div(by, lb); bz = V::div(bz, lb);
+
+    // c is perpendicular to the water plane (a x b)
+    f.cx = V::sub(V::mul(ay, bz), V::mul(az, by));
+    f.cy = V::sub(V::mul(az, bx), V::mul(ax, bz));
+    f.cz = V::sub(V::mul(ax, by), V::mul(ay, bx));
+    f.ax = ax; f.ay = ay; f.az = az;
+    f.bx = bx; f.by = by; f.bz = bz;
+    return bad;
+}
+
+// set the bad flags of the waters at i from the mask; returns their number
+template <class V>
+size_t flag_bad(const kernel_args &a, size_t i, unsigned bad) {
+    size_t nbad{ 0 };
+    for (unsigned k = 0; k < V::width; ++k) {
+        unsigned b{ (bad >> k) & 1u };
+        nbad += b;
+        if (a.bad) { a.bad[i + k] = static_cast<unsigned char>(b); }
+    }
+    return nbad;
+}
+
+// store site s (coefficients ka, kb, kc) of the waters at i
+template <class V>
+void place_site(const kernel_args &a, size_t i, int s, typename V::type xO,
+                typename V::type yO, typename V::type zO,
+                const water_frame<V> &f, typename V::type ka,
+                typename V::type kb, typename V::type kc) {
+    V::store(a.x[s] + i, V::add(V::add(V::add(xO, V::mul(f.cx, kc)),
+                                       V::mul(f.ax, ka)),
+                                V::mul(f.bx, kb)));
+    V::store(a.y[s] + i, V::add(V::add(V::add(yO, V::mul(f.cy, kc)),
+                                       V::mul(f.ay, ka)),
+                                V::mul(f.by, kb)));
+    V::store(a.z[s] + i, V::add(V::add(V::add(zO, V::mul(f.cz, kc)),
+                                       V::mul(f.az, ka)),
+                                V::mul(f.bz, kb)));
+}
+
+// process waters [begin, end) in steps of V::width; end - begin must be
+// a multiple of the width. Returns the number of bad waters.
+template <class V, int E>
+size_t transform_block(size_t begin, size_t end, const kernel_args &a,
+                       const model_geometry &p) {
+    typedef typename V::type vec;
+    const int n{ 2 + E }; // sites generated
+    vec ka[n], kb[n], kc[n];
+    for (int s = 0; s < n; ++s) {
+        ka[s] = V::set1(p.site[s].a);
+        kb[s] = V::set1(p.site[s].b);
+        kc[s] = V::set1(p.site[s].c);
+    }
+    size_t nbad{ 0 };
+
+    for (size_t i = begin; i < end; i += V::width) {
+        vec xO{ V::load(a.xO + i) };
+        vec yO{ V::load(a.yO + i) };
+        vec zO{ V::load(a.zO + i) };
+        water_frame<V> f;
+        nbad += flag_bad<V>(a, i, frame_of<V>(a, i, xO, yO, zO, f));
+
+        // new H positions and extra sites
+        for (int s = 0; s < n; ++s) {
+            place_site<V>(a, i, s, xO, yO, zO, f, ka[s], kb[s], kc[s]);
+        }
+    }
+    return nbad;
+}
+
+// the frames of waters [begin, end) into f (steps as transform_block);
+// returns the number of bad waters
+template <class V>
+size_t orient_block(size_t begin, size_t end, const kernel_args &a,
+                    const frame_args &f) {
+    typedef typename V::type vec;
+    size_t nbad{ 0 };
+    for (size_t i = begin; i < end; i += V::width) {
+        water_frame<V> w;
+        nbad += flag_bad<V>(a, i, frame_of<V>(a, i, V::load(a.xO + i),
+                                              V::load(a.yO + i),
+                                              V::load(a.zO + i), w));
+        const vec v[9]{ w.ax, w.ay, w.az, w.bx, w.by, w.bz, w.cx, w.cy,
+                        w.cz };
+        for (int k = 0; k < 9; ++k) { V::store(f.v[k] + i, v[k]); }
+    }
+    return nbad;
+}
+
+// the sites of a model for waters [begin, end) along the frames f (steps
+// as transform_block)
+template <class V, int E>
+void place_block(size_t begin, size_t end, const kernel_args &a,
+                 const frame_args &f, const model_geometry &p) {
+    typedef typename V::type vec;
+    const int n{ 2 + E }; // sites generated
+    vec ka[n], kb[n], kc[n];
+    for (int s = 0; s < n; ++s) {
+        ka[s] = V::set1(p.site[s].a);
+        kb[s] = V::set1(p.site[s].b);
+        kc[s] = V::set1(p.site[s].c);
+    }
+    for (size_t i = begin; i < end; i += V::width) {
+        vec xO{ V::load(a.xO + i) };
+        vec yO{ V::load(a.yO + i) };
+        vec zO{ V::load(a.zO + i) };
+        water_frame<V> w;
+        w.ax = V::load(f.v[0] + i); w.ay = V::load(f.v[1] + i);
+        w.az = V::load(f.v[2] + i);
+        w.bx = V::load(f.v[3] + i); w.by = V::load(f.v[4] + i);
+        w.bz = V::load(f.v[5] + i);
+        w.cx = V::load(f.v[6] + i); w.cy = V::load(f.v[7] + i);
+        w.cz = V::load(f.v[8] + i);
+        for (int s = 0; s < n; ++s) {
+            place_site<V>(a, i, s, xO, yO, zO, w, ka[s], kb[s], kc[s]);
+        }
+    }
+}
+
+// common body of the ISA specific entry points
+template <class V, int E>
+size_t transform_whole_vectors(size_t n, const kernel_args &a,
+                               const model_geometry &p, size_t &done) {
+    done = n - n % V::width;
+    return transform_block<V, E>(0, done, a, p);
+}
+
+template <class V>
+size_t orient_whole_vectors(size_t n, const kernel_args &a,
+                            const frame_args &f, size_t &done) {
+    done = n - n % V::width;
+    return orient_block<V>(0, done, a, f);
+}
+
+template <class V, int E>
+void place_whole_vectors(size_t n, const kernel_args &a, const frame_args &f,
+                         const model_geometry &p, size_t &done) {
+    done = n - n % V::width;
+    place_block<V, E>(0, done, a, f, p);
+}
+
+// the entry points of an instruction set (transform_isa, orient_isa and
+// place_isa), indexed by number of extra sites
+static_assert(max_extra_sites == 4, "update WATCOR_KERNEL_TABLE");
+#define WATCOR_KERNEL_TABLE(isa, V) \
+    const kernel_fn transform_##isa[max_extra_sites + 1]{ \
+        transform_whole_vectors<V, 0>, transform_whole_vectors<V, 1>, \
+        transform_whole_vectors<V, 2>, transform_whole_vectors<V, 3>, \
+        transform_whole_vectors<V, 4> }; \
+    const orient_fn orient_##isa{ orient_whole_vectors<V> }; \
+    const place_fn place_##isa[max_extra_sites + 1]{ \
+        place_whole_vectors<V, 0>, place_whole_vectors<V, 1>, \
+        place_whole_vectors<V, 2>, place_whole_vectors<V, 3>, \
+        place_whole_vectors<V, 4> }
+
+#endif
@@ -0,0 +1,34 @@
+#include "model_kernel.h"
+
+#ifdef WATCOR_HAVE_SSE2
+#include <emmintrin.h>
+
+namespace {
+
+// two doubles per vector (SSE2)
+struct v_sse2 {
+    typedef __m128d type;
+    static const unsigned width{ 2 };
+    static type load(const double *p) { return _mm_loadu_pd(p); }
+    static void store(double *p, type v) { _mm_storeu_pd(p, v); }
+    static type set1(double d) { return _mm_set1_pd(d); }
+    static type add(type a, type b) { return _mm_add_pd(a, b); }
+    static type sub(type a, type b) { return _mm_sub_pd(a, b); }
+    static type mul(type a, type b) { return _mm_mul_pd(a, b); }
+    static type div(type a, type b) { return _mm_div_pd(a, b); }
+    static type sqrt(type a) { return _mm_sqrt_pd(a); }
+    static unsigned bad(type lv1, type lv2, type la) {
+        type lo{ _mm_set1_pd(1.0e-4) };
+        type m{ _mm_or_pd(_mm_or_pd(_mm_cmplt_pd(lv1, lo),
+                                    _mm_cmplt_pd(lv2, lo)),
+                          _mm_or_pd(_mm_cmplt_pd(la, lo),
+                                    _mm_cmpgt_pd(la, _mm_set1_pd(1.9999)))) };
+        return static_cast<unsigned>(_mm_movemask_pd(m));
+    }
+};
+
+} // namespace
+
+WATCOR_KERNEL_TABLE(sse2, v_sse2);
+
+#endif
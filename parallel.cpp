@@ -0,0 +1,118 @@
+#include "parallel.h"
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+int thread_count(int requested) {
+    if (requested > 0) { return requested; }
+    unsigned h{ std::thread::hardware_concurrency() };
+    return h > 0 ? static_cast<int>(h) : 1;
+}
+
+void parallel_for(size_t n, int threads,
+                  const std::function<void(size_t)> &work) {
+    std::vector<std::exception_ptr> err(n);
+    std::atomic<size_t> next{ 0 };
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            try {
+                work(i);
+            }
+            catch (...) {
+                err[i] = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads && static_cast<size_t>(t) < n; ++t) {
+        pool.emplace_back(worker);
+    }
+    worker(); // the calling thread works too
+    for (auto &t: pool) { t.join(); }
+
+    for (auto &e: err) {
+        if (e) { std::rethrow_exception(e); }
+    }
+}
+
+void parallel_ordered(size_t n, int threads, size_t ahead,
+                      const std::function<void(size_t)> &produce,
+                      const std::function<void(size_t)> &consume) {
+    if (threads <= 1) {
+        for (size_t i = 0; i < n; ++i) {
+            produce(i);
+            consume(i);
+        }
+        return;
+    }
+    if (ahead < 1) { ahead = 1; }
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<char> done(n, 0);
+    std::vector<std::exception_ptr> err(n);
+    size_t next{ 0 };     // next item to produce
+    size_t consumed{ 0 }; // items consumed so far
+    bool stop{ false };   // set to make the workers quit
+
+    auto worker = [&]() {
+        for (;;) {
+            size_t i;
+            {
+                std::unique_lock<std::mutex> lock{ mtx };
+                cv.wait(lock, [&]() {
+                    return stop || next >= n || next < consumed + ahead;
+                });
+                if (stop || next >= n) { return; }
+                i = next++;
+            }
+            std::exception_ptr e;
+            try {
+                produce(i);
+            }
+            catch (...) {
+                e = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock{ mtx };
+            err[i] = e;
+            done[i] = 1;
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads && static_cast<size_t>(t) < n; ++t) {
+        pool.emplace_back(worker);
+    }
+    auto finish = [&]() {
+        {
+            std::lock_guard<std::mutex> lock{ mtx };
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto &t: pool) { t.join(); }
+    };
+
+    try {
+        for (size_t i = 0; i < n; ++i) {
+            {
+                std::unique_lock<std::mutex> lock{ mtx };
+                cv.wait(lock, [&]() { return done[i] != 0; });
+                if (err[i]) { std::rethrow_exception(err[i]); }
+            }
+            consume(i);
+            std::lock_guard<std::mutex> lock{ mtx };
+            ++consumed;
+            cv.notify_all();
+        }
+    }
+    catch (...) {
+        finish();
+        throw;
+    }
+    finish();
+}
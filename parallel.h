@@ -0,0 +1,49 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+#include <cstddef>
+#include <functional>
+
+/** \defgroup parallel Thread helpers
+ * @{
+ */
+
+//! Number of threads to use for a requested number
+/**
+ * \param requested number of threads asked for; 0 or less means one per
+ *     hardware thread
+ * \return a thread count of at least 1
+ */
+int thread_count(int requested);
+
+//! Run work(i) for all i in [0, n), spread over several threads
+/**
+ * \param n number of work items
+ * \param threads number of threads to use (the calling thread is one)
+ * \param work function to call for each item
+ * \throw the exception thrown by work(i) for the lowest i, once all
+ *     threads have finished
+ */
+void parallel_for(size_t n, int threads,
+                  const std::function<void(size_t)> &work);
+
+//! Produce items on several threads, consume them in order
+/**
+ * produce(i) runs on worker threads, at most ahead items beyond the one
+ * waiting to be consumed. consume(i) runs on the calling thread in the
+ * order i = 0, 1, ..., n-1, as soon as item i is produced.
+ *
+ * \param n number of items
+ * \param threads number of worker threads
+ * \param ahead maximum number of items produced but not yet consumed
+ * \param produce function producing item i
+ * \param consume function consuming item i
+ * \throw if produce(i) throws, items before i are consumed, then the
+ *     exception is rethrown; exceptions from consume() are passed on
+ */
+void parallel_ordered(size_t n, int threads, size_t ahead,
+                      const std::function<void(size_t)> &produce,
+                      const std::function<void(size_t)> &consume);
+
+/**@}*/
+
+#endif
@@ -1,33 +1,200 @@
 #include "readall.h"
+#include "codec.h"
+#include "uring.h"
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <stdexcept>
 #include <cerrno>
 #include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 long readall(std::string name, std::vector<std::string> &lines) {
 
-    std::ifstream inp;
+    text_file f{ name };
 
-    inp.open(name);
-    if (!inp.good()) {
-        std::string msg{ "cannot open '" + name + "': " };
-        msg += strerror(errno);
-        throw(std::runtime_error(msg));
-    }
-    
     long n{ 0 }; // nr. of lines read
-    std::string l; // line buffer
-    while (std::getline(inp,l)) {
-        lines.push_back(l);
+    lines.reserve(lines.size() + f.size());
+    for (size_t i = 0; i < f.size(); ++i) {
+        lines.push_back(f[i].str());
         ++n;
     }
     
-    if (!inp.eof()) {
-        std::string msg { "error while reading '" + name + "': " };
+    return n;
+
+}
+
+text_file::text_file(const std::string &name, bool uring, bool copy) :
+    base{ nullptr }, nbytes{ 0 }, map{ nullptr } {
+
+    bool use_stdin{ name == "-" };
+    int fd{ use_stdin ? STDIN_FILENO : open(name.c_str(), O_RDONLY) };
+    if (fd < 0) {
+        std::string msg{ "cannot open '" + name + "': " };
         msg += strerror(errno);
         throw(std::runtime_error(msg));
     }
-    
-    return n;
 
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        nbytes = static_cast<size_t>(st.st_size);
+        if (uring) {
+            // anonymous memory: no need to clear it before reading into it
+            void *p{ mmap(nullptr, nbytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) };
+            bool done{ false };
+            try {
+                done = p != MAP_FAILED
+                       && uring_read(fd, static_cast<char *>(p), nbytes, name);
+            }
+            catch (...) {
+                munmap(p, nbytes);
+                if (!use_stdin) { close(fd); }
+                throw;
+            }
+            if (done) {
+                map = p;
+                base = static_cast<const char *>(p);
+            } else if (p != MAP_FAILED) {
+                munmap(p, nbytes); // io_uring not available
+            }
+        }
+    }
+    if (!base && nbytes > 0 && !copy) {
+        void *p{ mmap(nullptr, nbytes, PROT_READ, MAP_PRIVATE, fd, 0) };
+        if (p != MAP_FAILED) {
+            map = p;
+            base = static_cast<const char *>(p);
+            madvise(p, nbytes, MADV_SEQUENTIAL);
+        }
+    }
+
+    if (!base) {
+        try {
+            read_fd(fd, name);
+        }
+        catch (...) {
+            if (!use_stdin) { close(fd); }
+            throw;
+        }
+    }
+    if (!use_stdin) { close(fd); } // mapping stays valid
+
+    if (codec_of_data(base, nbytes) != CODEC_NONE) {
+        try {
+            unpack(name);
+        }
+        catch (...) {
+            if (map) { munmap(map, nbytes); }
+            throw;
+        }
+    } else {
+        index_lines(0, nbytes, true);
+    }
+}
+
+text_file::text_file(const char *data, size_t n) :
+    base{ data }, nbytes{ n }, map{ nullptr } {
+    index_lines(0, nbytes, true);
+}
+
+text_file::~text_file() {
+    if (map) { munmap(map, nbytes); }
+}
+
+void text_file::read_fd(int fd, const std::string &name) {
+    size_t block{ 1 << 20 };
+    nbytes = 0;
+    arena.resize(block);
+    for (;;) {
+        if (arena.size() - nbytes < block) {
+            arena.resize(2 * arena.size());
+        }
+        ssize_t r{ read(fd, arena.data() + nbytes, arena.size() - nbytes) };
+        if (r == 0) { break; }
+        if (r < 0) {
+            if (errno == EINTR) { continue; }
+            std::string msg { "error while reading '" + name + "': " };
+            msg += strerror(errno);
+            throw(std::runtime_error(msg));
+        }
+        nbytes += static_cast<size_t>(r);
+    }
+    base = arena.data();
+}
+
+void text_file::unpack(const std::string &name) {
+    // the compressed data stay where they are (mapped or in the arena) until
+    // decompress() returns; meanwhile base is the decompressed text so far,
+    // whose complete lines are indexed block by block
+    const char *packed{ base };
+    codec_t c{ codec_of_data(packed, nbytes) };
+    std::vector<char> text(std::max(decompressed_size(c, packed, nbytes),
+                                    size_t{ 1 } << 20));
+    size_t used{ 0 };
+    size_t next{ 0 }; // start of the first line not indexed
+    decompress(c, packed, nbytes, [&](const char *p, size_t n) {
+        if (text.size() - used < n) {
+            text.resize(std::max(2 * text.size(), used + n));
+        }
+        std::memcpy(text.data() + used, p, n);
+        used += n;
+        base = text.data();
+        next = index_lines(next, used, false);
+    }, name);
+    base = text.data();
+    index_lines(next, used, true);
+
+    if (map) { munmap(map, nbytes); }
+    map = nullptr;
+    text.resize(used);
+    arena.swap(text);
+    base = arena.data();
+    nbytes = arena.size();
+}
+
+size_t text_file::index_lines(size_t from, size_t to, bool last) {
+    const size_t mask{ (size_t{ 1 } << block_bits) - 1 };
+    auto add = [&](size_t at) {
+        if ((offs.size() & mask) == 0) { blocks.push_back(at); }
+        if (at - blocks.back() > UINT32_MAX) {
+            throw(std::runtime_error("lines too long to index (4096 lines "
+                                     "of 4 GB or more)"));
+        }
+        offs.push_back(static_cast<uint32_t>(at - blocks.back()));
+    };
+    while (from < to) {
+        const void *nl{ std::memchr(base + from, '\n', to - from) };
+        if (!nl) { break; }
+        add(from);
+        from = static_cast<size_t>(static_cast<const char *>(nl) - base) + 1;
+    }
+    if (last) {
+        // a last line without newline, then the sentinel (one past the
+        // newline, real or implied, of the last line) as line size()
+        if (from < to) {
+            add(from);
+            from = to + 1;
+        }
+        add(from);
+    }
+    return from;
+}
+
+size_t text_file::line_of(const char *p) const {
+    if (!p || p < base || p >= base + nbytes) { return size(); }
+    size_t off{ static_cast<size_t>(p - base) };
+    // the block, then the line in it
+    size_t b{ static_cast<size_t>(std::upper_bound(blocks.begin(),
+                                                   blocks.end(), off)
+                                  - blocks.begin()) - 1 };
+    auto first = offs.begin() + static_cast<std::ptrdiff_t>(b << block_bits);
+    auto last = offs.begin() + static_cast<std::ptrdiff_t>(
+        std::min(offs.size(), (b + 1) << block_bits));
+    auto i = std::upper_bound(first, last,
+                              static_cast<uint32_t>(off - blocks[b]));
+    return static_cast<size_t>(i - offs.begin()) - 1;
 }
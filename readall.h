@@ -2,6 +2,9 @@
 #define READALL_H
 #include <vector>
 #include <string>
+#include <ostream>
+#include <cstddef>
+#include <cstdint>
 
 /** \defgroup readall File reading utility
  * @{
@@ -20,6 +23,127 @@
  */
 long readall(std::string name, std::vector<std::string> &lines);
 
+//! Non-owning reference to a line of text (a minimal string_view)
+/**
+ * The referenced characters must outlive the line_view. The line does not
+ * include the terminating newline.
+ */
+class line_view {
+public:
+    line_view() : ptr{ nullptr }, len{ 0 } {}
+    //! refer to n characters starting at p
+    line_view(const char *p, size_t n) : ptr{ p }, len{ n } {}
+    //! refer to the contents of a string (implicit, like string_view)
+    line_view(const std::string &s) : ptr{ s.data() }, len{ s.size() } {}
+
+    const char *data() const { return ptr; }   //!< first character
+    size_t size() const { return len; }        //!< number of characters
+    size_t length() const { return len; }      //!< number of characters
+    bool empty() const { return len == 0; }    //!< true if no characters
+    char operator[](size_t i) const { return ptr[i]; } //!< unchecked access
+
+    //! part of the line (clipped at the end like std::string::substr)
+    line_view substr(size_t pos, size_t n = std::string::npos) const {
+        if (pos > len) { pos = len; }
+        if (n > len - pos) { n = len - pos; }
+        return line_view(ptr + pos, n);
+    }
+    //! copy of the characters as a string
+    std::string str() const { return std::string(ptr, len); }
+private:
+    const char *ptr; //!< first character
+    size_t len;      //!< number of characters
+};
+
+//! write the characters of a line_view to a stream
+inline std::ostream &operator<<(std::ostream &os, line_view l) {
+    return os.write(l.data(), static_cast<std::streamsize>(l.size()));
+}
+
+//! Contents of a text file with an index of line starts
+/**
+ * Regular files are memory mapped (or read through io_uring), other inputs
+ * (pipes, stdin) are read in large blocks into a single buffer. Compressed
+ * files (gzip, zstd; see codec_of_data()) are decompressed into that buffer
+ * on a thread of their own, and each block is indexed as soon as it has
+ * been decompressed. The start of each line is recorded in a compact index
+ * (a 32 bit offset per line from the start of its block of 4096 lines, and
+ * the file offset of each block), so individual lines are available as
+ * line_view records pointing into the file contents without any copying,
+ * at 4 bytes of index per line however large the file.
+ *
+ * Lines are split as by std::getline: the newline is not part of the line
+ * and a final line without newline is still a line.
+ */
+class text_file {
+public:
+    //! Read a file; "-" reads stdin
+    /**
+     * \param name file name to read
+     * \param uring read a regular file into memory through io_uring with
+     *     several reads in flight instead of mapping it (mapped anyway if
+     *     io_uring is not available)
+     * \param copy read a regular file into memory rather than mapping it,
+     *     so that the file may be overwritten while the lines are in use
+     *     (e.g. when it is also the output)
+     * \throw runtime_error if file cannot be opened/read or decompressed
+     */
+    explicit text_file(const std::string &name, bool uring = false,
+                       bool copy = false);
+    //! Index the lines of a buffer held by the caller (nothing is copied)
+    /**
+     * \param data contents of the file; must outlive the text_file
+     * \param n number of bytes
+     */
+    text_file(const char *data, size_t n);
+    ~text_file();
+
+    text_file(const text_file &) = delete;
+    text_file &operator=(const text_file &) = delete;
+
+    size_t size() const { return offs.size() - 1; } //!< number of lines
+
+    //! line i (unchecked), without newline
+    line_view operator[](size_t i) const {
+        size_t b{ start(i) };
+        return line_view(base + b, start(i + 1) - b - 1);
+    }
+
+    //! number of the line holding character p (size() if not in the file)
+    size_t line_of(const char *p) const;
+
+    const char *data() const { return base; } //!< file contents
+    size_t bytes() const { return nbytes; }   //!< size of the contents
+    bool mapped() const { return map != nullptr; } //!< true if mmap was used
+
+private:
+    const char *base;           //!< file contents
+    size_t nbytes;              //!< size of the contents
+    void *map;                  //!< address of the mapping (or nullptr)
+    std::vector<char> arena;    //!< buffer for input that cannot be mapped
+    std::vector<uint32_t> offs; //!< start of line i in its block; one extra
+    std::vector<size_t> blocks; //!< start of lines 4096 k to 4096 k + 4095
+
+    static const int block_bits{ 12 }; //!< 4096 lines per block
+
+    //! offset of the first character of line i
+    size_t start(size_t i) const { return blocks[i >> block_bits] + offs[i]; }
+
+    void read_fd(int fd, const std::string &name); //!< fill arena from fd
+    //! replace the contents by their decompressed form, and index it
+    void unpack(const std::string &name);
+    //! add lines to offs[] and blocks[]
+    /**
+     * \param from offset of the first line to add
+     * \param to end of the text so far: only lines ending before it are
+     *     added, unless last
+     * \param last the text ends at to: add all lines, and the end
+     * \return the start of the first line not added
+     * \throw runtime_error if a block of lines spans 4 GB or more
+     */
+    size_t index_lines(size_t from, size_t to, bool last);
+};
+
 /**@}*/
 
 #endif
@@ -0,0 +1,245 @@
+#include "stats.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+double process_cpu_time() {
+    timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) { return 0.0; }
+    return static_cast<double>(ts.tv_sec) + 1.0e-9 * ts.tv_nsec;
+}
+
+// counter for this process and the threads it starts later, or -1
+int open_counter(unsigned type, unsigned long long config) {
+#ifdef __linux__
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    long fd{ syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0) };
+    return static_cast<int>(fd);
+#else
+    (void)type;
+    (void)config;
+    return -1;
+#endif
+}
+
+long long read_counter(int fd) {
+    if (fd < 0) { return -1; }
+    long long v{ 0 };
+    if (read(fd, &v, sizeof(v)) != static_cast<ssize_t>(sizeof(v))) {
+        return -1;
+    }
+    return v;
+}
+
+std::string json_string(const std::string &s) {
+    std::string r{ "\"" };
+    for (char c: s) {
+        if (c == '"' || c == '\\') { r += '\\'; }
+        r += c;
+    }
+    return r + "\"";
+}
+
+} // namespace
+
+alloc_counters &allocation_counters() {
+    static alloc_counters c;
+    return c;
+}
+
+run_stats::run_stats(bool hw) : hw_fd{ -1, -1, -1 } {
+#ifdef __linux__
+    if (hw) {
+        hw_fd[0] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        hw_fd[1] = open_counter(PERF_TYPE_HARDWARE,
+                                PERF_COUNT_HW_INSTRUCTIONS);
+        hw_fd[2] = open_counter(PERF_TYPE_HARDWARE,
+                                PERF_COUNT_HW_CACHE_MISSES);
+        if (hw_fd[0] < 0) { // all or nothing
+            for (auto &fd: hw_fd) {
+                if (fd >= 0) { close(fd); }
+                fd = -1;
+            }
+        }
+    }
+#else
+    (void)hw;
+#endif
+    alloc_counters &a{ allocation_counters() };
+    alloc_start_count = a.count.load();
+    alloc_start_bytes = a.bytes.load();
+    a.active = true;
+    start = now();
+}
+
+run_stats::~run_stats() {
+    for (auto fd: hw_fd) {
+        if (fd >= 0) { close(fd); }
+    }
+}
+
+run_stats::sample run_stats::now() const {
+    sample s;
+    s.wall = std::chrono::steady_clock::now();
+    s.cpu = process_cpu_time();
+    for (int k = 0; k < 3; ++k) { s.hw[k] = read_counter(hw_fd[k]); }
+    return s;
+}
+
+run_stats::interval run_stats::elapsed(const sample &a, const sample &b) {
+    interval d;
+    d.wall = std::chrono::duration<double>(b.wall - a.wall).count();
+    d.cpu = b.cpu - a.cpu;
+    for (int k = 0; k < 3; ++k) {
+        d.hw[k] = (a.hw[k] >= 0 && b.hw[k] >= 0) ? b.hw[k] - a.hw[k] : -1;
+    }
+    return d;
+}
+
+void run_stats::add(const std::string &phase, const interval &d,
+                    size_t bytes, size_t lines, size_t waters) {
+    std::lock_guard<std::mutex> guard{ lock };
+    phase_stats *p{ nullptr };
+    for (auto &q: list) {
+        if (q.name == phase) { p = &q; break; }
+    }
+    if (!p) {
+        list.push_back(phase_stats());
+        p = &list.back();
+        p->name = phase;
+    }
+    ++p->calls;
+    p->wall += d.wall;
+    p->cpu += d.cpu;
+    p->bytes += bytes;
+    p->lines += lines;
+    p->waters += waters;
+    long long *hw[3]{ &p->cycles, &p->instructions, &p->cache_misses };
+    for (int k = 0; k < 3; ++k) {
+        if (d.hw[k] >= 0) { *hw[k] = std::max(*hw[k], 0ll) + d.hw[k]; }
+    }
+}
+
+void run_stats::finish() {
+    sample end{ now() };
+    total_wall = std::chrono::duration<double>(end.wall - start.wall).count();
+    total_cpu = end.cpu - start.cpu;
+    rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        peak_rss = ru.ru_maxrss; // kB on Linux
+    }
+    alloc_counters &a{ allocation_counters() };
+    a.active = false;
+    if (a.hooked) {
+        alloc_count = static_cast<long long>(a.count - alloc_start_count);
+        alloc_bytes = static_cast<long long>(a.bytes - alloc_start_bytes);
+    }
+}
+
+phase_timer::~phase_timer() {
+    if (!stats) { return; }
+    run_stats::interval d{ run_stats::elapsed(start, stats->now()) };
+    d.wall -= nested.wall;
+    d.cpu -= nested.cpu;
+    for (int k = 0; k < 3; ++k) {
+        if (d.hw[k] >= 0 && nested.hw[k] >= 0) { d.hw[k] -= nested.hw[k]; }
+    }
+    stats->add(name, d, bytes, lines, waters);
+    if (encl) { // whole time of this phase, including its nested ones
+        encl->nested.wall += d.wall + nested.wall;
+        encl->nested.cpu += d.cpu + nested.cpu;
+        for (int k = 0; k < 3; ++k) {
+            if (d.hw[k] >= 0) {
+                encl->nested.hw[k] = std::max(encl->nested.hw[k], 0ll)
+                                     + d.hw[k] + std::max(nested.hw[k], 0ll);
+            }
+        }
+    }
+}
+
+std::vector<phase_stats> run_stats::phases() const {
+    std::lock_guard<std::mutex> guard{ lock };
+    return list;
+}
+
+void run_stats::write(std::ostream &os) const {
+    char b[256];
+    std::snprintf(b, sizeof(b), "%-12s %9s %9s %10s %11s %9s %10s\n",
+                  "phase", "wall(s)", "cpu(s)", "MB", "lines", "waters",
+                  "MB/s");
+    os << b;
+    for (const auto &p: phases()) {
+        std::snprintf(b, sizeof(b),
+                      "%-12s %9.4f %9.4f %10.2f %11zu %9zu %10.1f\n",
+                      p.name.c_str(), p.wall, p.cpu, p.bytes / 1.0e6,
+                      p.lines, p.waters,
+                      p.wall > 0.0 ? p.bytes / p.wall / 1.0e6 : 0.0);
+        os << b;
+        if (p.cycles >= 0) {
+            std::snprintf(b, sizeof(b),
+                          "%-12s cycles %lld, instructions %lld, "
+                          "cache misses %lld\n", "", p.cycles,
+                          p.instructions, p.cache_misses);
+            os << b;
+        }
+    }
+    std::snprintf(b, sizeof(b), "%-12s %9.4f %9.4f\n", "total", total_wall,
+                  total_cpu);
+    os << b;
+    os << fast_path << " waters copied unchanged (fast path)\n";
+    os << "peak RSS " << peak_rss << " kB";
+    if (alloc_count >= 0) {
+        os << ", " << alloc_count << " allocations (" << alloc_bytes
+           << " bytes)";
+    }
+    os << "\n";
+}
+
+void run_stats::write_json(std::ostream &os) const {
+    char b[512];
+    os << "{\n  \"phases\": [\n";
+    std::vector<phase_stats> ps{ phases() };
+    for (size_t i = 0; i < ps.size(); ++i) {
+        const phase_stats &p{ ps[i] };
+        std::snprintf(b, sizeof(b),
+                      "    {\"phase\": %s, \"calls\": %zu, \"wall_s\": %.6f, "
+                      "\"cpu_s\": %.6f, \"bytes\": %zu, \"lines\": %zu, "
+                      "\"waters\": %zu",
+                      json_string(p.name).c_str(), p.calls, p.wall, p.cpu,
+                      p.bytes, p.lines, p.waters);
+        os << b;
+        if (p.cycles >= 0) {
+            std::snprintf(b, sizeof(b),
+                          ", \"cycles\": %lld, \"instructions\": %lld, "
+                          "\"cache_misses\": %lld", p.cycles,
+                          p.instructions, p.cache_misses);
+            os << b;
+        }
+        os << "}" << (i + 1 < ps.size() ? "," : "") << "\n";
+    }
+    std::snprintf(b, sizeof(b),
+                  "  ],\n  \"wall_s\": %.6f,\n  \"cpu_s\": %.6f,\n"
+                  "  \"fast_path_waters\": %zu,\n"
+                  "  \"peak_rss_kb\": %ld,\n  \"allocations\": %lld,\n"
+                  "  \"allocated_bytes\": %lld\n}\n",
+                  total_wall, total_cpu, fast_path.load(), peak_rss,
+                  alloc_count, alloc_bytes);
+    os << b;
+}
@@ -0,0 +1,162 @@
+#ifndef STATS_H
+#define STATS_H
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/** \defgroup stats Run statistics
+ * Optional measurements of the phases of a conversion. Functions taking a
+ * run_stats pointer record nothing (and cost nothing but a test) when it is
+ * nullptr. A phase may be entered many times (e.g. once per frame); its
+ * values are summed. With several threads, phases of different frames may
+ * overlap, so their wall times can add up to more than the total.
+ * @{
+ */
+
+//! Measurements of one phase
+struct phase_stats {
+    std::string name;       //!< name of the phase
+    size_t calls{ 0 };      //!< number of times the phase was entered
+    double wall{ 0.0 };     //!< wall clock time (s)
+    double cpu{ 0.0 };      //!< CPU time of the process, all threads (s)
+    size_t bytes{ 0 };      //!< bytes read or written
+    size_t lines{ 0 };      //!< lines read or written
+    size_t waters{ 0 };     //!< water molecules handled
+    long long cycles{ -1 };       //!< CPU cycles (-1: not measured)
+    long long instructions{ -1 }; //!< instructions (-1: not measured)
+    long long cache_misses{ -1 }; //!< cache misses (-1: not measured)
+};
+
+//! Statistics of a whole run
+class run_stats {
+public:
+    //! Start the clocks
+    /**
+     * \param hw_counters try to use hardware counters (perf_event_open,
+     *     Linux only); see hw_counters()
+     */
+    explicit run_stats(bool hw_counters = false);
+    ~run_stats();
+    run_stats(const run_stats &) = delete;
+    run_stats &operator=(const run_stats &) = delete;
+
+    //! Values of the clocks and counters at one point in time
+    struct sample {
+        std::chrono::steady_clock::time_point wall; //!< wall clock
+        double cpu;      //!< CPU time of the process (s)
+        long long hw[3]; //!< hardware counters (-1: not measured)
+    };
+    //! Time and counts between two samples
+    struct interval {
+        double wall{ 0.0 };                //!< wall clock time (s)
+        double cpu{ 0.0 };                 //!< CPU time (s)
+        long long hw[3]{ -1, -1, -1 };     //!< hardware counts
+    };
+    sample now() const; //!< read the clocks and counters
+    //! difference between two samples
+    static interval elapsed(const sample &a, const sample &b);
+
+    //! add a measurement to a phase (thread safe)
+    void add(const std::string &phase, const interval &d, size_t bytes,
+             size_t lines, size_t waters);
+    //! count waters copied unchanged, without conversion (thread safe)
+    void add_fast_path(size_t waters) { fast_path += waters; }
+
+    //! stop the clocks and read peak memory and allocation counts
+    void finish();
+
+    std::vector<phase_stats> phases() const; //!< phases in order of entry
+    double wall() const { return total_wall; } //!< whole run (s)
+    double cpu() const { return total_cpu; }   //!< whole run (s)
+    long peak_rss_kb() const { return peak_rss; } //!< peak resident set (kB)
+    //! number of allocations (-1 if they could not be counted)
+    long long allocations() const { return alloc_count; }
+    //! bytes allocated (-1 if they could not be counted)
+    long long allocated_bytes() const { return alloc_bytes; }
+    bool hw_counters() const { return hw_fd[0] >= 0; } //!< counters used
+    //! waters copied unchanged because they already had the model geometry
+    size_t fast_path_waters() const { return fast_path; }
+
+    //! write a table for humans
+    void write(std::ostream &os) const;
+    //! write a JSON object
+    void write_json(std::ostream &os) const;
+
+private:
+    mutable std::mutex lock;
+    std::vector<phase_stats> list;
+    std::atomic<size_t> fast_path{ 0 };
+    int hw_fd[3];
+    sample start;
+    double total_wall{ 0.0 };
+    double total_cpu{ 0.0 };
+    long peak_rss{ 0 };
+    size_t alloc_start_count{ 0 };
+    size_t alloc_start_bytes{ 0 };
+    long long alloc_count{ -1 };
+    long long alloc_bytes{ -1 };
+};
+
+//! Measures one phase from construction to destruction
+/**
+ * Does nothing if the run_stats pointer is nullptr. The time of a nested
+ * phase can be taken out of the enclosing one (see the constructor).
+ */
+class phase_timer {
+public:
+    //! Start measuring
+    /**
+     * \param s where to record (may be nullptr)
+     * \param phase name of the phase
+     * \param outer enclosing phase on the same thread, whose measurement
+     *     does not include this one (may be nullptr)
+     */
+    phase_timer(run_stats *s, const char *phase,
+                phase_timer *outer = nullptr) :
+        stats(s), name(phase), encl(outer) {
+        if (stats) { start = stats->now(); }
+    }
+    ~phase_timer();
+    phase_timer(const phase_timer &) = delete;
+    phase_timer &operator=(const phase_timer &) = delete;
+
+    //! count data handled in the phase
+    void count(size_t b, size_t l, size_t w = 0) {
+        bytes += b;
+        lines += l;
+        waters += w;
+    }
+
+private:
+    run_stats *stats;
+    const char *name;
+    phase_timer *encl;
+    run_stats::sample start{};
+    run_stats::interval nested{}; //!< time of nested phases
+    size_t bytes{ 0 };
+    size_t lines{ 0 };
+    size_t waters{ 0 };
+};
+
+//! Counters of memory allocations
+/**
+ * They are only updated if the replacement operator new of alloc_count.cpp
+ * is linked into the program (then hooked is true), and only while active.
+ */
+struct alloc_counters {
+    std::atomic<bool> active{ false }; //!< count allocations now
+    std::atomic<size_t> count{ 0 };    //!< number of allocations
+    std::atomic<size_t> bytes{ 0 };    //!< bytes allocated
+    bool hooked{ false };              //!< operator new counts allocations
+};
+
+//! the allocation counters of the program
+alloc_counters &allocation_counters();
+
+/**@}*/
+
+#endif
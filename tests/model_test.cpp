@@ -0,0 +1,67 @@
+// checks of the water model transforms (run by ctest)
+#include "model.h"
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int failures{ 0 };
+
+void check(bool ok, const std::string &what) {
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++failures;
+    }
+}
+
+// the compatibility transform() with a loaded model of max_extra_sites
+// extra sites returns all of them, the same as transform(w, extra)
+void test_transform_all_sites() {
+    std::istringstream def{
+        "model test4\n"
+        "rOH 0.9572\n"
+        "angle 104.52\n"
+        "site M1 0.15 0.0 0.0\n"
+        "site M2 -0.1 0.0 0.2\n"
+        "site M3 -0.1 0.0 -0.2\n"
+        "site M4 0.05 0.1 0.0\n" };
+    check(model::load(def, "test4") == 1, "load a model of 4 extra sites");
+    model m;
+    check(m.initialise("test4"), "initialise the loaded model");
+    check(m.size() == 3 + max_extra_sites, "size of the loaded model");
+
+    double xO{ 1.0 }, yO{ 2.0 }, zO{ 3.0 };
+    double x1{ 1.95 }, y1{ 2.05 }, z1{ 3.0 };
+    double x2{ 0.8 }, y2{ 2.9 }, z2{ 3.1 };
+    double w[9]{ xO, yO, zO, x1, y1, z1, x2, y2, z2 };
+    double extra[3 * max_extra_sites];
+    check(m.transform(w, extra), "transform(w, extra)");
+
+    std::vector<double> e{ m.transform(xO, yO, zO, x1, y1, z1, x2, y2,
+                                       z2) };
+    check(e.size() == 3 * max_extra_sites, "number of extra coordinates");
+    for (size_t k = 0; k < e.size() && k < 3 * max_extra_sites; ++k) {
+        check(e[k] == extra[k], "extra coordinate " + std::to_string(k));
+    }
+    double h[6]{ x1, y1, z1, x2, y2, z2 };
+    for (int k = 0; k < 6; ++k) {
+        check(h[k] == w[3 + k], "H coordinate " + std::to_string(k));
+    }
+    check(std::fabs(std::sqrt((x1 - xO) * (x1 - xO) + (y1 - yO) * (y1 - yO)
+                              + (z1 - zO) * (z1 - zO)) - 0.9572) < 1e-9,
+          "O-H distance");
+}
+
+} // namespace
+
+int main() {
+    test_transform_all_sites();
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,310 @@
+#include "uring.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef WATCOR_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+namespace {
+
+const unsigned depth{ 8 };             // requests in flight
+const size_t read_block{ 4 << 20 };    // bytes per read
+const size_t write_block{ 2 << 20 };   // bytes per write
+
+std::string error_text(const std::string &what, const std::string &name,
+                       int err) {
+    return what + " '" + name + "': " + strerror(err);
+}
+
+} // namespace
+
+#ifdef WATCOR_HAVE_IO_URING
+
+io_ring::io_ring(unsigned entries) {
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+    if (fd < 0) {
+        throw(std::runtime_error(std::string("io_uring: ") + strerror(errno)));
+    }
+
+    // the two rings share one mapping if the kernel allows it
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single{ (p.features & IORING_FEAT_SINGLE_MMAP) != 0 };
+    if (single) { sq_size = cq_size = std::max(sq_size, cq_size); }
+    sqe_size = p.sq_entries * sizeof(io_uring_sqe);
+    void *sq{ mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING) };
+    void *cq{ single ? sq : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, fd,
+                                 IORING_OFF_CQ_RING) };
+    void *sqe{ mmap(nullptr, sqe_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES) };
+    if (sq != MAP_FAILED) { sq_map = sq; }
+    if (!single && cq != MAP_FAILED) { cq_map = cq; }
+    if (sqe != MAP_FAILED) { sqe_map = sqe; }
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqe == MAP_FAILED) {
+        int err{ errno };
+        release();
+        throw(std::runtime_error(std::string("io_uring: ") + strerror(err)));
+    }
+
+    char *s{ static_cast<char *>(sq) };
+    char *c{ static_cast<char *>(cq) };
+    sq_tail = reinterpret_cast<unsigned *>(s + p.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(s + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(s + p.sq_off.array);
+    cq_head = reinterpret_cast<unsigned *>(c + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(c + p.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(c + p.cq_off.ring_mask);
+    cqes = c + p.cq_off.cqes;
+}
+
+io_ring::~io_ring() {
+    release();
+}
+
+void io_ring::release() {
+    if (sqe_map) { munmap(sqe_map, sqe_size); }
+    if (cq_map) { munmap(cq_map, cq_size); }
+    if (sq_map) { munmap(sq_map, sq_size); }
+    if (fd >= 0) { close(fd); }
+    sqe_map = cq_map = sq_map = nullptr;
+    fd = -1;
+}
+
+bool io_ring::available() {
+    static const bool ok{ [] {
+        try {
+            io_ring r{ 1 };
+            return true;
+        }
+        catch (const std::runtime_error &) {
+            return false;
+        }
+    }() };
+    return ok;
+}
+
+void io_ring::queue(int op, int file, const char *p, size_t n, uint64_t off,
+                    uint64_t tag) {
+    // only this thread writes the tail; the kernel reads it
+    unsigned tail{ *sq_tail };
+    unsigned i{ tail & *sq_mask };
+    io_uring_sqe *e{ static_cast<io_uring_sqe *>(sqe_map) + i };
+    std::memset(e, 0, sizeof(*e));
+    e->opcode = static_cast<uint8_t>(op);
+    e->fd = file;
+    e->addr = reinterpret_cast<uint64_t>(p);
+    e->len = static_cast<uint32_t>(n);
+    e->off = off;
+    e->user_data = tag;
+    sq_array[i] = i;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++queued;
+}
+
+void io_ring::read(int file, char *p, size_t n, uint64_t off, uint64_t tag) {
+    queue(IORING_OP_READ, file, p, n, off, tag);
+}
+
+void io_ring::write(int file, const char *p, size_t n, uint64_t off,
+                    uint64_t tag) {
+    queue(IORING_OP_WRITE, file, p, n, off, tag);
+}
+
+long io_ring::wait(uint64_t &tag) {
+    for (;;) {
+        unsigned head{ *cq_head };
+        if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe *e{ static_cast<const io_uring_cqe *>(cqes)
+                                   + (head & *cq_mask) };
+            tag = e->user_data;
+            long r{ e->res };
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            return r;
+        }
+        long r{ syscall(__NR_io_uring_enter, fd, queued, 1,
+                        IORING_ENTER_GETEVENTS, nullptr, 0) };
+        if (r < 0) {
+            if (errno == EINTR) { continue; }
+            throw(std::runtime_error(std::string("io_uring: ")
+                                     + strerror(errno)));
+        }
+        queued -= std::min(queued, static_cast<unsigned>(r));
+    }
+}
+
+#else
+
+io_ring::io_ring(unsigned) {
+    throw(std::runtime_error("io_uring: not supported by this build"));
+}
+
+io_ring::~io_ring() {}
+
+void io_ring::release() {}
+
+bool io_ring::available() { return false; }
+
+void io_ring::queue(int, int, const char *, size_t, uint64_t, uint64_t) {}
+
+void io_ring::read(int, char *, size_t, uint64_t, uint64_t) {}
+
+void io_ring::write(int, const char *, size_t, uint64_t, uint64_t) {}
+
+long io_ring::wait(uint64_t &) { return -ENOSYS; }
+
+#endif
+
+bool uring_read(int fd, char *p, size_t n, const std::string &name) {
+    if (n == 0) { return true; }
+    if (!io_ring::available()) { return false; }
+    io_ring ring{ depth };
+
+    // request k reads [start[k], start[k] + len[k]), the rest of its block
+    // after a short read; a new block once it is done
+    uint64_t start[depth];
+    size_t len[depth];
+    size_t next{ 0 };   // first byte not requested yet
+    unsigned busy{ 0 }; // requests in flight
+    int error{ 0 };     // first error (errno)
+    auto issue = [&](unsigned k) {
+        ring.read(fd, p + start[k], len[k], start[k], k);
+    };
+    for (unsigned k = 0; k < depth && next < n; ++k, ++busy) {
+        start[k] = next;
+        len[k] = std::min(read_block, n - next);
+        next += len[k];
+        issue(k);
+    }
+    // all requests are waited for, even after an error: the kernel writes
+    // into p until they complete
+    while (busy > 0) {
+        uint64_t k;
+        long r{ ring.wait(k) };
+        if (r == -EINTR || r == -EAGAIN) {
+            issue(static_cast<unsigned>(k));
+            continue;
+        }
+        if (r <= 0 && !error) { error = r < 0 ? static_cast<int>(-r) : EIO; }
+        if (r > 0) {
+            start[k] += static_cast<uint64_t>(r);
+            len[k] -= static_cast<size_t>(r);
+        }
+        if (!error && len[k] > 0) {
+            issue(static_cast<unsigned>(k));
+        } else if (!error && next < n) {
+            start[k] = next;
+            len[k] = std::min(read_block, n - next);
+            next += len[k];
+            issue(static_cast<unsigned>(k));
+        } else {
+            --busy;
+        }
+    }
+    if (error) {
+        throw(std::runtime_error(error_text("error while reading", name,
+                                            error)));
+    }
+    return true;
+}
+
+uring_buffer::uring_buffer(const std::string &name) :
+    file{ name }, fd{ -1 }, ring{ depth }, blocks(depth) {
+    fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        throw(std::runtime_error(error_text("cannot open", name, errno)));
+    }
+    blocks[0].data.resize(write_block);
+    setp(blocks[0].data.data(), blocks[0].data.data() + write_block);
+}
+
+uring_buffer::~uring_buffer() {
+    try {
+        finish();
+    }
+    catch (...) {}
+}
+
+void uring_buffer::submit(size_t i) {
+    block &b{ blocks[i] };
+    ring.write(fd, b.data.data() + b.done, b.size - b.done,
+               b.offset + b.done, i);
+}
+
+void uring_buffer::complete() {
+    uint64_t i;
+    long r{ ring.wait(i) };
+    block &b{ blocks[i] };
+    if (r == -EINTR || r == -EAGAIN) {
+        submit(i);
+        return;
+    }
+    if (r <= 0) {
+        if (!error) { error = r < 0 ? static_cast<int>(-r) : EIO; }
+        b.size = 0;
+        return;
+    }
+    b.done += static_cast<size_t>(r);
+    if (b.done < b.size) {
+        submit(i); // short write: the rest
+    } else {
+        b.size = 0;
+    }
+}
+
+bool uring_buffer::hand_over() {
+    size_t n{ static_cast<size_t>(pptr() - pbase()) };
+    if (n > 0 && !error) {
+        block &b{ blocks[current] };
+        b.offset = offset;
+        b.size = n;
+        b.done = 0;
+        offset += n;
+        submit(current);
+        current = (current + 1) % blocks.size();
+        while (blocks[current].size > 0) { complete(); }
+        std::vector<char> &d{ blocks[current].data };
+        if (d.empty()) { d.resize(write_block); } // blocks made as needed
+        setp(d.data(), d.data() + d.size());
+    }
+    return !error;
+}
+
+uring_buffer::int_type uring_buffer::overflow(int_type c) {
+    if (!hand_over()) { return traits_type::eof(); }
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+int uring_buffer::sync() {
+    return hand_over() ? 0 : -1;
+}
+
+void uring_buffer::finish() {
+    if (fd < 0) { return; }
+    hand_over();
+    for (;;) {
+        bool busy{ false };
+        for (const auto &b: blocks) { busy = busy || b.size > 0; }
+        if (!busy) { break; }
+        complete();
+    }
+    if (close(fd) != 0 && !error) { error = errno; }
+    fd = -1;
+    setp(nullptr, nullptr);
+    if (error) {
+        throw(std::runtime_error(error_text("error writing", file, error)));
+    }
+}
@@ -0,0 +1,147 @@
+#ifndef URING_H
+#define URING_H
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+/** \defgroup uring Asynchronous file I/O
+ * Reading and writing large files through Linux io_uring, with several
+ * large requests in flight, so that the storage (a parallel file system in
+ * particular) is kept busy while the program waits or computes. The ring is
+ * driven by raw system calls (no liburing). Where io_uring is not compiled
+ * in or the kernel refuses it (old kernels, seccomp filters), available()
+ * is false and the callers use plain reads and writes instead.
+ * @{
+ */
+
+//! An io_uring instance (submission and completion queue)
+class io_ring {
+public:
+    //! Set up a ring for up to entries requests in flight
+    /** \throw std::runtime_error if io_uring is not available */
+    explicit io_ring(unsigned entries);
+    ~io_ring();
+
+    io_ring(const io_ring &) = delete;
+    io_ring &operator=(const io_ring &) = delete;
+
+    //! true if io_uring can be used (checked once)
+    static bool available();
+
+    //! queue a read of n bytes at offset off of fd into p
+    void read(int fd, char *p, size_t n, uint64_t off, uint64_t tag);
+    //! queue a write of n bytes from p at offset off of fd
+    void write(int fd, const char *p, size_t n, uint64_t off, uint64_t tag);
+
+    //! Submit the queued requests and wait for one to complete
+    /**
+     * \param[out] tag the tag of the request
+     * \return its result: bytes transferred or -errno
+     * \throw std::runtime_error if the ring itself fails
+     */
+    long wait(uint64_t &tag);
+
+private:
+    int fd{ -1 };
+    void *sq_map{ nullptr };   //!< submission ring (and completion ring)
+    size_t sq_size{ 0 };
+    void *cq_map{ nullptr };   //!< completion ring, if mapped separately
+    size_t cq_size{ 0 };
+    void *sqe_map{ nullptr };  //!< submission queue entries
+    size_t sqe_size{ 0 };
+    unsigned *sq_tail{ nullptr };
+    unsigned *sq_mask{ nullptr };
+    unsigned *sq_array{ nullptr };
+    unsigned *cq_head{ nullptr };
+    unsigned *cq_tail{ nullptr };
+    unsigned *cq_mask{ nullptr };
+    void *cqes{ nullptr };     //!< completion queue entries
+    unsigned queued{ 0 };      //!< requests not submitted yet
+
+    void release();            //!< unmap and close
+
+    void queue(int op, int fd, const char *p, size_t n, uint64_t off,
+               uint64_t tag);
+};
+
+//! Read the first n bytes of a file into p with several reads in flight
+/**
+ * \param fd the file (a regular file)
+ * \param p destination
+ * \param n number of bytes (the size of the file)
+ * \param name file name for error messages
+ * \return false if io_uring is not available (nothing read)
+ * \throw std::runtime_error on a read error or if the file is shorter
+ */
+bool uring_read(int fd, char *p, size_t n, const std::string &name);
+
+//! Stream buffer writing a file through io_uring
+/**
+ * Output is collected in blocks of 2 MB; a full block is written while the
+ * next one is filled, with up to 8 blocks in flight. The file is only
+ * complete after finish().
+ */
+class uring_buffer: public std::streambuf {
+public:
+    //! Create (or truncate) a file
+    /**
+     * \param name file name
+     * \throw std::runtime_error if the file cannot be opened or io_uring
+     *     is not available
+     */
+    explicit uring_buffer(const std::string &name);
+    ~uring_buffer(); //!< finish(), errors ignored
+
+    uring_buffer(const uring_buffer &) = delete;
+    uring_buffer &operator=(const uring_buffer &) = delete;
+
+    //! Write what is left, wait for all writes and close the file
+    /** \throw std::runtime_error if a write failed */
+    void finish();
+
+protected:
+    int_type overflow(int_type c) override;
+    int sync() override;
+
+private:
+    //! a block of output and the write it is in
+    struct block {
+        std::vector<char> data;
+        uint64_t offset{ 0 }; //!< file offset of the block
+        size_t size{ 0 };     //!< bytes to write (0: not in flight)
+        size_t done{ 0 };     //!< bytes written so far
+    };
+
+    std::string file;
+    int fd;
+    io_ring ring;
+    std::vector<block> blocks;
+    size_t current{ 0 };       //!< block in the put area
+    uint64_t offset{ 0 };      //!< file offset of the put area
+    int error{ 0 };            //!< first write error (errno)
+
+    bool hand_over();          //!< write the put area, take the next block
+    void complete();           //!< wait for one write to complete
+    void submit(size_t i);     //!< (re)queue the rest of block i
+};
+
+//! Output stream writing a file through io_uring (see uring_buffer)
+class uring_ostream: public std::ostream {
+public:
+    //! \copydoc uring_buffer::uring_buffer
+    explicit uring_ostream(const std::string &name) :
+        std::ostream(nullptr), buf(name) {
+        rdbuf(&buf);
+    }
+    //! \copydoc uring_buffer::finish
+    void finish() { buf.finish(); }
+private:
+    uring_buffer buf;
+};
+
+/**@}*/
+
+#endif
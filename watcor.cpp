@@ -0,0 +1,305 @@
+#include "watcor.h"
+#include "watcor_c.h"
+#include "gro.h"
+#include "membuf.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <new>
+#include <ostream>
+
+namespace {
+
+// atom count from the second line of a converted file (0 if not there)
+size_t count_line(const char *p, size_t n) {
+    const char *nl{ static_cast<const char *>(std::memchr(p, '\n', n)) };
+    if (!nl) { return 0; }
+    ++nl;
+    return static_cast<size_t>(std::strtoul(std::string(nl,
+        std::find(nl, p + n, '\n')).c_str(), nullptr, 10));
+}
+
+// convert data into os; fills in all of r but atoms and bytes
+void convert_to(const char *data, size_t size, const model &wm,
+                std::ostream &os, int threads, watcor::result &r) {
+    text_file lines{ data, size };
+    try {
+        if (lines.size() < 1) {
+            r.error = "input is empty";
+            return;
+        }
+        r.waters = static_cast<long>(process_gro(os, lines, wm, threads));
+        r.ok = true;
+    }
+    catch (const gro_error &e) {
+        r.error = e.what();
+        r.error_line = lines.line_of(e.where()) + 1;
+    }
+    catch (const water_error &e) {
+        r.error = e.what();
+        r.error_line = lines.line_of(e.where()) + 1;
+    }
+    catch (const std::bad_alloc &) {
+        throw;
+    }
+    catch (const std::exception &e) {
+        r.error = e.what();
+    }
+    if (r.error_line > lines.size()) { r.error_line = 0; } // not known
+}
+
+// convert the atoms of layout wl into arrays with room for all of them
+watcor::result convert_layout(const water_layout &wl,
+                              const char *const *names, const double *xyz,
+                              const model &wm, const char **out_names,
+                              double *out_xyz, size_t *out_origin) {
+    watcor::result r;
+    int model_size{ wm.size() };
+    size_t nw{ wl.first.size() };
+    r.atoms = wl.output_atoms(model_size);
+
+    // idealise all waters in one batch (Angstrom, as for gro files)
+    std::vector<double> c[9];
+    std::vector<double> ext[3 * max_extra_sites];
+    for (int k = 0; k < 9; ++k) {
+        c[k].resize(nw);
+        for (size_t j = 0; j < nw; ++j) {
+            c[k][j] = xyz[3 * (wl.first[j] + k / 3) + k % 3] * 10.0;
+        }
+    }
+    for (int k = 0; k < 3 * (model_size - 3); ++k) { ext[k].resize(nw); }
+    std::vector<unsigned char> bad(nw);
+    if (nw > 0) {
+        site_arrays O{ &c[0][0], &c[1][0], &c[2][0] };
+        site_arrays H1{ &c[3][0], &c[4][0], &c[5][0] };
+        site_arrays H2{ &c[6][0], &c[7][0], &c[8][0] };
+        site_arrays extra[max_extra_sites];
+        for (int k = 0; k < max_extra_sites; ++k) {
+            extra[k] = site_arrays{ ext[3*k].data(), ext[3*k+1].data(),
+                                     ext[3*k+2].data() };
+        }
+        if (wm.transform(nw, O, H1, H2, extra, bad.data()) > 0) {
+            size_t j{ 0 };
+            while (!bad[j]) { ++j; }
+            r.error = "bad input water structure";
+            r.error_line = wl.first[j] + 1;
+            return r;
+        }
+    }
+
+    // the atoms in order, with the new waters in place of the old ones
+    size_t o{ 0 }; // next output atom
+    auto put = [&](const char *name, size_t from, double x, double y,
+                   double z) {
+        out_names[o] = name;
+        out_xyz[3 * o] = x;
+        out_xyz[3 * o + 1] = y;
+        out_xyz[3 * o + 2] = z;
+        if (out_origin) { out_origin[o] = from; }
+        ++o;
+    };
+    size_t j{ 0 }; // next water
+    for (size_t i = 0; i < wl.natoms; ) {
+        if (j < nw && wl.first[j] == i) {
+            // O does not move: copy it, as scaling it back to nm could
+            // change its last bit
+            put(names[i], i, xyz[3 * i], xyz[3 * i + 1], xyz[3 * i + 2]);
+            for (int a = 1; a < 3; ++a) {
+                put(names[i + a], i + a, c[3*a][j] / 10.0,
+                    c[3*a+1][j] / 10.0, c[3*a+2][j] / 10.0);
+            }
+            for (int k = 0; k < model_size - 3; ++k) {
+                put(wm.extra_name(k), i + 2, ext[3*k][j] / 10.0,
+                    ext[3*k+1][j] / 10.0, ext[3*k+2][j] / 10.0);
+            }
+            i += wl.sites[j];
+            ++j;
+        } else {
+            put(names[i], i, xyz[3 * i], xyz[3 * i + 1], xyz[3 * i + 2]);
+            ++i;
+        }
+    }
+    r.waters = static_cast<long>(nw);
+    r.ok = true;
+    return r;
+}
+
+} // namespace
+
+namespace watcor {
+
+result convert(const char *data, size_t size, const model &wm,
+               std::string &out, int threads) {
+    result r;
+    out.clear();
+    string_buffer sb{ out };
+    std::ostream os{ &sb };
+    convert_to(data, size, wm, os, threads, r);
+    r.bytes = out.size();
+    if (r.ok) { r.atoms = count_line(out.data(), out.size()); }
+    return r;
+}
+
+result convert(const char *data, size_t size, const model &wm, char *out,
+               size_t capacity, int threads) {
+    result r;
+    array_buffer ab{ out, capacity };
+    std::ostream os{ &ab };
+    convert_to(data, size, wm, os, threads, r);
+    r.bytes = ab.needed();
+    if (r.ok && ab.overflowed()) {
+        r.ok = false;
+        r.error = "output buffer too small";
+    }
+    if (r.ok) { r.atoms = count_line(out, r.bytes); }
+    return r;
+}
+
+result convert_atoms(size_t n, const char *const *names, const double *xyz,
+                     const model &wm, atom_arrays &out) {
+    water_layout wl{ find_waters(names, n) };
+    size_t m{ wl.output_atoms(wm.size()) };
+    out.names.resize(m);
+    out.xyz.resize(3 * m);
+    out.origin.resize(m);
+    return convert_layout(wl, names, xyz, wm, out.names.data(),
+                          out.xyz.data(), out.origin.data());
+}
+
+} // namespace watcor
+
+// C interface
+
+struct watcor_model {
+    model m;
+};
+
+namespace {
+
+// copy a result for C callers
+int c_result(const watcor::result &r, watcor_result *c) {
+    if (c) {
+        c->ok = r.ok ? 1 : 0;
+        c->waters = r.waters;
+        c->atoms = r.atoms;
+        c->bytes = r.bytes;
+        c->error_line = r.error_line;
+        std::strncpy(c->error, r.error.c_str(), sizeof(c->error) - 1);
+        c->error[sizeof(c->error) - 1] = '\0';
+    }
+    return r.ok ? 0 : -1;
+}
+
+// result for an exception escaping to a C caller
+int c_failure(const char *what, watcor_result *c) {
+    watcor::result r;
+    r.error = what;
+    return c_result(r, c);
+}
+
+} // namespace
+
+extern "C" {
+
+watcor_model *watcor_model_new(const char *name) {
+    try {
+        watcor_model *m{ new watcor_model };
+        if (!name || !m->m.initialise(std::string(name))) {
+            delete m;
+            return nullptr;
+        }
+        return m;
+    }
+    catch (...) {
+        return nullptr;
+    }
+}
+
+void watcor_model_free(watcor_model *m) {
+    delete m;
+}
+
+int watcor_model_size(const watcor_model *m) {
+    return m ? m->m.size() : 0;
+}
+
+int watcor_load_models(const char *file, watcor_result *r) {
+    try {
+        std::ifstream is{ file };
+        if (!is.good()) {
+            return c_failure((std::string("cannot open '") + file + "': "
+                              + std::strerror(errno)).c_str(), r);
+        }
+        model::load(is, file);
+        watcor::result ok;
+        ok.ok = true;
+        return c_result(ok, r);
+    }
+    catch (const std::exception &e) {
+        return c_failure(e.what(), r);
+    }
+}
+
+int watcor_convert(const watcor_model *m, const char *data, size_t size,
+                   char *out, size_t capacity, int threads,
+                   watcor_result *r) {
+    try {
+        return c_result(watcor::convert(data, size, m->m, out, capacity,
+                                        threads), r);
+    }
+    catch (const std::exception &e) {
+        return c_failure(e.what(), r);
+    }
+}
+
+int watcor_convert_alloc(const watcor_model *m, const char *data,
+                         size_t size, char **out, int threads,
+                         watcor_result *r) {
+    *out = nullptr;
+    try {
+        std::string s;
+        watcor::result res{ watcor::convert(data, size, m->m, s, threads) };
+        if (res.ok) {
+            char *p{ static_cast<char *>(std::malloc(s.size() + 1)) };
+            if (!p) { throw std::bad_alloc(); }
+            std::memcpy(p, s.data(), s.size());
+            p[s.size()] = '\0';
+            *out = p;
+        }
+        return c_result(res, r);
+    }
+    catch (const std::exception &e) {
+        return c_failure(e.what(), r);
+    }
+}
+
+void watcor_free(void *p) {
+    std::free(p);
+}
+
+int watcor_convert_atoms(const watcor_model *m, size_t n,
+                         const char *const *names, const double *xyz,
+                         size_t capacity, const char **out_names,
+                         double *out_xyz, size_t *out_origin,
+                         watcor_result *r) {
+    try {
+        water_layout wl{ find_waters(names, n) };
+        size_t need{ wl.output_atoms(m->m.size()) };
+        if (need > capacity) {
+            watcor::result res;
+            res.atoms = need;
+            res.error = "output arrays too small";
+            return c_result(res, r);
+        }
+        return c_result(convert_layout(wl, names, xyz, m->m, out_names,
+                                       out_xyz, out_origin), r);
+    }
+    catch (const std::exception &e) {
+        return c_failure(e.what(), r);
+    }
+}
+
+} // extern "C"
@@ -0,0 +1,89 @@
+#ifndef WATCOR_H
+#define WATCOR_H
+#include "model.h"
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/** \defgroup api Library interface
+ * Conversion of gro files held in memory and of atoms given as arrays, for
+ * programs linking libwatcor (a C interface is in watcor_c.h). The input
+ * is used in place: lines are never copied into strings. Errors are
+ * returned in a watcor::result; nothing is thrown but std::bad_alloc.
+ * Models are set up with the model class (see model.h); one model can be
+ * used by several conversions at the same time.
+ * @{
+ */
+
+namespace watcor {
+
+//! Outcome of a conversion
+struct result {
+    bool ok{ false };       //!< true if the conversion succeeded
+    long waters{ 0 };       //!< water molecules converted (all frames)
+    size_t atoms{ 0 };      //!< atoms per frame in the output
+    size_t bytes{ 0 };      //!< bytes of output (needed, if they did not fit)
+    size_t error_line{ 0 }; //!< line (atom) of the error from 1; 0: unknown
+    std::string error;      //!< description of the error ("" if ok)
+};
+
+//! Convert a gro file held in memory into a string
+/**
+ * \param data contents of the gro file (one or more frames)
+ * \param size number of bytes
+ * \param wm the water model to be used in the output
+ * \param[out] out the converted file (replaces the contents; its capacity
+ *     is reused)
+ * \param threads number of threads to use
+ * \return the outcome; on error out holds the output up to the error
+ */
+result convert(const char *data, size_t size, const model &wm,
+               std::string &out, int threads = 1);
+
+//! Convert a gro file held in memory into an array of the caller
+/**
+ * Same as above; if the output does not fit, the result is not ok and
+ * bytes is the size needed.
+ *
+ * \param data contents of the gro file
+ * \param size number of bytes
+ * \param wm the water model to be used in the output
+ * \param[out] out array for the converted file (not 0 terminated)
+ * \param capacity size of the array
+ * \param threads number of threads to use
+ * \return the outcome
+ */
+result convert(const char *data, size_t size, const model &wm, char *out,
+               size_t capacity, int threads = 1);
+
+//! Atoms of a system converted by convert_atoms()
+struct atom_arrays {
+    //! atom names: pointers to the input names, or to model::extra_name()
+    //! for new extra sites (valid as long as the model)
+    std::vector<const char *> names;
+    std::vector<double> xyz;    //!< coordinates (nm), x, y, z per atom
+    //! input atom each atom comes from (for extra sites: the second H)
+    std::vector<size_t> origin;
+};
+
+//! Convert the waters of a system given as arrays
+/**
+ * Waters are found by name as in a gro file (see find_waters()). The O
+ * atoms of the waters and all other atoms keep their coordinates exactly.
+ *
+ * \param n number of atoms
+ * \param names atom names
+ * \param xyz coordinates (nm), x, y, z per atom
+ * \param wm the water model to be used in the output
+ * \param[out] out the atoms after conversion (replaces the contents)
+ * \return the outcome; error_line is the number (from 1) of the O atom of
+ *     a water that cannot be converted
+ */
+result convert_atoms(size_t n, const char *const *names, const double *xyz,
+                     const model &wm, atom_arrays &out);
+
+} // namespace watcor
+
+/**@}*/
+
+#endif
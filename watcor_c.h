@@ -0,0 +1,76 @@
+#ifndef WATCOR_C_H
+#define WATCOR_C_H
+#include <stddef.h>
+
+/** \defgroup capi C interface
+ * The library interface of watcor.h for C and other languages (e.g.
+ * through ctypes or cffi). Functions return 0 on success and -1 on error;
+ * the details are in the watcor_result, which may be NULL.
+ * @{
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A water model (opaque) */
+typedef struct watcor_model watcor_model;
+
+/** Outcome of a call (see watcor::result) */
+typedef struct watcor_result {
+    int ok;            /**< 1 if the call succeeded */
+    long waters;       /**< water molecules converted (all frames) */
+    size_t atoms;      /**< atoms per frame in the output */
+    size_t bytes;      /**< bytes of output (needed, if they did not fit) */
+    size_t error_line; /**< line (atom) of the error from 1; 0: unknown */
+    char error[256];   /**< description of the error ("" if ok) */
+} watcor_result;
+
+/** Set up a model by name; NULL if the name is not known */
+watcor_model *watcor_model_new(const char *name);
+
+/** Free a model made by watcor_model_new() (NULL is allowed) */
+void watcor_model_free(watcor_model *m);
+
+/** Number of sites per water of a model */
+int watcor_model_size(const watcor_model *m);
+
+/** Add the models of a parameter file (see model::load()); not thread safe */
+int watcor_load_models(const char *file, watcor_result *r);
+
+/** Convert a gro file held in memory into an array of the caller
+ * (see watcor::convert()); if it does not fit, r->bytes is the size needed
+ */
+int watcor_convert(const watcor_model *m, const char *data, size_t size,
+                   char *out, size_t capacity, int threads,
+                   watcor_result *r);
+
+/** Convert a gro file held in memory into an array allocated by the
+ * library, to be released with watcor_free(); its size is r->bytes
+ */
+int watcor_convert_alloc(const watcor_model *m, const char *data,
+                         size_t size, char **out, int threads,
+                         watcor_result *r);
+
+/** Free an array returned by the library (NULL is allowed) */
+void watcor_free(void *p);
+
+/** Convert the waters of a system given as arrays (see
+ * watcor::convert_atoms()) into arrays of the caller with room for
+ * capacity atoms; if they do not fit, r->atoms is the number needed.
+ * out_names point to the input names or to names owned by the model;
+ * out_origin may be NULL.
+ */
+int watcor_convert_atoms(const watcor_model *m, size_t n,
+                         const char *const *names, const double *xyz,
+                         size_t capacity, const char **out_names,
+                         double *out_xyz, size_t *out_origin,
+                         watcor_result *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+/**@}*/
+
+#endif
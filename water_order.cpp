@@ -0,0 +1,194 @@
+#include "water_order.h"
+#include "gro_parse.h"
+#include "parallel.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <string>
+
+namespace {
+
+const int cell_bits{ 21 }; // per axis: keys of 63 bits
+const size_t block{ 65536 }; // waters per work item
+
+// the bits of v (21) moved to every third bit
+uint64_t spread(uint32_t v) {
+    uint64_t x{ v & 0x1fffffu };
+    x = (x | x << 32) & 0x001f00000000ffffull;
+    x = (x | x << 16) & 0x001f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+// bits of x, y and z interleaved, x the most significant of each level
+uint64_t interleave(uint32_t x, uint32_t y, uint32_t z) {
+    return spread(x) << 2 | spread(y) << 1 | spread(z);
+}
+
+// cell coordinates turned into the "transposed" Hilbert index, whose
+// interleaved bits are the position along the curve (J. Skilling,
+// Programming the Hilbert curve, AIP Conf. Proc. 707, 381 (2004))
+void hilbert_transpose(uint32_t *v) {
+    const int n{ 3 };
+    const uint32_t m{ 1u << (cell_bits - 1) };
+    for (uint32_t q = m; q > 1; q >>= 1) { // inverse undo
+        uint32_t p{ q - 1 };
+        for (int i = 0; i < n; ++i) {
+            // bit set: invert the low bits of v[0], else exchange them with
+            // those of v[i] (without branches, which would be mispredicted)
+            uint32_t set{ 0u - ((v[i] & q) != 0 ? 1u : 0u) };
+            uint32_t t{ (v[0] ^ v[i]) & p & ~set };
+            v[0] ^= (p & set) | t;
+            v[i] ^= t;
+        }
+    }
+    for (int i = 1; i < n; ++i) { v[i] ^= v[i - 1]; } // Gray encode
+    uint32_t t{ 0 };
+    for (uint32_t q = m; q > 1; q >>= 1) {
+        if (v[n - 1] & q) { t ^= q - 1; }
+    }
+    for (int i = 0; i < n; ++i) { v[i] ^= t; }
+}
+
+// a water and the position of its cell along the curve
+struct entry {
+    uint64_t key;
+    uint64_t water; // index of the water (ties keep the input order)
+    bool operator<(const entry &o) const {
+        return key < o.key || (key == o.key && water < o.water);
+    }
+};
+
+// sort in blocks on the threads, then merge pairs of runs in rounds
+void parallel_sort(std::vector<entry> &v, int threads) {
+    size_t n{ v.size() };
+    size_t nb{ std::min(static_cast<size_t>(threads), n / block + 1) };
+    size_t run{ (n + nb - 1) / nb };
+    if (run == 0) { return; }
+    parallel_for(nb, threads, [&](size_t b) {
+        auto first = v.begin() + static_cast<std::ptrdiff_t>(
+            std::min(n, b * run));
+        auto last = v.begin() + static_cast<std::ptrdiff_t>(
+            std::min(n, (b + 1) * run));
+        std::sort(first, last);
+    });
+    std::vector<entry> tmp(n);
+    for (; run < n; run *= 2) {
+        size_t pairs{ (n + 2 * run - 1) / (2 * run) };
+        parallel_for(pairs, threads, [&](size_t k) {
+            size_t a{ k * 2 * run };
+            size_t m{ std::min(n, a + run) };
+            size_t e{ std::min(n, a + 2 * run) };
+            std::merge(v.begin() + static_cast<std::ptrdiff_t>(a),
+                       v.begin() + static_cast<std::ptrdiff_t>(m),
+                       v.begin() + static_cast<std::ptrdiff_t>(m),
+                       v.begin() + static_cast<std::ptrdiff_t>(e),
+                       tmp.begin() + static_cast<std::ptrdiff_t>(a));
+        });
+        v.swap(tmp);
+    }
+}
+
+} // namespace
+
+uint64_t curve_key(space_curve c, uint32_t x, uint32_t y, uint32_t z) {
+    if (c == space_curve::hilbert) {
+        uint32_t v[3]{ x, y, z };
+        hilbert_transpose(v);
+        return interleave(v[0], v[1], v[2]);
+    }
+    return interleave(x, y, z);
+}
+
+std::vector<size_t> water_order(const text_file &lines, const water_layout &wl,
+                                space_curve c, int threads, size_t f) {
+    size_t nw{ wl.first.size() };
+    size_t nblocks{ (nw + block - 1) / block };
+
+    // O positions (Angstrom)
+    std::vector<double> pos[3];
+    for (auto &p: pos) { p.resize(nw); }
+    parallel_for(nblocks, threads, [&](size_t b) {
+        for (size_t i = b * block; i < std::min(nw, (b + 1) * block); ++i) {
+            coordinates(lines[f + 2 + wl.first[i]], pos[0][i], pos[1][i],
+                        pos[2][i]);
+        }
+    });
+
+    // the grid: the box if there is one, else the bounding box of the O
+    // atoms (positions outside the box are wrapped into it)
+    double box[9]{ 0.0 };
+    size_t box_line{ f + wl.natoms + 2 };
+    bool wrap{ box_line < lines.size()
+               && parse_box(lines[box_line], box) >= 3
+               && box[0] > 0.0 && box[1] > 0.0 && box[2] > 0.0 };
+    double lo[3]{ 0.0, 0.0, 0.0 };
+    double len[3];
+    for (int d = 0; d < 3; ++d) {
+        if (wrap) {
+            len[d] = box[d] * 10.0;
+        } else if (nw > 0) {
+            auto r = std::minmax_element(pos[d].begin(), pos[d].end());
+            lo[d] = *r.first;
+            len[d] = *r.second - *r.first;
+        }
+        if (!(len[d] > 0.0)) { len[d] = 1.0; }
+    }
+
+    const double cells{ static_cast<double>(uint32_t{ 1 } << cell_bits) };
+    std::vector<entry> keys(nw);
+    parallel_for(nblocks, threads, [&](size_t b) {
+        for (size_t i = b * block; i < std::min(nw, (b + 1) * block); ++i) {
+            uint32_t cell[3];
+            for (int d = 0; d < 3; ++d) {
+                double u{ (pos[d][i] - lo[d]) / len[d] };
+                if (wrap) { u -= std::floor(u); }
+                u = std::min(std::max(u * cells, 0.0), cells - 1.0);
+                cell[d] = static_cast<uint32_t>(u);
+            }
+            keys[i] = entry{ curve_key(c, cell[0], cell[1], cell[2]), i };
+        }
+    });
+    for (auto &p: pos) { std::vector<double>().swap(p); }
+
+    parallel_sort(keys, threads);
+    std::vector<size_t> order(nw);
+    for (size_t g = 0; g < nw; ++g) {
+        order[g] = static_cast<size_t>(keys[g].water);
+    }
+    return order;
+}
+
+void write_water_order(std::ostream &os, const water_layout &wl,
+                       const std::vector<size_t> &order,
+                       const std::vector<int> &model_sizes) {
+    os << "# new_water old_water old_first_atom new_first_atom";
+    if (model_sizes.size() > 1) { os << " (for each model)"; }
+    os << "\n";
+    std::string buf;
+    size_t before{ 0 }; // input atoms in waters before place g
+    char field[24];
+    auto put = [&](size_t v, char end) {
+        int n{ std::snprintf(field, sizeof(field), "%zu%c", v, end) };
+        buf.append(field, static_cast<size_t>(n));
+    };
+    for (size_t g = 0; g < order.size(); ++g) {
+        size_t s{ order[g] };
+        put(g + 1, ' ');
+        put(s + 1, ' ');
+        put(wl.first[s] + 1, ' ');
+        for (size_t m = 0; m < model_sizes.size(); ++m) {
+            size_t size{ static_cast<size_t>(model_sizes[m]) };
+            put(wl.first[g] - before + g * size + 1,
+                m + 1 < model_sizes.size() ? ' ' : '\n');
+        }
+        if (buf.size() >= (size_t{ 1 } << 20)) {
+            os << buf;
+            buf.clear();
+        }
+        before += wl.sites[g];
+    }
+    os << buf;
+}
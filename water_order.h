@@ -0,0 +1,73 @@
+#ifndef WATER_ORDER_H
+#define WATER_ORDER_H
+#include "gro.h"
+#include "readall.h"
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+/** \defgroup water_order Spatial order of the waters
+ * Waters sorted along a space-filling curve through the box, so that
+ * waters close in space are close in the output file (and in the memory of
+ * the program that reads it). The solute keeps its place: the waters fill
+ * the places of the waters of the input in the new order (see
+ * process_gro()).
+ *
+ * The position of a water is that of its O atom. It is wrapped into the
+ * box of the frame (its diagonal, for a triclinic box) or, if the frame has
+ * no box, taken within the bounding box of the O atoms, and mapped on a
+ * grid of 2^21 cells along each axis; the cells are ordered along a Morton
+ * (Z order) or Hilbert curve. Waters in the same cell keep their input
+ * order, so the order does not depend on the number of threads.
+ * @{
+ */
+
+//! The space-filling curve along which waters are sorted
+enum class space_curve {
+    morton,  //!< Z order: interleaved bits of the cell coordinates
+    hilbert  //!< Hilbert curve: no jumps between neighbouring cells
+};
+
+//! Position of a cell along a curve
+/**
+ * \param c the curve
+ * \param x,y,z cell coordinates (21 bits each)
+ * \return the position (63 bits)
+ */
+uint64_t curve_key(space_curve c, uint32_t x, uint32_t y, uint32_t z);
+
+//! Sort the waters of a frame along a curve
+/**
+ * \param lines the gro file
+ * \param wl the waters of the frame (see find_waters())
+ * \param c the curve
+ * \param threads number of threads to use
+ * \param f the title line of the frame
+ * \return order[g]: the water (index into wl.first) to be written in the
+ *     place of water g
+ * \throws gro_error if the coordinates of an O atom cannot be read
+ */
+std::vector<size_t> water_order(const text_file &lines, const water_layout &wl,
+                                space_curve c, int threads = 1, size_t f = 0);
+
+//! Write the permutation of the waters as a table
+/**
+ * One line for each water in output order: its place in the output and in
+ * the input, its first atom in the input and in the output of each model
+ * (all numbered from 1, atoms not wrapped), so that index or restraint
+ * files can be remapped: site k of the water (O, H1, H2) is atom first + k
+ * in both files.
+ *
+ * \param os the output stream
+ * \param wl the waters of the input frame
+ * \param order the order of the waters (see water_order())
+ * \param model_sizes number of sites of each output model
+ */
+void write_water_order(std::ostream &os, const water_layout &wl,
+                       const std::vector<size_t> &order,
+                       const std::vector<int> &model_sizes);
+
+/**@}*/
+
+#endif
@@ -0,0 +1,699 @@
+#include "xtc.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// The coordinate compression below follows xdr3dfcoord() of the xdrfile
+// library (libxdrf), step by step, so the bit streams are identical.
+
+namespace {
+
+const int xtc_magic{ 1995 };
+
+// sizes used for the small differences between consecutive atoms
+const int magicints[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0,
+    8, 10, 12, 16, 20, 25, 32, 40, 50, 64,
+    80, 101, 128, 161, 203, 256, 322, 406, 512, 645,
+    812, 1024, 1290, 1625, 2048, 2580, 3250, 4096, 5060, 6501,
+    8192, 10321, 13003, 16384, 20642, 26007, 32768, 41285, 52015, 65536,
+    82570, 104031, 131072, 165140, 208063, 262144, 330280, 416127, 524287,
+    660561, 832255, 1048576, 1321122, 1664510, 2097152, 2642245, 3329021,
+    4194304, 5284491, 6658042, 8388607, 10568983, 13316085, 16777216 };
+
+const int firstidx{ 9 }; // magicints[firstidx - 1] == 0
+const int lastidx{ static_cast<int>(sizeof(magicints) / sizeof(*magicints)) };
+
+// largest value that can be converted to int after scaling
+const float maxabs{ static_cast<float>(INT_MAX - 2) };
+
+// ---- XDR primitives (big endian) ----
+
+void put_u32(std::ostream &os, uint32_t v) {
+    unsigned char b[4]{ static_cast<unsigned char>(v >> 24),
+                        static_cast<unsigned char>(v >> 16),
+                        static_cast<unsigned char>(v >> 8),
+                        static_cast<unsigned char>(v) };
+    os.write(reinterpret_cast<const char *>(b), 4);
+}
+
+void put_int(std::ostream &os, int v) {
+    put_u32(os, static_cast<uint32_t>(v));
+}
+
+void put_float(std::ostream &os, float v) {
+    uint32_t u;
+    std::memcpy(&u, &v, 4);
+    put_u32(os, u);
+}
+
+// false at end of file (before the first byte)
+bool get_u32(std::istream &is, uint32_t &v) {
+    unsigned char b[4];
+    is.read(reinterpret_cast<char *>(b), 4);
+    if (is.gcount() == 0 && is.eof()) { return false; }
+    if (is.gcount() != 4) { throw(xtc_error("unexpected end of xtc file")); }
+    v = (uint32_t{ b[0] } << 24) | (uint32_t{ b[1] } << 16)
+        | (uint32_t{ b[2] } << 8) | uint32_t{ b[3] };
+    return true;
+}
+
+uint32_t need_u32(std::istream &is) {
+    uint32_t v;
+    if (!get_u32(is, v)) { throw(xtc_error("unexpected end of xtc file")); }
+    return v;
+}
+
+int need_int(std::istream &is) {
+    return static_cast<int>(need_u32(is));
+}
+
+float need_float(std::istream &is) {
+    uint32_t u{ need_u32(is) };
+    float v;
+    std::memcpy(&v, &u, 4);
+    return v;
+}
+
+// ---- bit streams ----
+
+// writes bits, most significant first, into a growing byte buffer
+class bit_writer {
+public:
+    explicit bit_writer(std::vector<unsigned char> &b) : buf(b) {
+        buf.clear();
+        buf.push_back(0);
+    }
+
+    void send(int nbits, unsigned num) {
+        num &= mask(nbits);
+        while (nbits >= 8) {
+            lastbyte = (lastbyte << 8) | (num >> (nbits - 8));
+            put(static_cast<unsigned char>(lastbyte >> lastbits));
+            nbits -= 8;
+        }
+        if (nbits > 0) {
+            lastbyte = (lastbyte << nbits) | num;
+            lastbits += nbits;
+            if (lastbits >= 8) {
+                lastbits -= 8;
+                put(static_cast<unsigned char>(lastbyte >> lastbits));
+            }
+        }
+        if (lastbits > 0) { // partly filled last byte
+            buf[cnt] = static_cast<unsigned char>(lastbyte << (8 - lastbits));
+        }
+    }
+
+    // pack the numbers nums[i] < sizes[i] as one number of nbits bits
+    void send_ints(int nbits, const unsigned sizes[3], const unsigned nums[3]) {
+        unsigned bytes[32];
+        int nbytes{ 0 };
+        unsigned tmp{ nums[0] };
+        do {
+            bytes[nbytes++] = tmp & 0xff;
+            tmp >>= 8;
+        } while (tmp != 0);
+
+        for (int i = 1; i < 3; ++i) {
+            if (nums[i] >= sizes[i]) {
+                throw(xtc_error("coordinate out of range in compression"));
+            }
+            // one step multiply
+            tmp = nums[i];
+            int bytecnt;
+            for (bytecnt = 0; bytecnt < nbytes; ++bytecnt) {
+                tmp = bytes[bytecnt] * sizes[i] + tmp;
+                bytes[bytecnt] = tmp & 0xff;
+                tmp >>= 8;
+            }
+            while (tmp != 0) {
+                bytes[bytecnt++] = tmp & 0xff;
+                tmp >>= 8;
+            }
+            nbytes = bytecnt;
+        }
+        if (nbits >= nbytes * 8) {
+            for (int i = 0; i < nbytes; ++i) { send(8, bytes[i]); }
+            send(nbits - nbytes * 8, 0);
+        } else {
+            for (int i = 0; i < nbytes - 1; ++i) { send(8, bytes[i]); }
+            send(nbits - (nbytes - 1) * 8, bytes[nbytes - 1]);
+        }
+    }
+
+    // number of bytes used (including a partly filled one)
+    size_t size() const { return cnt + (lastbits > 0 ? 1 : 0); }
+
+private:
+    std::vector<unsigned char> &buf;
+    size_t cnt{ 0 };        // number of complete bytes
+    int lastbits{ 0 };      // bits used in the last byte
+    unsigned lastbyte{ 0 }; // bits not yet complete to a byte
+
+    static unsigned mask(int nbits) {
+        return static_cast<unsigned>((uint64_t{ 1 } << nbits) - 1);
+    }
+    void put(unsigned char c) {
+        buf[cnt++] = c;
+        if (cnt >= buf.size()) { buf.resize(2 * buf.size()); }
+    }
+};
+
+// reads bits written by bit_writer
+class bit_reader {
+public:
+    bit_reader(const unsigned char *b, size_t n) : buf(b), size(n) {}
+
+    unsigned receive(int nbits) {
+        unsigned mask{ static_cast<unsigned>((uint64_t{ 1 } << nbits) - 1) };
+        unsigned num{ 0 };
+        while (nbits >= 8) {
+            lastbyte = (lastbyte << 8) | next();
+            num |= (lastbyte >> lastbits) << (nbits - 8);
+            nbits -= 8;
+        }
+        if (nbits > 0) {
+            if (lastbits < static_cast<unsigned>(nbits)) {
+                lastbits += 8;
+                lastbyte = (lastbyte << 8) | next();
+            }
+            lastbits -= nbits;
+            num |= (lastbyte >> lastbits) & ((1u << nbits) - 1);
+        }
+        return num & mask;
+    }
+
+    // unpack numbers packed by bit_writer::send_ints()
+    void receive_ints(int nbits, const unsigned sizes[3], int nums[3]) {
+        unsigned bytes[32];
+        int nbytes{ 0 };
+        bytes[0] = bytes[1] = bytes[2] = bytes[3] = 0;
+        while (nbits > 8) {
+            bytes[nbytes++] = receive(8);
+            nbits -= 8;
+        }
+        if (nbits > 0) { bytes[nbytes++] = receive(nbits); }
+        for (int i = 2; i > 0; --i) {
+            unsigned num{ 0 };
+            for (int j = nbytes - 1; j >= 0; --j) {
+                num = (num << 8) | bytes[j];
+                unsigned p{ num / sizes[i] };
+                bytes[j] = p;
+                num = num - p * sizes[i];
+            }
+            nums[i] = static_cast<int>(num);
+        }
+        nums[0] = static_cast<int>(bytes[0] | (bytes[1] << 8)
+                                   | (bytes[2] << 16) | (bytes[3] << 24));
+    }
+
+private:
+    const unsigned char *buf;
+    size_t size;
+    size_t cnt{ 0 };
+    unsigned lastbits{ 0 };
+    unsigned lastbyte{ 0 };
+
+    unsigned next() {
+        if (cnt >= size) {
+            throw(xtc_error("corrupt compressed coordinates in xtc file"));
+        }
+        return buf[cnt++];
+    }
+};
+
+// number of bits needed for values 0 .. size - 1 (xdrfile's sizeofint)
+int sizeofint(unsigned size) {
+    uint64_t num{ 1 };
+    int nbits{ 0 };
+    while (size >= num && nbits < 32) {
+        ++nbits;
+        num <<= 1;
+    }
+    return nbits;
+}
+
+// number of bits needed for the product of three sizes
+int sizeofints(const unsigned sizes[3]) {
+    unsigned bytes[32];
+    unsigned nbytes{ 1 };
+    bytes[0] = 1;
+    for (int i = 0; i < 3; ++i) {
+        unsigned tmp{ 0 };
+        unsigned bytecnt;
+        for (bytecnt = 0; bytecnt < nbytes; ++bytecnt) {
+            tmp = bytes[bytecnt] * sizes[i] + tmp;
+            bytes[bytecnt] = tmp & 0xff;
+            tmp >>= 8;
+        }
+        while (tmp != 0) {
+            bytes[bytecnt++] = tmp & 0xff;
+            tmp >>= 8;
+        }
+        nbytes = bytecnt;
+    }
+    unsigned num{ 1 };
+    int nbits{ 0 };
+    --nbytes;
+    while (bytes[nbytes] >= num) {
+        ++nbits;
+        num *= 2;
+    }
+    return nbits + static_cast<int>(nbytes) * 8;
+}
+
+// sizes of the integer coordinate ranges and the bits needed for them
+struct coord_range {
+    int minint[3];
+    int maxint[3];
+    unsigned sizeint[3];
+    int bitsizeint[3];
+    int bitsize; // 0: each coordinate on its own (bitsizeint)
+
+    void setup() {
+        for (int k = 0; k < 3; ++k) {
+            sizeint[k] = static_cast<unsigned>(maxint[k])
+                         - static_cast<unsigned>(minint[k]) + 1;
+        }
+        // check if one of the sizes is too big to be multiplied
+        if ((sizeint[0] | sizeint[1] | sizeint[2]) > 0xffffff) {
+            for (int k = 0; k < 3; ++k) {
+                bitsizeint[k] = sizeofint(sizeint[k]);
+            }
+            bitsize = 0;
+        } else {
+            bitsize = sizeofints(sizeint);
+        }
+    }
+};
+
+inline int iabs(int v) { return v < 0 ? -v : v; }
+
+// compress n atoms (ip: integer coordinates, changed) into buf
+// returns the number of bytes
+size_t compress(int *ip, int n, const coord_range &r, int mindiff,
+                int &smallidx_out, std::vector<unsigned char> &buf) {
+    bit_writer bw{ buf };
+    buf.resize(static_cast<size_t>(n) * 16 + 64);
+
+    int smallidx{ firstidx };
+    while (smallidx < lastidx && magicints[smallidx] < mindiff) {
+        ++smallidx;
+    }
+    smallidx_out = smallidx;
+
+    int maxidx{ std::min(lastidx, smallidx + 8) };
+    int minidx{ maxidx - 8 }; // often this equal smallidx
+    int smaller{ magicints[std::max(firstidx, smallidx - 1)] / 2 };
+    int smallnum{ magicints[smallidx] / 2 };
+    unsigned sizesmall[3];
+    sizesmall[0] = sizesmall[1] = sizesmall[2] = magicints[smallidx];
+    int larger{ magicints[std::min(maxidx, lastidx - 1)] / 2 };
+
+    int prevcoord[3]{ 0, 0, 0 };
+    unsigned tmpcoord[30];
+    int prevrun{ -1 };
+    int i{ 0 };
+    while (i < n) {
+        int is_small{ 0 };
+        int is_smaller;
+        int *thiscoord{ ip + i * 3 };
+        if (smallidx < maxidx && i >= 1
+            && iabs(thiscoord[0] - prevcoord[0]) < larger
+            && iabs(thiscoord[1] - prevcoord[1]) < larger
+            && iabs(thiscoord[2] - prevcoord[2]) < larger) {
+            is_smaller = 1;
+        } else if (smallidx > minidx) {
+            is_smaller = -1;
+        } else {
+            is_smaller = 0;
+        }
+        if (i + 1 < n) {
+            if (iabs(thiscoord[0] - thiscoord[3]) < smallnum
+                && iabs(thiscoord[1] - thiscoord[4]) < smallnum
+                && iabs(thiscoord[2] - thiscoord[5]) < smallnum) {
+                // interchange first with second atom for better
+                // compression of water molecules
+                std::swap(thiscoord[0], thiscoord[3]);
+                std::swap(thiscoord[1], thiscoord[4]);
+                std::swap(thiscoord[2], thiscoord[5]);
+                is_small = 1;
+            }
+        }
+        for (int k = 0; k < 3; ++k) {
+            tmpcoord[k] = static_cast<unsigned>(thiscoord[k])
+                          - static_cast<unsigned>(r.minint[k]);
+        }
+        if (r.bitsize == 0) {
+            for (int k = 0; k < 3; ++k) {
+                bw.send(r.bitsizeint[k], tmpcoord[k]);
+            }
+        } else {
+            bw.send_ints(r.bitsize, r.sizeint, tmpcoord);
+        }
+        for (int k = 0; k < 3; ++k) { prevcoord[k] = thiscoord[k]; }
+        thiscoord += 3;
+        ++i;
+
+        int run{ 0 };
+        if (is_small == 0 && is_smaller == -1) { is_smaller = 0; }
+        while (is_small && run < 8 * 3) {
+            if (is_smaller == -1) {
+                long long dx{ thiscoord[0] - prevcoord[0] };
+                long long dy{ thiscoord[1] - prevcoord[1] };
+                long long dz{ thiscoord[2] - prevcoord[2] };
+                if (dx*dx + dy*dy + dz*dz
+                    >= static_cast<long long>(smaller) * smaller) {
+                    is_smaller = 0;
+                }
+            }
+            for (int k = 0; k < 3; ++k) {
+                tmpcoord[run++] = static_cast<unsigned>(thiscoord[k]
+                                  - prevcoord[k] + smallnum);
+                prevcoord[k] = thiscoord[k];
+            }
+            ++i;
+            thiscoord += 3;
+            is_small = 0;
+            if (i < n
+                && iabs(thiscoord[0] - prevcoord[0]) < smallnum
+                && iabs(thiscoord[1] - prevcoord[1]) < smallnum
+                && iabs(thiscoord[2] - prevcoord[2]) < smallnum) {
+                is_small = 1;
+            }
+        }
+        if (run != prevrun || is_smaller != 0) {
+            prevrun = run;
+            bw.send(1, 1); // flag the change in run-length
+            bw.send(5, static_cast<unsigned>(run + is_smaller + 1));
+        } else {
+            bw.send(1, 0); // run-length did not change
+        }
+        for (int k = 0; k < run; k += 3) {
+            bw.send_ints(smallidx, sizesmall, &tmpcoord[k]);
+        }
+        if (is_smaller != 0) {
+            smallidx += is_smaller;
+            if (is_smaller < 0) {
+                smallnum = smaller;
+                smaller = smallidx > firstidx ? magicints[smallidx - 1] / 2 : 0;
+            } else {
+                smaller = smallnum;
+                smallnum = magicints[smallidx] / 2;
+            }
+            sizesmall[0] = sizesmall[1] = sizesmall[2] = magicints[smallidx];
+        }
+    }
+    return bw.size();
+}
+
+// decompress n atoms into x, using precision
+void decompress(const unsigned char *data, size_t nbytes, int n,
+                const coord_range &r, int smallidx, float precision,
+                std::vector<int> &ip, float *x) {
+    if (smallidx < firstidx || smallidx >= lastidx) {
+        throw(xtc_error("corrupt compressed coordinates in xtc file"));
+    }
+    bit_reader br{ data, nbytes };
+    ip.resize(static_cast<size_t>(n) * 3 + 3 * 8);
+
+    int smaller{ magicints[std::max(firstidx, smallidx - 1)] / 2 };
+    int smallnum{ magicints[smallidx] / 2 };
+    unsigned sizesmall[3];
+    sizesmall[0] = sizesmall[1] = sizesmall[2] = magicints[smallidx];
+
+    float inv_precision{ 1.0f / precision };
+    float *lfp{ x };
+    float *end{ x + static_cast<size_t>(n) * 3 };
+    int prevcoord[3];
+    int run{ 0 };
+    int i{ 0 };
+    while (i < n) {
+        int *thiscoord{ &ip[static_cast<size_t>(i) * 3] };
+        if (r.bitsize == 0) {
+            for (int k = 0; k < 3; ++k) {
+                thiscoord[k] = static_cast<int>(br.receive(r.bitsizeint[k]));
+            }
+        } else {
+            br.receive_ints(r.bitsize, r.sizeint, thiscoord);
+        }
+        ++i;
+        for (int k = 0; k < 3; ++k) {
+            thiscoord[k] = static_cast<int>(static_cast<unsigned>(thiscoord[k])
+                           + static_cast<unsigned>(r.minint[k]));
+            prevcoord[k] = thiscoord[k];
+        }
+
+        int is_smaller{ 0 };
+        if (br.receive(1) == 1) {
+            run = static_cast<int>(br.receive(5));
+            is_smaller = run % 3;
+            run -= is_smaller;
+            --is_smaller;
+        }
+        if (lfp + 3 + run > end) {
+            throw(xtc_error("corrupt compressed coordinates in xtc file"));
+        }
+        if (run > 0) {
+            thiscoord += 3;
+            for (int k = 0; k < run; k += 3) {
+                br.receive_ints(smallidx, sizesmall, thiscoord);
+                ++i;
+                for (int d = 0; d < 3; ++d) {
+                    thiscoord[d] += prevcoord[d] - smallnum;
+                }
+                if (k == 0) {
+                    // interchange first with second atom for better
+                    // compression of water molecules
+                    for (int d = 0; d < 3; ++d) {
+                        std::swap(thiscoord[d], prevcoord[d]);
+                    }
+                    for (int d = 0; d < 3; ++d) {
+                        *lfp++ = prevcoord[d] * inv_precision;
+                    }
+                } else {
+                    for (int d = 0; d < 3; ++d) { prevcoord[d] = thiscoord[d]; }
+                }
+                for (int d = 0; d < 3; ++d) {
+                    *lfp++ = thiscoord[d] * inv_precision;
+                }
+            }
+        } else {
+            for (int d = 0; d < 3; ++d) {
+                *lfp++ = thiscoord[d] * inv_precision;
+            }
+        }
+        smallidx += is_smaller;
+        if (smallidx < firstidx || smallidx >= lastidx) {
+            throw(xtc_error("corrupt compressed coordinates in xtc file"));
+        }
+        if (is_smaller < 0) {
+            smallnum = smaller;
+            smaller = smallidx > firstidx ? magicints[smallidx - 1] / 2 : 0;
+        } else if (is_smaller > 0) {
+            smaller = smallnum;
+            smallnum = magicints[smallidx] / 2;
+        }
+        sizesmall[0] = sizesmall[1] = sizesmall[2] = magicints[smallidx];
+    }
+}
+
+} // namespace
+
+bool xtc_reader::read(xtc_frame &f) {
+    uint32_t magic;
+    if (!get_u32(inp, magic)) { return false; }
+    if (static_cast<int>(magic) != xtc_magic) {
+        throw(xtc_error("not an xtc file (bad magic number)"));
+    }
+    f.natoms = need_int(inp);
+    f.step = need_int(inp);
+    f.time = need_float(inp);
+    for (auto &b: f.box) { b = need_float(inp); }
+    int n{ need_int(inp) };
+    if (n != f.natoms || n < 0) {
+        throw(xtc_error("inconsistent atom count in xtc file"));
+    }
+    f.x.resize(static_cast<size_t>(n) * 3);
+
+    if (n <= 9) { // stored uncompressed
+        f.precision = -1.0f;
+        for (auto &v: f.x) { v = need_float(inp); }
+        return true;
+    }
+
+    f.precision = need_float(inp);
+    if (!(f.precision > 0.0f)) {
+        throw(xtc_error("bad precision in xtc file"));
+    }
+    coord_range r;
+    for (auto &m: r.minint) { m = need_int(inp); }
+    for (auto &m: r.maxint) { m = need_int(inp); }
+    r.setup();
+    int smallidx{ need_int(inp) };
+    uint32_t nbytes{ need_u32(inp) };
+    size_t padded{ (static_cast<size_t>(nbytes) + 3) / 4 * 4 };
+    buf.resize(padded + 1);
+    inp.read(reinterpret_cast<char *>(buf.data()),
+             static_cast<std::streamsize>(padded));
+    if (static_cast<size_t>(inp.gcount()) != padded) {
+        throw(xtc_error("unexpected end of xtc file"));
+    }
+    decompress(buf.data(), nbytes, n, r, smallidx, f.precision, ints,
+               f.x.data());
+    return true;
+}
+
+void xtc_writer::write(const xtc_frame &f) {
+    int n{ f.natoms };
+    put_int(out, xtc_magic);
+    put_int(out, n);
+    put_int(out, f.step);
+    put_float(out, f.time);
+    for (auto b: f.box) { put_float(out, b); }
+    put_int(out, n);
+
+    if (n <= 9) { // too small to compress
+        for (int i = 0; i < 3 * n; ++i) { put_float(out, f.x[i]); }
+        return;
+    }
+
+    float precision{ f.precision > 0.0f ? f.precision : 1000.0f };
+    put_float(out, precision);
+
+    // integer coordinates, their range and the smallest step between atoms
+    coord_range r;
+    for (int k = 0; k < 3; ++k) {
+        r.minint[k] = INT_MAX;
+        r.maxint[k] = INT_MIN;
+    }
+    ints.resize(static_cast<size_t>(n) * 3 + 3);
+    int mindiff{ INT_MAX };
+    int old[3]{ 0, 0, 0 };
+    for (int i = 0; i < n; ++i) {
+        long long diff{ 0 };
+        for (int k = 0; k < 3; ++k) {
+            float v{ f.x[static_cast<size_t>(i) * 3 + k] };
+            // nearest integer, as computed by xdrfile
+            float prod{ v * precision };
+            float lf{ v >= 0.0f ? static_cast<float>(prod + 0.5)
+                                : static_cast<float>(prod - 0.5) };
+            if (!(std::fabs(lf) <= maxabs)) {
+                throw(xtc_error("coordinates too large to compress"));
+            }
+            int li{ static_cast<int>(lf) };
+            r.minint[k] = std::min(r.minint[k], li);
+            r.maxint[k] = std::max(r.maxint[k], li);
+            ints[static_cast<size_t>(i) * 3 + k] = li;
+            diff += std::llabs(static_cast<long long>(old[k]) - li);
+            old[k] = li;
+        }
+        if (i > 0 && diff < mindiff) { mindiff = static_cast<int>(diff); }
+    }
+    for (int k = 0; k < 3; ++k) {
+        if (static_cast<float>(r.maxint[k]) - static_cast<float>(r.minint[k])
+            >= maxabs) {
+            throw(xtc_error("coordinates too large to compress"));
+        }
+    }
+    for (auto m: r.minint) { put_int(out, m); }
+    for (auto m: r.maxint) { put_int(out, m); }
+    r.setup();
+
+    int smallidx;
+    size_t nbytes{ compress(ints.data(), n, r, mindiff, smallidx, buf) };
+    put_int(out, smallidx);
+    put_int(out, static_cast<int>(nbytes));
+    size_t padded{ (nbytes + 3) / 4 * 4 };
+    buf.resize(std::max(buf.size(), padded));
+    std::memset(buf.data() + nbytes, 0, padded - nbytes);
+    out.write(reinterpret_cast<const char *>(buf.data()),
+              static_cast<std::streamsize>(padded));
+}
+
+long process_xtc(std::ostream &os, std::istream &is, const water_layout &wl,
+                 const model &wm) {
+    int model_size{ wm.size() };
+    size_t nw{ wl.first.size() };
+    size_t nout{ wl.output_atoms(model_size) };
+    if (nout > static_cast<size_t>(INT_MAX)) {
+        throw(xtc_error("too many atoms for an xtc file"));
+    }
+
+    xtc_reader reader{ is };
+    xtc_writer writer{ os };
+    xtc_frame in;
+    xtc_frame out;
+    out.natoms = static_cast<int>(nout);
+    out.x.resize(nout * 3);
+
+    // coordinates of the waters (Angstrom), structure of arrays
+    std::vector<double> xyz[9];
+    std::vector<double> ext[3 * max_extra_sites];
+    for (auto &v: xyz) { v.resize(nw); }
+    for (int k = 0; k < 3 * (model_size - 3); ++k) { ext[k].resize(nw); }
+    std::vector<unsigned char> bad(nw);
+
+    long frames{ 0 };
+    while (reader.read(in)) {
+        if (static_cast<size_t>(in.natoms) != wl.natoms) {
+            throw(xtc_error("frame at step " + std::to_string(in.step)
+                            + " has " + std::to_string(in.natoms)
+                            + " atoms, reference structure has "
+                            + std::to_string(wl.natoms)));
+        }
+
+        // idealise all waters of the frame in one batch
+        for (size_t j = 0; j < nw; ++j) {
+            const float *p{ &in.x[wl.first[j] * 3] };
+            for (int k = 0; k < 9; ++k) { xyz[k][j] = p[k] * 10.0; }
+        }
+        if (nw > 0) {
+            site_arrays O{ &xyz[0][0], &xyz[1][0], &xyz[2][0] };
+            site_arrays H1{ &xyz[3][0], &xyz[4][0], &xyz[5][0] };
+            site_arrays H2{ &xyz[6][0], &xyz[7][0], &xyz[8][0] };
+            site_arrays extra[max_extra_sites];
+            for (int k = 0; k < max_extra_sites; ++k) {
+                extra[k] = site_arrays{ ext[3*k].data(), ext[3*k+1].data(),
+                                         ext[3*k+2].data() };
+            }
+            if (wm.transform(nw, O, H1, H2, extra, bad.data()) > 0) {
+                throw(std::runtime_error("bad input water structure "
+                      "in frame at step " + std::to_string(in.step)));
+            }
+        }
+
+        // assemble the new frame: other atoms copied, waters replaced
+        float *q{ out.x.data() };
+        size_t j{ 0 }; // next water
+        size_t i{ 0 }; // next input atom
+        while (i < wl.natoms) {
+            if (j < nw && i == wl.first[j]) {
+                for (int k = 0; k < 9; ++k) {
+                    *q++ = static_cast<float>(xyz[k][j] / 10.0);
+                }
+                for (int k = 0; k < 3 * (model_size - 3); ++k) {
+                    *q++ = static_cast<float>(ext[k][j] / 10.0);
+                }
+                i += static_cast<size_t>(wl.sites[j]);
+                ++j;
+            } else {
+                for (int k = 0; k < 3; ++k) { *q++ = in.x[i * 3 + k]; }
+                ++i;
+            }
+        }
+
+        out.step = in.step;
+        out.time = in.time;
+        std::memcpy(out.box, in.box, sizeof(out.box));
+        out.precision = in.precision;
+        writer.write(out);
+        if (!os) { throw(xtc_error("error writing xtc file")); }
+        ++frames;
+    }
+    return frames;
+}
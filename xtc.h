@@ -0,0 +1,100 @@
+#ifndef XTC_H
+#define XTC_H
+#include "gro.h"
+#include "model.h"
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/** \defgroup xtc XTC trajectories
+ * Reading and writing of Gromacs .xtc files (XDR, compressed coordinates),
+ * without any Gromacs library. The coordinate compression is that of the
+ * xdrfile library, so the files can be used with all Gromacs versions.
+ * @{
+ */
+
+//! Exception class to reflect error in reading or writing an xtc file
+class xtc_error: public std::runtime_error {
+public:
+    //! Constructor of xtc_error class
+    /**
+     * \param msg description of the error
+     */
+    explicit xtc_error(const std::string & msg) : std::runtime_error(msg) {}
+};
+
+//! One frame of an xtc trajectory
+struct xtc_frame {
+    int natoms{ 0 };          //!< number of atoms
+    int step{ 0 };            //!< MD step
+    float time{ 0.0f };       //!< time (ps)
+    float box[9]{};           //!< box vectors (nm), one after the other
+    float precision{ -1.0f }; //!< 1/precision of coordinates (nm); -1: none
+    std::vector<float> x{};   //!< coordinates (nm), x y z of each atom
+};
+
+//! Reads frames from an xtc file
+class xtc_reader {
+public:
+    //! \param is the input, opened in binary mode
+    explicit xtc_reader(std::istream &is) : inp(is) {}
+
+    //! read the next frame
+    /**
+     * \param[out] f the frame
+     * \return false at the end of the file
+     * \throws xtc_error if the file is not a valid xtc file
+     */
+    bool read(xtc_frame &f);
+
+private:
+    std::istream &inp;
+    std::vector<unsigned char> buf{}; //!< compressed coordinates
+    std::vector<int> ints{};          //!< integer coordinates
+};
+
+//! Writes frames to an xtc file
+class xtc_writer {
+public:
+    //! \param os the output, opened in binary mode
+    explicit xtc_writer(std::ostream &os) : out(os) {}
+
+    //! write a frame
+    /**
+     * Frames with more than 9 atoms are compressed; if the frame has no
+     * precision, 1000 is used (i.e. coordinates rounded to 0.001 nm).
+     *
+     * \param f the frame
+     * \throws xtc_error if the coordinates are too large to compress
+     */
+    void write(const xtc_frame &f);
+
+private:
+    std::ostream &out;
+    std::vector<unsigned char> buf{}; //!< compressed coordinates
+    std::vector<int> ints{};          //!< integer coordinates
+};
+
+//! Convert the water molecules in all frames of an xtc trajectory
+/**
+ *  The water molecules are taken from a reference structure with the same
+ *  atoms (see find_waters()); in each frame they are changed as by
+ *  process_gro() and written with the precision of the input frame.
+ *
+ *  \param os the output xtc file, opened in binary mode
+ *  \param is the input xtc file, opened in binary mode
+ *  \param wl the water molecules in the reference structure
+ *  \param wm the water model to be used in the output
+ *  \return the number of frames converted
+ *  \throws xtc_error if the trajectory cannot be read or written or does
+ *      not match the reference structure
+ *  \throws std::runtime_error for a bad water structure
+ */
+long process_xtc(std::ostream &os, std::istream &is, const water_layout &wl,
+                 const model &wm);
+
+/**@}*/
+
+#endif